@@ -0,0 +1,334 @@
+/*
+ *  bench.c
+ *
+ *  Microbenchmarks for cower's CPU bound paths: JSON parsing, PKGBUILD
+ *  scanning, comment extraction, filtering and rendering. cower.c is built
+ *  in whole (minus its main) so that static functions are reachable, and
+ *  each benchmark runs against a fixture from bench/fixtures.
+ *
+ *  For every benchmark, the time per op, allocations per op and, where an
+ *  op consumes a fixture, throughput are reported.
+ */
+
+#define main cower_main
+#include "../cower.c"
+#undef main
+
+#include <fcntl.h>
+
+#define BENCH_FIXTURES  "fixtures/"
+#define BENCH_MIN_MS    250.0
+#define BENCH_CHUNK     16384
+#define BENCH_FORMAT    "%n %v\t%-24d|%u %l %o %p %t %c%D\n"
+
+struct bench_t {
+  const char *name;
+  const char *fixture;
+  void (*setup)(void);
+  void (*run)(char*, size_t);
+};
+
+/* scratch space for the functions which work in place, the packages from
+ * the search fixture, and a count of every allocation made */
+static char *scratch;
+static alpm_list_t *packages;
+static unsigned long allocs;
+
+/* allocation counting {{{ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void*, size_t);
+extern void __libc_free(void*);
+
+void *malloc(size_t size) {
+  allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  allocs++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+/* }}} */
+
+static alpm_list_t *bench_parse_json(const char *data, size_t len) { /* {{{ */
+  struct yajl_parser_t parse_struct;
+
+  memset(&parse_struct, 0, sizeof parse_struct);
+  parse_struct.handle = yajl_alloc(&callbacks, NULL, &parse_struct);
+  yajl_parse(parse_struct.handle, (const unsigned char*)data, len);
+  yajl_complete_parse(parse_struct.handle);
+  yajl_free(parse_struct.handle);
+
+  return parse_struct.pkglist;
+} /* }}} */
+
+static void bench_free_packages(alpm_list_t *list) { /* {{{ */
+  alpm_list_free_inner(list, aurpkg_free);
+  alpm_list_free(list);
+} /* }}} */
+
+/* benchmarks {{{ */
+static void run_json(char *data, size_t len) {
+  bench_free_packages(bench_parse_json(data, len));
+}
+
+static void run_pkgbuild(char *data, size_t len) {
+  alpm_list_t *depends = NULL, *makedepends = NULL, *optdepends = NULL;
+  alpm_list_t *provides = NULL, *conflicts = NULL, *replaces = NULL;
+  alpm_list_t **details[PKGDETAIL_MAX] = {
+    &depends, &makedepends, &optdepends, &provides, &conflicts, &replaces
+  };
+
+  memcpy(scratch, data, len + 1);
+  pkgbuild_get_extinfo(scratch, details);
+
+  FREELIST(depends);
+  FREELIST(makedepends);
+  FREELIST(optdepends);
+  FREELIST(provides);
+  FREELIST(conflicts);
+  FREELIST(replaces);
+}
+
+static void run_html_decode(char *data, size_t len) {
+  struct html_decoder_t decoder;
+
+  html_decode_init(&decoder, scratch);
+  html_decode(&decoder, data, len);
+  html_decode_finish(&decoder);
+}
+
+static void run_comments(char *data, size_t len) {
+  struct comment_parser_t parser;
+  size_t off, chunk;
+
+  memset(&parser, 0, sizeof parser);
+
+  /* delivered in pieces, the way curl would */
+  for (off = 0; off < len; off += chunk) {
+    chunk = len - off < BENCH_CHUNK ? len - off : BENCH_CHUNK;
+    curl_write_comments(data + off, 1, chunk, &parser);
+  }
+
+  free(parser.pending);
+  FREELIST(parser.comments);
+}
+
+static void setup_filter(void) {
+  cfg.opmask = OP_SEARCH;
+  cfg.targets = alpm_list_add(NULL, strdup("[a-z]"));
+}
+
+static void run_filter(char *data, size_t len) {
+  (void)data; (void)len;
+
+  /* every package matches, so the list comes back whole */
+  packages = filter_results(packages);
+}
+
+static void setup_formatted(void) {
+  format_free();
+  format_compile(BENCH_FORMAT);
+}
+
+static void run_formatted(char *data, size_t len) {
+  const alpm_list_t *i;
+
+  (void)data; (void)len;
+
+  for (i = packages; i; i = alpm_list_next(i)) {
+    print_pkg_formatted(alpm_list_getdata(i));
+  }
+  outbuf.len = 0;
+}
+
+static void setup_notty(void) {
+  termwidth_stale = 1;
+  getcols();
+}
+
+/* getcols only asks the terminal, so give it one */
+static void setup_tty(void) {
+  struct winsize win = { .ws_row = 24, .ws_col = 80 };
+  int pty, saved;
+
+  pty = posix_openpt(O_RDWR|O_NOCTTY);
+  if (pty < 0 || grantpt(pty) != 0 || unlockpt(pty) != 0) {
+    fprintf(stderr, "warning: no pty available, indentprint won't wrap\n");
+    return;
+  }
+  ioctl(pty, TIOCSWINSZ, &win);
+
+  saved = dup(STDOUT_FILENO);
+  dup2(pty, STDOUT_FILENO);
+  termwidth_stale = 1;
+  getcols();
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(pty);
+}
+
+static void run_indentprint(char *data, size_t len) {
+  const alpm_list_t *i;
+
+  (void)data; (void)len;
+
+  for (i = packages; i; i = alpm_list_next(i)) {
+    struct aurpkg_t *pkg = alpm_list_getdata(i);
+    indentprint(pkg->desc, 17);
+  }
+  outbuf.len = 0;
+}
+/* }}} */
+
+static struct bench_t benchmarks[] = {
+  {"json/search",        "rpc-search.json",              NULL,            run_json},
+  {"json/info",          "rpc-info.json",                NULL,            run_json},
+  {"pkgbuild/simple",    "pkgbuild/simple",              NULL,            run_pkgbuild},
+  {"pkgbuild/large",     "pkgbuild/large",               NULL,            run_pkgbuild},
+  {"pkgbuild/wide",      "pkgbuild/pathological-wide",   NULL,            run_pkgbuild},
+  {"pkgbuild/tall",      "pkgbuild/pathological-tall",   NULL,            run_pkgbuild},
+  {"pkgbuild/nested",    "pkgbuild/pathological-nested", NULL,            run_pkgbuild},
+  {"html/decode",        "comments.html",                NULL,            run_html_decode},
+  {"html/comments",      "comments.html",                NULL,            run_comments},
+  {"filter/search",      NULL,                           setup_filter,    run_filter},
+  {"print/formatted",    NULL,                           setup_formatted, run_formatted},
+  {"print/indent-notty", NULL,                           setup_notty,     run_indentprint},
+  {"print/indent-tty",   NULL,                           setup_tty,       run_indentprint},
+  {NULL, NULL, NULL, NULL}
+};
+
+static char *read_fixture(const char *name, size_t *len) { /* {{{ */
+  char *path, *data = NULL;
+  struct stat st;
+  FILE *fp;
+
+  cwr_asprintf(&path, BENCH_FIXTURES "%s", name);
+  fp = fopen(path, "r");
+  if (!fp || fstat(fileno(fp), &st) != 0) {
+    fprintf(stderr, "error: failed to open %s: %s\n", path, strerror(errno));
+    goto finish;
+  }
+
+  data = malloc(st.st_size + 1);
+  *len = fread(data, 1, st.st_size, fp);
+  data[*len] = '\0';
+
+finish:
+  if (fp) {
+    fclose(fp);
+  }
+  free(path);
+  return data;
+} /* }}} */
+
+/**
+ * Runs a benchmark with doubling iteration counts until one round takes
+ * long enough to be trusted, and reports on that round.
+ */
+static int run_benchmark(const struct bench_t *bench, FILE *report) { /* {{{ */
+  char *data = NULL;
+  size_t len = 0, n, iterations;
+  unsigned long startallocs;
+  double start, elapsed;
+
+  if (bench->fixture && !(data = read_fixture(bench->fixture, &len))) {
+    return 1;
+  }
+  scratch = realloc(scratch, len + 1);
+
+  if (bench->setup) {
+    bench->setup();
+  }
+
+  for (iterations = 1; ; iterations *= 2) {
+    startallocs = allocs;
+    start = now_ms();
+    for (n = 0; n < iterations; n++) {
+      bench->run(data, len);
+    }
+    elapsed = now_ms() - start;
+    if (elapsed >= BENCH_MIN_MS) {
+      break;
+    }
+  }
+
+  fprintf(report, "%-30s %12.0f ns/op %10.1f allocs/op", bench->name,
+      elapsed * 1e6 / iterations, (double)(allocs - startallocs) / iterations);
+  if (len) {
+    fprintf(report, " %10.2f MB/s", len * iterations / (elapsed / 1000) / 1e6);
+  }
+  fputc('\n', report);
+  fflush(report);
+
+  free(data);
+  return 0;
+} /* }}} */
+
+int main(int argc, char *argv[]) {
+  const struct bench_t *bench;
+  FILE *report;
+  char *corpus;
+  size_t len;
+  int devnull, ret = 0;
+
+  memset(&cfg, 0, sizeof cfg);
+  cfg.delim = LIST_DELIM;
+  cfg.logmask = LOG_ERROR|LOG_WARN;
+  cfg.proto = "https";
+  cfg.aurhost = strdup(AUR_HOST_DEFAULT);
+  strings_init();
+
+  /* the packages from the search fixture feed the filter and print
+   * benchmarks */
+  corpus = read_fixture("rpc-search.json", &len);
+  if (!corpus) {
+    return 1;
+  }
+  packages = bench_parse_json(corpus, len);
+  free(corpus);
+
+  /* anything the renderers flush goes nowhere, and the report goes where
+   * stdout used to */
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  for (bench = benchmarks; bench->name; bench++) {
+    /* any arguments pick benchmarks by prefix */
+    if (argc > 1) {
+      int i, match = 0;
+      for (i = 1; i < argc && !match; i++) {
+        match = STR_STARTS_WITH(bench->name, argv[i]);
+      }
+      if (!match) {
+        continue;
+      }
+    }
+    ret |= run_benchmark(bench, report);
+  }
+
+  fclose(report);
+  bench_free_packages(packages);
+  FREELIST(cfg.targets);
+  format_free();
+  free(scratch);
+  free(outbuf.data);
+  free(colstr);
+  free(cfg.aurhost);
+
+  return ret;
+}
+
+/* vim: set et sw=2: */
@@ -0,0 +1,725 @@
+/*
+ *  loadbench.c
+ *
+ *  End to end load benchmark. A stand-in for the AUR serves a synthetic
+ *  dataset from a local port, with configurable latency, bandwidth and
+ *  error rate, while cower is run against it over a sweep of operations,
+ *  thread counts and target counts. Each run reports wall time, requests
+ *  served per second, peak RSS and CPU time.
+ *
+ *  With -S, only the server runs, for poking at by hand.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#define STREQ(x,y)            (strcmp((x),(y)) == 0)
+#define STR_STARTS_WITH(x,y)  (strncmp((x),(y), strlen(y)) == 0)
+
+#define REQUEST_MAX           8192
+#define TARBALL_MAX           65536
+#define SEARCH_MAX            5000
+
+struct mockpkg_t {
+  char name[32];
+  char version[16];
+  int *deps;
+  int ndeps;
+  char *pkgbuild;
+  char *tarball;
+  size_t tarlen;
+};
+
+struct response_t {
+  int code;
+  const char *type;
+  char *body;
+  size_t len;
+  int ownbody;
+};
+
+struct run_t {
+  double wall;
+  double user;
+  double sys;
+  long maxrss;
+  unsigned long requests;
+  int status;
+};
+
+/* runtime configuration {{{ */
+struct {
+  const char *cower;
+  const char *ops;
+  const char *threads;
+  const char *targets;
+  int port;
+  int npkgs;
+  int maxdeps;
+  int comments;
+  long latency;
+  long bandwidth;
+  double errorrate;
+  unsigned int seed;
+  int serveonly;
+} opts = {
+  .cower = "../cower",
+  .ops = "s,i,ii,u,d,dd",
+  .threads = "1,2,4,8,16,32",
+  .targets = "10,100",
+  .npkgs = 1000,
+  .maxdeps = 3,
+  .comments = 20,
+  .seed = 1
+}; /* }}} */
+
+/* globals {{{ */
+struct mockpkg_t *pkgs;
+unsigned long served;
+static const char *words[] = {
+  "simple", "fast", "library", "tool", "client", "daemon", "bindings", "for",
+  "the", "and", "with", "a", "plugin", "viewer", "editor", "git", "python",
+  "gtk", "qt", "&amp;", "support", "frontend", "über", "中文"
+};
+/* }}} */
+
+static void dataset_build(void) { /* {{{ */
+  int i, j;
+  unsigned int seed = opts.seed;
+
+  pkgs = calloc(opts.npkgs, sizeof *pkgs);
+
+  /* everything is named before any PKGBUILD can refer to it */
+  for (i = 0; i < opts.npkgs; i++) {
+    snprintf(pkgs[i].name, sizeof pkgs[i].name, "pkg%05d", i);
+    snprintf(pkgs[i].version, sizeof pkgs[i].version, "1.%d-%d", i % 17, 1 + i % 3);
+  }
+
+  for (i = 0; i < opts.npkgs; i++) {
+    struct mockpkg_t *pkg = &pkgs[i];
+    size_t used = 0, size;
+    FILE *fp;
+
+    /* only ever depend on later packages, so the graph has no cycles */
+    pkg->ndeps = opts.maxdeps ? rand_r(&seed) % (opts.maxdeps + 1) : 0;
+    if (pkg->ndeps > opts.npkgs - i - 1) {
+      pkg->ndeps = opts.npkgs - i - 1;
+    }
+    pkg->deps = calloc(pkg->ndeps + 1, sizeof *pkg->deps);
+    for (j = 0; j < pkg->ndeps; j++) {
+      pkg->deps[j] = i + 1 + rand_r(&seed) % (opts.npkgs - i - 1);
+    }
+
+    fp = open_memstream(&pkg->pkgbuild, &size);
+    fprintf(fp, "# Maintainer: user%d <user%d@example.com>\n\npkgname=%s\n"
+        "pkgver=%.*s\npkgrel=%s\npkgdesc=\"synthetic package %d\"\n"
+        "arch=('i686' 'x86_64')\nlicense=('GPL')\ndepends=('glibc'",
+        i % 100, i % 100, pkg->name, (int)strcspn(pkg->version, "-"), pkg->version,
+        strchr(pkg->version, '-') + 1, i);
+    /* split the edges between depends and makedepends */
+    for (j = 0; j < pkg->ndeps; j += 2) {
+      fprintf(fp, " '%s>=1.0'", pkgs[pkg->deps[j]].name);
+    }
+    fprintf(fp, ")\nmakedepends=(");
+    for (j = 1; j < pkg->ndeps; j += 2) {
+      fprintf(fp, "%s'%s'", j > 1 ? " " : "", pkgs[pkg->deps[j]].name);
+    }
+    fprintf(fp, ")\nsource=()\n\nbuild() {\n  true\n}\n\npackage() {\n  true\n}\n");
+    fclose(fp);
+
+    /* tarballs are built up front so that serving one costs nothing */
+    {
+      struct archive *archive = archive_write_new();
+      struct archive_entry *entry = archive_entry_new();
+      char path[64];
+
+      pkg->tarball = malloc(TARBALL_MAX);
+      archive_write_set_compression_gzip(archive);
+      archive_write_set_format_ustar(archive);
+      archive_write_open_memory(archive, pkg->tarball, TARBALL_MAX, &used);
+
+      snprintf(path, sizeof path, "%s/PKGBUILD", pkg->name);
+      archive_entry_set_pathname(entry, path);
+      archive_entry_set_size(entry, size);
+      archive_entry_set_filetype(entry, AE_IFREG);
+      archive_entry_set_perm(entry, 0644);
+      archive_write_header(archive, entry);
+      archive_write_data(archive, pkg->pkgbuild, size);
+
+      archive_entry_free(entry);
+      archive_write_close(archive);
+      archive_write_finish(archive);
+      pkg->tarlen = used;
+    }
+  }
+} /* }}} */
+
+static struct mockpkg_t *dataset_find(const char *name) { /* {{{ */
+  int i;
+
+  if (!STR_STARTS_WITH(name, "pkg")) {
+    return NULL;
+  }
+
+  i = atoi(name + 3);
+  if (i < 0 || i >= opts.npkgs || !STREQ(pkgs[i].name, name)) {
+    return NULL;
+  }
+
+  return &pkgs[i];
+} /* }}} */
+
+static void json_pkg(FILE *fp, const struct mockpkg_t *pkg) { /* {{{ */
+  int i = pkg - pkgs, w;
+
+  fprintf(fp, "{\"ID\":\"%d\",\"Name\":\"%s\",\"Version\":\"%s\",\"CategoryID\":\"%d\","
+      "\"Description\":\"", i + 1, pkg->name, pkg->version, 1 + i % 17);
+  for (w = 0; w < 6 + i % 20; w++) {
+    fprintf(fp, "%s%s", w ? " " : "", words[(i + w * 7) % (sizeof words / sizeof *words)]);
+  }
+  fprintf(fp, "\",\"LocationID\":\"2\",\"URL\":\"http://example.com/%s\","
+      "\"URLPath\":\"/packages/%s/%s.tar.gz\",\"License\":\"GPL\",\"NumVotes\":\"%d\","
+      "\"OutOfDate\":\"%d\"}", pkg->name, pkg->name, pkg->name, i % 500, i % 13 == 0);
+} /* }}} */
+
+static void handle_rpc(const char *query, struct response_t *resp) { /* {{{ */
+  char type[16] = "", arg[256] = "";
+  const char *p;
+  FILE *fp;
+  int i, count = 0;
+
+  if ((p = strstr(query, "type="))) {
+    sscanf(p + 5, "%15[^&]", type);
+  }
+  if ((p = strstr(query, "arg="))) {
+    sscanf(p + 4, "%255[^&]", arg);
+  }
+
+  fp = open_memstream(&resp->body, &resp->len);
+  resp->ownbody = 1;
+  resp->type = "application/json";
+
+  if (STREQ(type, "info")) {
+    struct mockpkg_t *pkg = dataset_find(arg);
+    if (pkg) {
+      fprintf(fp, "{\"type\":\"info\",\"resultcount\":1,\"results\":");
+      json_pkg(fp, pkg);
+      fputc('}', fp);
+      fclose(fp);
+      return;
+    }
+  } else if (STREQ(type, "search") || STREQ(type, "msearch")) {
+    int msearch = STREQ(type, "msearch");
+    int maintainer = msearch && STR_STARTS_WITH(arg, "user") ? atoi(arg + 4) : -1;
+
+    /* packages are maintained by user0 through user99, round robin */
+#define MATCHES(i) (msearch ? (i) % 100 == maintainer : strstr(pkgs[(i)].name, arg) != NULL)
+    for (i = 0; i < opts.npkgs && count < SEARCH_MAX; i++) {
+      count += MATCHES(i);
+    }
+    if (count) {
+      fprintf(fp, "{\"type\":\"%s\",\"resultcount\":%d,\"results\":[", type, count);
+      for (i = 0; i < opts.npkgs && count; i++) {
+        if (MATCHES(i)) {
+          json_pkg(fp, &pkgs[i]);
+          fputc(--count ? ',' : ']', fp);
+        }
+      }
+      fputc('}', fp);
+      fclose(fp);
+      return;
+    }
+#undef MATCHES
+  }
+
+  fprintf(fp, "{\"type\":\"error\",\"resultcount\":0,\"results\":\"No results found\"}");
+  fclose(fp);
+} /* }}} */
+
+static void handle_comments(const char *query, struct response_t *resp) { /* {{{ */
+  FILE *fp;
+  int id = 0, i;
+
+  if ((query = strstr(query, "ID="))) {
+    id = atoi(query + 3);
+  }
+
+  fp = open_memstream(&resp->body, &resp->len);
+  resp->ownbody = 1;
+  resp->type = "text/html";
+
+  fprintf(fp, "<html><head><title>AUR (en) - Package Details</title></head><body>\n"
+      "<div class=\"pgbox\"><span class=\"f2\">pkg%05d</span></div>\n", id - 1);
+  for (i = 0; i < opts.comments; i++) {
+    fprintf(fp, "<div class=\"comment-header\">Comment by: user%d on Mon, %02d Aug 2011</div>\n"
+        "<blockquote class=\"comment-body\"><div>\nWorks for me &amp; builds fine with "
+        "&quot;makepkg -s&quot; &lt;3<br />\nsecond line %d &mdash; done\n</div>"
+        "</blockquote>\n<div class=\"comment-sep\"></div>\n", (id + i) % 100, 1 + i % 28, i);
+  }
+  fprintf(fp, "</body></html>\n");
+  fclose(fp);
+} /* }}} */
+
+static void handle_request(const char *path, struct response_t *resp, unsigned int *seed) { /* {{{ */
+  char name[64], file[128];
+  struct mockpkg_t *pkg;
+  const char *query = strchr(path, '?');
+
+  resp->code = 200;
+  resp->type = "text/plain";
+  resp->body = NULL;
+  resp->len = 0;
+  resp->ownbody = 0;
+
+  if (opts.errorrate > 0 && rand_r(seed) < opts.errorrate * RAND_MAX) {
+    resp->code = 503;
+    resp->body = "Service Unavailable\n";
+  } else if (STR_STARTS_WITH(path, "/rpc.php") && query) {
+    handle_rpc(query, resp);
+  } else if (STR_STARTS_WITH(path, "/packages.php") && query) {
+    handle_comments(query, resp);
+  } else if (sscanf(path, "/packages/%63[^/]/%127s", name, file) == 2 &&
+      (pkg = dataset_find(name))) {
+    if (STREQ(file, "PKGBUILD")) {
+      resp->body = pkg->pkgbuild;
+    } else if (STR_STARTS_WITH(file, name) && STREQ(file + strlen(name), ".tar.gz")) {
+      resp->type = "application/x-gzip";
+      resp->body = pkg->tarball;
+      resp->len = pkg->tarlen;
+    } else {
+      resp->code = 404;
+    }
+  } else if (!STREQ(path, "/")) {
+    resp->code = 404;
+  }
+
+  if (resp->code == 404) {
+    resp->body = "Not Found\n";
+  }
+  if (resp->body && !resp->len) {
+    resp->len = strlen(resp->body);
+  }
+} /* }}} */
+
+static int send_all(int fd, const char *data, size_t len) { /* {{{ */
+  /* bandwidth is metered out in twentieths of a second */
+  size_t chunk = opts.bandwidth ? (size_t)opts.bandwidth / 20 + 1 : len;
+  struct timespec tick = { 0, 50 * 1000000L };
+
+  while (len) {
+    size_t n = len < chunk ? len : chunk;
+    ssize_t written = send(fd, data, n, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += written;
+    len -= written;
+    if (opts.bandwidth && len) {
+      nanosleep(&tick, NULL);
+    }
+  }
+
+  return 0;
+} /* }}} */
+
+static void *serve_connection(void *arg) { /* {{{ */
+  int fd = (int)(intptr_t)arg, one = 1;
+  char buf[REQUEST_MAX + 1];
+  size_t have = 0;
+  unsigned int seed = opts.seed ^ (unsigned int)fd;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+  while (1) {
+    char method[8], path[REQUEST_MAX], *end, *header;
+    struct response_t resp;
+    int keepalive;
+    ssize_t n;
+
+    while (!(end = memmem(buf, have, "\r\n\r\n", 4))) {
+      if (have == REQUEST_MAX || (n = recv(fd, buf + have, REQUEST_MAX - have, 0)) <= 0) {
+        goto finish;
+      }
+      have += n;
+    }
+    *end = '\0';
+
+    if (sscanf(buf, "%7s %8191s", method, path) != 2) {
+      goto finish;
+    }
+    keepalive = !strcasestr(buf, "\r\nConnection: close");
+
+    if (opts.latency) {
+      struct timespec delay = { opts.latency / 1000, (opts.latency % 1000) * 1000000L };
+      nanosleep(&delay, NULL);
+    }
+
+    handle_request(path, &resp, &seed);
+    __sync_add_and_fetch(&served, 1);
+
+    n = asprintf(&header, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zd\r\n"
+        "Connection: %s\r\n\r\n", resp.code, resp.code == 200 ? "OK" :
+        resp.code == 404 ? "Not Found" : "Service Unavailable", resp.type, resp.len,
+        keepalive ? "keep-alive" : "close");
+    if (send_all(fd, header, n) != 0 ||
+        (!STREQ(method, "HEAD") && send_all(fd, resp.body, resp.len) != 0)) {
+      keepalive = 0;
+    }
+    free(header);
+    if (resp.ownbody) {
+      free(resp.body);
+    }
+
+    if (!keepalive) {
+      break;
+    }
+
+    /* keep anything pipelined behind this request */
+    end += 4;
+    have -= end - buf;
+    memmove(buf, end, have);
+  }
+
+finish:
+  close(fd);
+  return NULL;
+} /* }}} */
+
+static void *serve(void *arg) { /* {{{ */
+  int listenfd = (int)(intptr_t)arg;
+
+  while (1) {
+    pthread_t thread;
+    int fd = accept(listenfd, NULL, NULL);
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+
+    if (pthread_create(&thread, NULL, serve_connection, (void*)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  return NULL;
+} /* }}} */
+
+static int serve_start(void) { /* {{{ */
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof addr;
+  pthread_t thread;
+  int fd, one = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(opts.port);
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(fd, 128) != 0 ||
+      getsockname(fd, (struct sockaddr*)&addr, &addrlen) != 0) {
+    fprintf(stderr, "error: failed to listen on port %d: %s\n", opts.port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if (pthread_create(&thread, NULL, serve, (void*)(intptr_t)fd) != 0) {
+    close(fd);
+    return -1;
+  }
+  pthread_detach(thread);
+
+  return ntohs(addr.sin_port);
+} /* }}} */
+
+static int rmtree_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw) { /* {{{ */
+  (void)st; (void)flag; (void)ftw;
+  return remove(path);
+} /* }}} */
+
+static double now(void) { /* {{{ */
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+} /* }}} */
+
+/**
+ * Forks off cower with argv from inside workdir, its output thrown away,
+ * and waits for it.
+ */
+static int cower_exec(char **argv, const char *workdir, int *status,
+    struct rusage *usage) { /* {{{ */
+  char cache[PATH_MAX + 8];
+  pid_t pid;
+
+  snprintf(cache, sizeof cache, "%s/cache", workdir);
+
+  pid = fork();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    if (chdir(workdir) != 0) {
+      _exit(127);
+    }
+    setenv("XDG_CACHE_HOME", cache, 1);
+    setenv("XDG_CONFIG_HOME", workdir, 1);
+    execv(opts.cower, argv);
+    _exit(127);
+  }
+
+  return pid < 0 || wait4(pid, status, 0, usage) < 0;
+} /* }}} */
+
+/**
+ * None of the dataset is installed, so -u would only ever skip it. Instead,
+ * cower is left a foreign package cache claiming the first ntargets
+ * packages are, every other one a release behind. The stamp that keeps the
+ * cache valid is whatever cower writes for this machine's dbs, so it's
+ * taken from an untimed run and everything else that run left is dropped.
+ */
+static int seed_foreign(const char *aurhost, int ntargets, const char *workdir) { /* {{{ */
+  char *argv[] = { (char*)opts.cower, "--nossl", (char*)aurhost, "-u", NULL };
+  char path[PATH_MAX + 32], *stamp = NULL;
+  size_t len = 0;
+  struct rusage usage;
+  FILE *fp;
+  int status, i;
+
+  if (cower_exec(argv, workdir, &status, &usage) != 0) {
+    return 1;
+  }
+
+  snprintf(path, sizeof path, "%s/cache/cower/foreign", workdir);
+  if (!(fp = fopen(path, "r")) || getline(&stamp, &len, fp) <= 0) {
+    if (fp) {
+      fclose(fp);
+    }
+    free(stamp);
+    errno = ENOENT;
+    return 1;
+  }
+  fclose(fp);
+
+  snprintf(path, sizeof path, "%s/cache", workdir);
+  nftw(path, rmtree_cb, 16, FTW_DEPTH|FTW_PHYS);
+  mkdir(path, 0755);
+  strcat(path, "/cower");
+  mkdir(path, 0755);
+  strcat(path, "/foreign");
+
+  if (!(fp = fopen(path, "w"))) {
+    free(stamp);
+    return 1;
+  }
+  fputs(stamp, fp);
+  for (i = 0; i < ntargets && i < opts.npkgs; i++) {
+    fprintf(fp, "%s\t%s\n", pkgs[i].name, i % 2 ? pkgs[i].version : "1.0-0");
+  }
+  fclose(fp);
+
+  free(stamp);
+  return 0;
+} /* }}} */
+
+/**
+ * Runs cower once against the server, from a scratch directory with an
+ * empty cache, so that every run starts cold. Updates find their targets
+ * in the foreign package cache seeded for them.
+ */
+static int run_cower(const char *op, int threads, int ntargets, int port,
+    const char *workdir, struct run_t *run) { /* {{{ */
+  char aurhost[64], threadarg[32], opflag[8];
+  char **argv;
+  struct rusage usage;
+  unsigned long startserved;
+  double start;
+  int argc = 0, i, ret;
+
+  snprintf(aurhost, sizeof aurhost, "--aurhost=127.0.0.1:%d", port);
+  snprintf(threadarg, sizeof threadarg, "--threads=%d", threads);
+  snprintf(opflag, sizeof opflag, "-%s", op);
+
+  if (op[0] == 'u' && seed_foreign(aurhost, ntargets, workdir) != 0) {
+    nftw(workdir, rmtree_cb, 16, FTW_DEPTH|FTW_PHYS);
+    return 1;
+  }
+
+  argv = calloc(ntargets + 8, sizeof *argv);
+  argv[argc++] = (char*)opts.cower;
+  argv[argc++] = "--nossl";
+  argv[argc++] = aurhost;
+  argv[argc++] = threadarg;
+  argv[argc++] = opflag;
+  if (op[0] == 'd') {
+    argv[argc++] = "-f";
+  }
+  for (i = 0; op[0] != 'u' && i < ntargets && i < opts.npkgs; i++) {
+    argv[argc++] = pkgs[i].name;
+  }
+
+  startserved = served;
+  start = now();
+  ret = cower_exec(argv, workdir, &run->status, &usage);
+  free(argv);
+  if (ret != 0) {
+    return 1;
+  }
+
+  run->wall = now() - start;
+  run->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  run->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  run->maxrss = usage.ru_maxrss;
+  run->requests = served - startserved;
+
+  nftw(workdir, rmtree_cb, 16, FTW_DEPTH|FTW_PHYS);
+  return 0;
+} /* }}} */
+
+static void usage(void) { /* {{{ */
+  fprintf(stderr, "Usage: loadbench [options]\n\n"
+      "  -c <path>    cower binary to run (default: %s)\n"
+      "  -o <ops>     operations to sweep (default: %s)\n"
+      "  -t <list>    thread counts to sweep (default: %s)\n"
+      "  -T <list>    target counts to sweep (default: %s)\n"
+      "  -n <num>     packages in the dataset (default: %d)\n"
+      "  -D <num>     most AUR dependencies per package (default: %d)\n"
+      "  -C <num>     comments per package page (default: %d)\n"
+      "  -l <ms>      latency added to every response (default: 0)\n"
+      "  -b <bytes>   bandwidth of each connection, per second (default: unlimited)\n"
+      "  -e <rate>    fraction of requests answered with http503 (default: 0)\n"
+      "  -s <seed>    seed for the dataset and errors (default: %u)\n"
+      "  -p <port>    port to listen on (default: any)\n"
+      "  -S           only run the server\n",
+      opts.cower, opts.ops, opts.threads, opts.targets, opts.npkgs, opts.maxdeps,
+      opts.comments, opts.seed);
+} /* }}} */
+
+int main(int argc, char *argv[]) {
+  char template[] = "/tmp/cower-loadbench.XXXXXX", *base, workdir[PATH_MAX];
+  char *ops, *op, *threads, *thread, *targets, *target;
+  char *opsave, *threadsave, *targetsave;
+  int port, opt, runs = 0;
+
+  while ((opt = getopt(argc, argv, "b:c:C:D:e:hl:n:o:p:s:St:T:")) != -1) {
+    switch (opt) {
+      case 'b': opts.bandwidth = strtol(optarg, NULL, 10); break;
+      case 'c': opts.cower = optarg; break;
+      case 'C': opts.comments = atoi(optarg); break;
+      case 'D': opts.maxdeps = atoi(optarg); break;
+      case 'e': opts.errorrate = strtod(optarg, NULL); break;
+      case 'l': opts.latency = strtol(optarg, NULL, 10); break;
+      case 'n': opts.npkgs = atoi(optarg); break;
+      case 'o': opts.ops = optarg; break;
+      case 'p': opts.port = atoi(optarg); break;
+      case 's': opts.seed = strtoul(optarg, NULL, 10); break;
+      case 'S': opts.serveonly = 1; break;
+      case 't': opts.threads = optarg; break;
+      case 'T': opts.targets = optarg; break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (opts.npkgs < 1) {
+    fprintf(stderr, "error: the dataset needs at least one package\n");
+    return 1;
+  }
+
+  dataset_build();
+  if ((port = serve_start()) < 0) {
+    return 1;
+  }
+
+  if (opts.serveonly) {
+    printf("serving %d packages on 127.0.0.1:%d\n", opts.npkgs, port);
+    fflush(stdout);
+    pause();
+    return 0;
+  }
+
+  if (access(opts.cower, X_OK) != 0) {
+    fprintf(stderr, "error: cannot run %s: %s\n", opts.cower, strerror(errno));
+    return 1;
+  }
+
+  base = mkdtemp(template);
+  if (!base) {
+    fprintf(stderr, "error: failed to create a scratch directory: %s\n", strerror(errno));
+    return 1;
+  }
+
+  printf("# %d packages, up to %d deps each, %ldms latency, %ld B/s, %.1f%% errors\n",
+      opts.npkgs, opts.maxdeps, opts.latency, opts.bandwidth, opts.errorrate * 100);
+  printf("%-4s %7s %7s %9s %8s %9s %10s %8s %8s %6s\n", "op", "threads", "targets",
+      "wall(s)", "requests", "req/s", "maxrss(KB)", "user(s)", "sys(s)", "status");
+
+  ops = strdup(opts.ops);
+  for (op = strtok_r(ops, ",", &opsave); op; op = strtok_r(NULL, ",", &opsave)) {
+    targets = strdup(opts.targets);
+    for (target = strtok_r(targets, ",", &targetsave); target;
+        target = strtok_r(NULL, ",", &targetsave)) {
+      threads = strdup(opts.threads);
+      for (thread = strtok_r(threads, ",", &threadsave); thread;
+          thread = strtok_r(NULL, ",", &threadsave)) {
+        struct run_t run;
+
+        snprintf(workdir, sizeof workdir, "%s/run%d", base, runs++);
+        mkdir(workdir, 0755);
+        if (run_cower(op, atoi(thread), atoi(target), port, workdir, &run) != 0) {
+          fprintf(stderr, "error: failed to run %s: %s\n", opts.cower, strerror(errno));
+          continue;
+        }
+
+        printf("%-4s %7d %7d %9.3f %8lu %9.1f %10ld %8.3f %8.3f %6d\n", op, atoi(thread),
+            atoi(target), run.wall, run.requests, run.requests / run.wall, run.maxrss,
+            run.user, run.sys, WIFEXITED(run.status) ? WEXITSTATUS(run.status) : -1);
+        fflush(stdout);
+      }
+      free(threads);
+    }
+    free(targets);
+  }
+  free(ops);
+
+  rmdir(base);
+  return 0;
+}
+
+/* vim: set et sw=2: */
@@ -27,24 +27,42 @@
 /* glibc */
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <locale.h>
 #include <pthread.h>
 #include <regex.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <wordexp.h>
 
 /* external libs */
 #include <alpm.h>
 #include <archive.h>
+#include <archive_entry.h>
 #include <curl/curl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <openssl/crypto.h>
+#include <openssl/evp.h>
 #include <yajl/yajl_parse.h>
 
 /* macros {{{ */
@@ -58,13 +76,18 @@
 
 #define COWER_USERAGENT       "cower/3.x"
 
-#define AUR_PKGBUILD_PATH     "%s://aur.archlinux.org/packages/%s/PKGBUILD"
-#define AUR_PKG_URL           "%s://aur.archlinux.org/packages/%s/%s.tar.gz"
-#define AUR_PKG_URL_FORMAT    "%s://aur.archlinux.org/packages.php?ID="
-#define AUR_RPC_URL           "%s://aur.archlinux.org/rpc.php?type=%s&arg=%s"
+#define AUR_HOST_DEFAULT      "aur.archlinux.org"
+#define AUR_BASE_URL          "%s://%s/"
+#define AUR_PKGBUILD_PATH     "%s://%s/packages/%s/PKGBUILD"
+#define AUR_PKG_URL           "%s://%s/packages/%s/%s.tar.gz"
+#define AUR_PKG_URL_FORMAT    "%s://%s/packages.php?ID="
+#define AUR_RPC_URL           "%s://%s/rpc.php?type=%s&arg=%s"
+#define AUR_NAMES_URL         "%s://%s/packages.gz"
+#define AUR_MODIFIED_URL      "%s://%s/rss/modified"
 #define THREAD_DEFAULT        10
 #define TIMEOUT_DEFAULT       10L
 #define UNSET                 -1
+#define RECORD_MAGIC          "cower-record 1\n"
 
 #define AUR_QUERY_TYPE        "type"
 #define AUR_QUERY_TYPE_INFO   "info"
@@ -107,6 +130,31 @@
 #define COMMENT_BEG_DELIM     "class=\"comment-header\">"
 #define COMMENT_END_DELIM     "</blockquote>"
 
+#define OUTBUF_FLUSH          65536
+#define WORKQ_JOBS_PER_THREAD 4
+#define PIPELINE_EXTRACTORS   2
+#define PIPELINE_DEPTH        16
+#define COMPLETE_TTL          (24 * 60 * 60)
+#define UPDATE_TTL            (6 * 60 * 60)
+#define CLOSURE_TTL           (6 * 60 * 60)
+#define TARBALL_CACHE_DEFAULT (256L * 1024 * 1024)
+#define SHA256_HEX_LEN        64
+#define URING_ENTRIES         64
+#define URING_FILES           16
+#define URING_BATCH_BYTES     (4 * 1024 * 1024)
+
+/* older kernel headers know the ioctl by its btrfs name only */
+#ifndef FICLONE
+#define FICLONE               _IOW(0x94, 9, int)
+#endif
+
+#define DAEMON_PROTOCOL       2
+#define DAEMON_CACHE_TTL      60
+#define DAEMON_FDS            4
+#define DAEMON_PAYLOAD_MAX    (1024 * 1024)
+#define DAEMON_POOL_MAX       32
+#define LOG_LINE_MAX          512
+
 #define INFO_INDENT           17
 #define SRCH_INDENT           4
 #define LIST_DELIM            "  "
@@ -154,27 +202,100 @@ typedef enum __operation_t {
   OP_INFO     = (1 << 1),
   OP_DOWNLOAD = (1 << 2),
   OP_UPDATE   = (1 << 3),
-  OP_MSEARCH  = (1 << 4)
+  OP_MSEARCH  = (1 << 4),
+  OP_COMPLETE = (1 << 5)
 } operation_t;
 
 typedef enum __html_strip_state_t {
   READING_TAG,
+  READING_ENTITY,
   NOT_READING_TAG
 } html_strip_state_t;
 
 
 enum {
-  OP_DEBUG = 1000,
+  OP_AURHOST = 1000,
+  OP_COMPLETENAMES,
+  OP_COMPLETEREFRESH,
+  OP_DAEMON,
+  OP_DEBUG,
+  OP_DEPSONLY,
   OP_FORMAT,
   OP_IGNOREPKG,
   OP_IGNOREREPO,
+  OP_INCREMENTAL,
+  OP_JSON,
+  OP_LINKCACHE,
   OP_LISTDELIM,
+  OP_NODAEMON,
   OP_NOSSL,
+  OP_RECORD,
+  OP_REPLAY,
+  OP_REPLAYDELAY,
+  OP_STATS,
+  OP_TARGETSFROM,
   OP_THREADS,
   OP_TIMEOUT,
+  OP_TRACE,
   OP_VERSION
 };
 
+typedef enum __daemon_msg_t {
+  DAEMON_MSG_RUN = 1,
+  DAEMON_MSG_EXIT,
+  DAEMON_MSG_REFUSED
+} daemon_msg_t;
+
+typedef enum __link_mode_t {
+  LINK_NONE = 0,
+  LINK_REFLINK
+} link_mode_t;
+
+typedef enum __json_output_t {
+  JSON_NONE = 0,
+  JSON_PACKAGES,
+  JSON_RAW
+} json_output_t;
+
+typedef enum __extract_op_t {
+  EXTRACT_OP_MKDIR = 0,
+  EXTRACT_OP_WRITE,
+  EXTRACT_OP_OTHER
+} extract_op_t;
+
+typedef enum __stats_format_t {
+  STATS_NONE = 0,
+  STATS_TEXT,
+  STATS_JSON
+} stats_format_t;
+
+typedef enum __stat_request_t {
+  STAT_REQUEST_RPC = 0,
+  STAT_REQUEST_TARBALL,
+  STAT_REQUEST_PKGBUILD,
+  STAT_REQUEST_COMMENTS,
+  STAT_REQUEST_NAMES,
+  STAT_REQUEST_FEED,
+  STAT_REQUEST_MAX
+} stat_request_t;
+
+typedef enum __stat_phase_t {
+  STAT_PHASE_ALPM = 0,
+  STAT_PHASE_INDEX,
+  STAT_PHASE_JSON,
+  STAT_PHASE_PKGBUILD,
+  STAT_PHASE_EXTRACT,
+  STAT_PHASE_OUTPUT,
+  STAT_PHASE_MAX
+} stat_phase_t;
+
+typedef enum __format_op_type_t {
+  FORMAT_END = 0,
+  FORMAT_LITERAL,
+  FORMAT_FIELD,
+  FORMAT_LIST
+} format_op_type_t;
+
 typedef enum __pkgdetail_t {
   PKGDETAIL_DEPENDS = 0,
   PKGDETAIL_MAKEDEPENDS,
@@ -219,11 +340,35 @@ struct aurpkg_t {
   alpm_list_t *replaces;
 };
 
+/* what the last check for updates to a package found */
+struct update_entry_t {
+  char *name;
+  char *localver;
+  char *aurver;
+  time_t checked;
+};
+
+struct update_modified_t {
+  time_t modified;
+  char name[];
+};
+
 struct yajl_parser_t {
   alpm_list_t *pkglist;
   struct aurpkg_t *aurpkg;
+  struct yajl_handle_t *handle;
   char curkey[32];
   int json_depth;
+  double parsetime;
+
+  /* for --json=raw, result objects are written back out as they're parsed
+   * instead of becoming packages */
+  FILE *raw;
+  int rawresults;
+  int rawinarray;
+  int rawstart;
+  char rawsep;
+  size_t rawcount;
 };
 
 struct response_t {
@@ -231,11 +376,236 @@ struct response_t {
   size_t size;
 };
 
+/* a tarball on its way in from the network, hashed as it arrives */
+struct tarball_t {
+  struct response_t response;
+  EVP_MD_CTX *digest;
+};
+
+/* an io_uring instance, set up and mapped by hand */
+struct uring_t {
+  int fd;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqring, *cqring;
+  size_t sqringsize, cqringsize, sqessize;
+  unsigned tail;
+  unsigned queued;
+  unsigned long syscalls;
+};
+
+/* an archive entry on its way to disk, kept until its metadata is set */
+struct extract_entry_t {
+  char *path;
+  char *link;
+  char *data;
+  size_t size;
+  mode_t mode;
+  mode_t created;
+  struct timespec times[2];
+  int settimes;
+  int symlink;
+};
+
+struct comment_parser_t {
+  alpm_list_t *comments;
+  int count;
+  int max;
+  int incomment;
+  char *pending;
+  size_t pendlen;
+};
+
+struct buffer_t {
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+struct format_op_t {
+  format_op_type_t type;
+  char field;
+  int width;
+  int leftalign;
+  char *text;
+  size_t textlen;
+};
+
+struct hashtable_entry_t {
+  const char *key;
+  void *value;
+};
+
+struct hashtable_t {
+  struct hashtable_entry_t *entries;
+  size_t size;
+  size_t count;
+};
+
+struct provider_t {
+  const char *key;
+  const char *pkgname;
+  const char *version;
+  const char *repo;
+  int ownkey;
+  struct provider_t *next;
+};
+
+struct provider_index_t {
+  struct hashtable_t *table;
+  struct provider_t *providers;
+  size_t count;
+};
+
+/* times are in milliseconds, each one covering a single step of the
+ * transfer rather than curl's running totals */
+struct request_stat_t {
+  double dns;
+  double connect;
+  double tls;
+  double server;
+  double transfer;
+  double total;
+  double bytes;
+  long httpcode;
+};
+
+/* a single fetch, as handed to whichever transport is in use */
+struct request_t {
+  stat_request_t type;
+  const char *url;
+  size_t (*writefn)(void*, size_t, size_t, void*);
+  void *writedata;
+  int identity;
+  long httpcode;
+  struct request_stat_t stat;
+};
+
+struct transport_t {
+  const char *name;
+  int (*init)(void);
+  CURLcode (*fetch)(CURL*, struct request_t*);
+  void (*cleanup)(void);
+};
+
+/* a response read back by the replay transport, or held by the daemon's
+ * response cache. the url and body point into the same allocation as the
+ * struct itself */
+struct recording_t {
+  char *url;
+  long httpcode;
+  double ttfb;
+  double total;
+  double stored;
+  char *body;
+  size_t len;
+};
+
+struct tee_t {
+  struct request_t *request;
+  struct response_t body;
+};
+
+/* every message between daemon and client starts with one of these,
+ * followed by len bytes of payload */
+struct daemon_frame_t {
+  uint16_t version;
+  uint16_t type;
+  uint32_t len;
+};
+
+struct trace_event_t {
+  const char *cat;
+  const char *name;
+  char *detail;
+  double start;
+  double end;
+};
+
+/* each thread records into its own buffer, and the buffers are only ever
+ * walked once every thread is done with them */
+/* a formatted message waiting on the log writer */
+struct log_message_t {
+  struct log_message_t *next;
+  FILE *stream;
+  size_t len;
+  char text[];
+};
+
+struct trace_buffer_t {
+  struct trace_event_t *events;
+  size_t count;
+  size_t size;
+  int tid;
+  const char *threadname;
+  struct trace_buffer_t *next;
+};
+
 struct task_t {
   void *(*threadfn)(CURL*, void*);
   void (*printfn)(struct aurpkg_t*);
 };
 
+/* how full a queue ran, for --stats */
+struct queue_stat_t {
+  size_t pushed;
+  size_t maxdepth;
+  double depthsum;
+  double blocked;
+};
+
+struct job_t {
+  const char *target;
+  alpm_list_t *results;
+  struct log_message_t *output;
+  struct log_message_t **outtail;
+  int done;
+  struct job_t *next;
+};
+
+/* jobs stay queued from the moment they're pushed until they're retired,
+ * which happens strictly in the order they were pushed */
+struct workqueue_t {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t done;
+  pthread_cond_t room;
+  struct job_t *head;
+  struct job_t *pending;
+  struct job_t *tail;
+  size_t count;
+  size_t depth;
+  int closed;
+  int ordered;
+  int held;
+  struct queue_stat_t stat;
+};
+
+/* a downloaded package on its way through extraction and dependency
+ * resolution. the tarball is only known by digest when it's cached */
+struct stage_item_t {
+  const char *target;
+  struct aurpkg_t *pkg;
+  struct response_t tarball;
+  char hex[SHA256_HEX_LEN + 1];
+  int cached;
+  struct stage_item_t *next;
+};
+
+struct stage_t {
+  const char *name;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_cond_t room;
+  struct stage_item_t *head;
+  struct stage_item_t *tail;
+  size_t count;
+  int closed;
+  struct queue_stat_t stat;
+};
+
 struct openssl_mutex_t {
   pthread_mutex_t *lock;
   long *lock_count;
@@ -245,33 +615,136 @@ struct html_character_codes_t {
   char *name_code;
   char *glyph;
 };
+
+struct html_decoder_t {
+  char *out;
+  size_t len;
+  html_strip_state_t state;
+  char entity[12];
+  size_t entitylen;
+};
 /* }}} */
 
 /* function prototypes {{{ */
 static alpm_list_t *alpm_find_foreign_pkgs(void);
-static int alpm_init(void);
-static int alpm_pkg_is_foreign(pmpkg_t*);
-static const char *alpm_provides_pkg(const char*);
-static int archive_extract_file(const struct response_t*);
+static int alpm_index_dbs(int);
+static void alpm_index_join(pthread_t);
+static void *alpm_index_worker(void*);
+static int alpm_init(int);
+static int archive_extract_complete(void*, uint64_t, int);
+static int archive_extract_disk(const struct response_t*, const char*, char**);
+static int archive_extract_file(const struct response_t*, const char*, char**);
+static int archive_extract_uring(const struct response_t*, const char*, char**);
+static int archive_extract_via_symlink(const struct extract_entry_t*, size_t, const char*, const char*);
 static int aurpkg_cmp(const void*, const void*);
 static void aurpkg_free(void*);
 static struct aurpkg_t *aurpkg_new(void);
+static int buffer_append(const char*, size_t);
+static void buffer_flush(void);
+static int buffer_pad(const char*, size_t, int, int);
+static int buffer_printf(const char*, ...) __attribute__((format(printf,1,2)));
+static int buffer_putc(char);
+static int buffer_puts(const char*);
+static int buffer_reserve(size_t);
+static void build_order_visit(struct aurpkg_t*, alpm_list_t*, alpm_list_t**, alpm_list_t**);
+static char *cache_closure_path(const struct aurpkg_t*);
+static char *cache_foreign_stamp(void);
+static int cache_get_closure(struct aurpkg_t*, alpm_list_t**);
+static int cache_get_extinfo(struct aurpkg_t*, alpm_list_t**[]);
+static int cache_get_foreign(alpm_list_t**);
+static int cache_get_tarball(const struct aurpkg_t*, char*);
+static int cache_init(void);
+static int cache_link_tree(const char*, const char*);
+static char *cache_path(const char*, const struct aurpkg_t*);
+static void cache_put_closure(struct aurpkg_t*, alpm_list_t*);
+static void cache_put_extinfo(struct aurpkg_t*, alpm_list_t**[]);
+static void cache_put_foreign(alpm_list_t*);
+static void cache_put_tarball(const struct aurpkg_t*, const struct response_t*, const char*);
+static int cache_put_tree(const char*, const struct response_t*);
+static int cache_read_tarball(const char*, struct response_t*);
+static void cache_trim(void);
+static int cache_write(const char*, const char*, size_t);
+static int complete_namecmp(const void*, const void*);
+static int complete_names(const char*);
+static int complete_refresh(void);
+static void complete_refresh_detached(const char*);
+static int cower_run(int, char*[]);
+static CURL *curl_get_handle(void);
+static void curl_global_setup(void);
 static CURL *curl_init_easy_handle(CURL*);
-static char *curl_get_url_as_buffer(CURL*, const char*);
+static void *curl_prewarm(void*);
+static int curl_prewarm_progress(void*, double, double, double, double);
+static void curl_put_handle(CURL*);
+static void curl_share_lock(CURL*, curl_lock_data, curl_lock_access, void*);
+static void curl_share_unlock(CURL*, curl_lock_data, void*);
+static char *curl_get_pkgbuild(CURL*, const char*);
+static char *curl_get_url_as_buffer(CURL*, const char*, long*);
+static size_t curl_write_comments(void*, size_t, size_t, void*);
 static size_t curl_write_response(void*, size_t, size_t, void*);
+static size_t curl_write_tarball(void*, size_t, size_t, void*);
 static int cwr_asprintf(char**, const char*, ...) __attribute__((format(printf,2,3)));
 static int cwr_fprintf(FILE*, loglevel_t, const char*, ...) __attribute__((format(printf,3,4)));
 static int cwr_printf(loglevel_t, const char*, ...) __attribute__((format(printf,2,3)));
 static int cwr_vfprintf(FILE*, loglevel_t, const char*, va_list) __attribute__((format(printf,3,0)));
+static int daemon_alpm_refresh(void);
+static char *daemon_alpm_stamp(void);
+static const struct recording_t *daemon_cache_get(const char*);
+static void daemon_cache_purge(void);
+static void daemon_cache_put(const char*, long, const char*, size_t);
+static int daemon_client(int, char*[]);
+static int daemon_env_differs(const char*, const char*);
+static int daemon_main(int, char*[]);
+static int daemon_recv(int, struct daemon_frame_t*, char**, int*, int*);
+static int daemon_send(int, daemon_msg_t, const void*, uint32_t, const int*, int);
+static void daemon_serve(int);
+static void daemon_signal(int);
+static char *daemon_socket_path(void);
+static void debug_phase(const char*);
+static void digest_hex(EVP_MD_CTX*, char*);
+static int file_read(const char*, struct response_t*);
 static alpm_list_t *filter_results(alpm_list_t*);
-static alpm_list_t *get_aur_comments(char*);
-static char *get_file_as_buffer(const char*);
+static int format_compile(const char*);
+static void format_free(void);
+static alpm_list_t *get_aur_comments(CURL*, const char*);
 static int getcols(void);
+static int hashtable_add(struct hashtable_t*, const char*, void*);
+static void hashtable_free(struct hashtable_t*, void (*)(void*));
+static void *hashtable_get(const struct hashtable_t*, const char*);
+static unsigned long hashtable_hash(const char*);
+static struct hashtable_t *hashtable_new(size_t);
+static int hashtable_resize(struct hashtable_t*, size_t);
+static void html_decode(struct html_decoder_t*, const char*, size_t);
+static void html_decode_entity(struct html_decoder_t*);
+static size_t html_decode_finish(struct html_decoder_t*);
+static void html_decode_init(struct html_decoder_t*, char*);
+static void html_decode_putc(struct html_decoder_t*, char);
 static void indentprint(const char*, int);
+static void job_replay(struct job_t*);
+static void job_write(FILE*, const char*, size_t);
 static int json_end_map(void*);
+static int json_raw_boolean(void*, int);
+static int json_raw_end_array(void*);
+static int json_raw_end_map(void*);
+static int json_raw_map_key(void*, const unsigned char*, size_t);
+static int json_raw_null(void*);
+static int json_raw_number(void*, const char*, size_t);
+static int json_raw_start_array(void*);
+static int json_raw_start_map(void*);
+static int json_raw_string(void*, const unsigned char*, size_t);
+static void json_raw_write(struct yajl_parser_t*, const char*, size_t, int);
 static int json_map_key(void*, const unsigned char*, size_t);
 static int json_start_map(void*);
 static int json_string(void*, const unsigned char*, size_t);
+static void json_write_string(FILE*, const char*, size_t);
+static void log_drain(struct log_message_t*);
+static void log_flush(void);
+static int log_start(void);
+static struct log_message_t *log_take(struct log_message_t*);
+static long log_tid(void);
+static void log_write(FILE*, const char*, size_t);
+static void *log_writer(void*);
+static int mkpath(const char*);
+static double now_ms(void);
 static void openssl_crypto_cleanup(void);
 static void openssl_crypto_init(void);
 static unsigned long openssl_thread_id(void);
@@ -280,45 +753,132 @@ static alpm_list_t *parse_bash_array(alpm_list_t*, char*, pkgdetail_t);
 static int parse_configfile(void);
 static int parse_options(int, char*[]);
 static void pkgbuild_get_extinfo(char*, alpm_list_t**[]);
+static void *pipeline_extract(void*);
+static void *pipeline_resolve(void*);
+static void pipeline_start(void);
+static void pipeline_stop(void);
+static void print_build_order(alpm_list_t*);
 static int print_escaped(const char*);
 static void print_extinfo_list(alpm_list_t*, const char*, const char*, int);
 static void print_pkg_formatted(struct aurpkg_t*);
 static void print_pkg_info(struct aurpkg_t*);
+static void print_pkg_json(struct aurpkg_t*);
 static void print_pkg_search(struct aurpkg_t*);
 static void print_results(alpm_list_t*, void (*)(struct aurpkg_t*));
-static int resolve_dependencies(CURL*, const char*);
+static const struct provider_t *provider_index_find(const struct provider_index_t*, const char*);
+static void provider_index_free(struct provider_index_t*);
+static int provider_index_init(struct provider_index_t*, alpm_list_t*, alpm_list_t**);
+static const char *provider_index_version(const struct provider_index_t*, const char*);
+static alpm_list_t *resolve_claim_depends(struct aurpkg_t*);
+static alpm_list_t *resolve_dependencies(CURL*, struct aurpkg_t*);
 static int set_working_dir(void);
+static void stats_add_phase(stat_phase_t, double);
+static void stats_add_request(const struct request_t*);
+static int stats_cmp(const void*, const void*);
+static void stats_free(void);
+static double stats_percentile(const double*, size_t, double);
+static void queue_stat_push(struct queue_stat_t*, size_t, double);
+static void stage_close(struct stage_t*);
+static void stage_item_free(struct stage_item_t*);
+static void stage_push(struct stage_t*, struct stage_item_t*);
+static struct stage_item_t *stage_take(struct stage_t*);
+static void stats_print(void);
+static void stats_print_series(const char*, double*, size_t, int);
+static void stats_print_timing(const char*, const struct request_stat_t*, size_t, size_t,
+    double*, int);
+static void sigwinch_handler(int);
 static int strings_init(void);
-static char *strip_and_sanitize_html(char*);
-static char *strreplace(const char *, const char *, const char *);
 static char *strtrim(char*);
+static int target_claim(char*);
+static void *targets_reader(void*);
 static void *task_download(CURL*, void*);
 static void *task_query(CURL*, void*);
 static void *task_update(CURL*, void*);
 static void *thread_pool(void*);
+static struct trace_buffer_t *trace_buffer(void);
+static void trace_end(const char*, const char*, const char*, double);
+static void trace_mutex_lock(pthread_mutex_t*, const char*);
+static void trace_thread_name(const char*);
+static int trace_write(void);
+static void transport_cleanup(void);
+static CURLcode transport_curl_fetch(CURL*, struct request_t*);
+static CURLcode transport_deliver(struct request_t*, char*, size_t);
+static CURLcode transport_fetch(CURL*, struct request_t*);
+static int transport_init(void);
+static const char *transport_key(const char*);
+static CURLcode transport_record_fetch(CURL*, struct request_t*);
+static int transport_record_init(void);
+static char *transport_record_path(const char*);
+static void transport_replay_cleanup(void);
+static CURLcode transport_replay_fetch(CURL*, struct request_t*);
+static int transport_replay_init(void);
+static CURLcode transport_tee(CURL*, struct request_t*,
+    CURLcode (*)(CURL*, struct request_t*), struct response_t*);
+static size_t transport_tee_write(void*, size_t, size_t, void*);
+static int tree_link(const char*, const char*);
+static int tree_remove(const char*);
+static off_t tree_size(const char*);
+static void umask_read(void);
+static int unescape_char(char);
+static void update_entry_free(void*);
+static int update_feed_fetch(void);
+static int update_lookup(const char*, const char*, alpm_list_t**);
+static void update_record(const char*, const char*, const char*);
+static void update_state_load(void);
+static void update_state_save(void);
+static void uring_discard(struct uring_t*);
+static int uring_flush(struct uring_t*, int (*)(void*, uint64_t, int), void*);
+static void uring_free(struct uring_t*);
+static struct io_uring_sqe *uring_get_sqe(struct uring_t*);
+static struct uring_t *uring_new(unsigned);
 static void usage(void);
+static int utf8_charwidth(const char*, int*);
+static int utf8_strwidth(const char*, size_t);
 static void version(void);
+static void workqueue_close(struct workqueue_t*);
+static void workqueue_finish(struct workqueue_t*, struct job_t*, alpm_list_t*);
+static void workqueue_hold(struct workqueue_t*);
+static int workqueue_push(struct workqueue_t*, const char*, int);
+static void workqueue_release(struct workqueue_t*);
+static struct job_t *workqueue_retire(struct workqueue_t*);
+static struct job_t *workqueue_take(struct workqueue_t*);
 static size_t yajl_parse_stream(void*, size_t, size_t, void*);
 /* }}} */
 
 /* runtime configuration {{{ */
 struct {
+  char *aurhost;
+  char *cachedir;
   char *dlpath;
+  const char *complete;
   const char *delim;
   const char *format;
   const char *proto;
+  const char *recorddir;
+  const char *replaydir;
+  const char *targetsfrom;
+  const char *tracefile;
 
   operation_t opmask;
   loglevel_t logmask;
 
   int color;
+  int completerefresh;
+  int depsonly;
   int extinfo;
   int force;
   int getdeps;
+  int maxcomments;
   int maxthreads;
   int quiet;
   int skiprepos;
   int printcomments;
+  json_output_t json;
+  link_mode_t linkcache;
+  stats_format_t stats;
+  long incremental;
+  long tarballcache;
+  long replaydelay;
   long timeout;
 
   alpm_list_t *targets;
@@ -331,7 +891,119 @@ struct {
 /* globals {{{ */
 struct strings_t *colstr;
 pmdb_t *db_local;
-alpm_list_t *workq;
+pthread_mutex_t targets_lock = PTHREAD_MUTEX_INITIALIZER;
+struct hashtable_t *targets_claimed;
+struct workqueue_t workq = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .ready = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+  .room = PTHREAD_COND_INITIALIZER
+};
+struct {
+  struct stage_t extract;
+  struct stage_t resolve;
+  pthread_t threads[PIPELINE_EXTRACTORS + 1];
+  int nthreads;
+  int active;
+} pipeline = {
+  .extract = {
+    .name = "extract",
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .room = PTHREAD_COND_INITIALIZER
+  },
+  .resolve = {
+    .name = "resolve",
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .room = PTHREAD_COND_INITIALIZER
+  }
+};
+int dlerrors;
+int rawresults;
+struct buffer_t outbuf;
+struct hashtable_t *foreign_versions;
+double startup;
+pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+int curl_ready;
+CURLSH *curl_share;
+pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int started;
+  int abort;
+  CURL *handle;
+} prewarm = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct {
+  int active;
+  char *path;
+  int stdio[3];
+  int cwd;
+  loglevel_t logmask;
+  char *alpmstamp;
+  alpm_list_t *ignorepkgs;
+  volatile sig_atomic_t stopping;
+  pthread_mutex_t cachelock;
+  struct hashtable_t *cache;
+  pthread_mutex_t poollock;
+  CURL *handles[DAEMON_POOL_MAX];
+  int nhandles;
+} server = {
+  .cachelock = PTHREAD_MUTEX_INITIALIZER,
+  .poollock = PTHREAD_MUTEX_INITIALIZER
+};
+struct {
+  pthread_mutex_t lock;
+  struct request_stat_t *requests[STAT_REQUEST_MAX];
+  size_t nrequests[STAT_REQUEST_MAX];
+  double *phases[STAT_PHASE_MAX];
+  size_t nphases[STAT_PHASE_MAX];
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+struct {
+  pthread_mutex_t lock;
+  struct trace_buffer_t *buffers;
+  int nexttid;
+} tracing = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread struct trace_buffer_t *trace_local;
+static __thread struct job_t *job_current;
+static __thread int query_failed;
+static __thread struct uring_t *extract_ring;
+int uring_unavailable;
+mode_t process_umask;
+struct {
+  pthread_mutex_t lock;
+  struct hashtable_t *entries;
+  struct hashtable_t *modified;
+  size_t cached;
+  int dirty;
+} updates = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static const struct transport_t transports[] = {
+  { "curl",   NULL,                   transport_curl_fetch,   NULL },
+  { "record", transport_record_init,  transport_record_fetch, NULL },
+  { "replay", transport_replay_init,  transport_replay_fetch, transport_replay_cleanup }
+};
+const struct transport_t *transport = &transports[0];
+struct hashtable_t *recordings;
+static struct log_message_t log_closed;
+struct {
+  struct log_message_t *head;
+  sem_t ready;
+  pthread_t writer;
+  int started;
+  int stopping;
+} logq = { .head = &log_closed };
+static const char *stat_request_names[STAT_REQUEST_MAX] = {
+  "rpc", "tarball", "pkgbuild", "comments", "names", "feed"
+};
+static const char *stat_phase_names[STAT_PHASE_MAX] = {
+  "alpm init", "db index", "json parse", "pkgbuild parse", "extract", "output"
+};
+int alpm_ready;
+struct provider_index_t local_index;
+struct provider_index_t sync_index;
+struct format_op_t *format_ops;
+volatile sig_atomic_t termwidth_stale = 1;
 struct openssl_mutex_t openssl_lock;
 
 static yajl_callbacks callbacks = {
@@ -348,30 +1020,86 @@ static yajl_callbacks callbacks = {
   NULL              /* end_array */
 };
 
+static yajl_callbacks raw_callbacks = {
+  json_raw_null,          /* null */
+  json_raw_boolean,       /* boolean */
+  NULL,                   /* integer */
+  NULL,                   /* double */
+  json_raw_number,        /* number */
+  json_raw_string,        /* string */
+  json_raw_start_map,     /* start_map */
+  json_raw_map_key,       /* map_key */
+  json_raw_end_map,       /* end_map */
+  json_raw_start_array,   /* start_array */
+  json_raw_end_array      /* end_array */
+};
+
 static char const *digits = "0123456789";
 static char const *printf_flags = "'-+ #0I";
 
+/* indexed by pkgdetail_t */
+static const char *pkgdetail_names[] = { "depends", "makedepends", "optdepends",
+                                         "provides", "conflicts", "replaces" };
+static const char *pkgdetail_keys[] = { "Depends", "MakeDepends", "OptDepends",
+                                        "Provides", "Conflicts", "Replaces" };
+
+/* the environment a request's results depend on, besides its arguments */
+static const char *daemon_env[] = { "HOME", "XDG_CACHE_HOME", "XDG_CONFIG_HOME",
+                                    "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE",
+                                    "LC_MESSAGES", "LC_NUMERIC", "LC_TIME", "TZ",
+                                    "http_proxy", "https_proxy", "HTTPS_PROXY",
+                                    "all_proxy", "ALL_PROXY", "no_proxy", "NO_PROXY",
+                                    NULL };
+
 static const char *aur_cat[] = { NULL, "None", "daemons", "devel", "editors",
                                 "emulators", "games", "gnome", "i18n", "kde", "lib",
                                 "modules", "multimedia", "network", "office",
                                 "science", "system", "x11", "xfce", "kernels" };
 
+/* a glyph must never be longer than the entity it replaces */
 static const struct html_character_codes_t html_character_codes[] = {
-  {"&quot;", "\""},
-  {"&lt;", "<"},
+  {"&amp;", "&"},
+  {"&apos;", "\'"},
+  {"&bull;", "*"},
   {"&gt;", ">"},
-  {"&ndash;", "-"},
-  {"&mdash;", "--"},
-  {"&lsquo;", "\'"},
-  {"&rsquo;", "\'"},
+  {"&hellip;", "..."},
+  {"&laquo;", "\""},
   {"&ldquo;", "\""},
+  {"&lsquo;", "\'"},
+  {"&lt;", "<"},
+  {"&mdash;", "--"},
+  {"&nbsp;", " "},
+  {"&ndash;", "-"},
+  {"&quot;", "\""},
+  {"&raquo;", "\""},
   {"&rdquo;", "\""},
-  {"&amp;", "&"}, /* do him last just to be safe */
+  {"&rsquo;", "\'"},
   {NULL, NULL}
 };
+/* sorted, non-overlapping codepoint ranges occupying two columns */
+static const struct { unsigned int first, last; } wide_chars[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x2E80, 0x303E},
+  {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+  {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x1F300, 0x1F64F},
+  {0x1F900, 0x1F9FF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+/* sorted, non-overlapping codepoint ranges which take up no space */
+static const struct { unsigned int first, last; } zero_width_chars[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+  {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E},
+  {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+  {0xFEFF, 0xFEFF}
+};
 /* }}} */
 
-int alpm_init() { /* {{{ */
+/**
+ * Reads pacman.conf for the DBPath and IgnorePkg. Sync dbs are only
+ * registered if withsync is set, as nothing else needs them.
+ */
+int alpm_init(int withsync) { /* {{{ */
   int ret = 0;
   FILE *fp;
   char line[PATH_MAX];
@@ -417,7 +1145,7 @@ int alpm_init() { /* {{{ */
       section = strdup(ptr);
       section[strlen(section) - 1] = '\0';
 
-      if (!STREQ(section, "options") && !cfg.skiprepos &&
+      if (withsync && !STREQ(section, "options") && !cfg.skiprepos &&
           !alpm_list_find_str(cfg.ignore.repos, section)) {
         alpm_db_register_sync(section);
         cwr_printf(LOG_DEBUG, "registering alpm db: %s\n", section);
@@ -450,1821 +1178,7230 @@ int alpm_init() { /* {{{ */
 
 alpm_list_t *alpm_find_foreign_pkgs() { /* {{{ */
   const alpm_list_t *i;
-  alpm_list_t *ret = NULL;
+  alpm_list_t *ret = NULL, *localpkgs;
+  double start;
 
-  for (i = alpm_db_get_pkgcache(db_local); i; i = alpm_list_next(i)) {
-    pmpkg_t *pkg = alpm_list_getdata(i);
+  if (alpm_index_dbs(1) != 0) {
+    return NULL;
+  }
 
-    if (alpm_pkg_is_foreign(pkg)) {
-      ret = alpm_list_add(ret, strdup(alpm_pkg_get_name(pkg)));
+  start = now_ms();
+  localpkgs = alpm_db_get_pkgcache(db_local);
+  for (i = localpkgs; i; i = alpm_list_next(i)) {
+    const char *pkgname = alpm_pkg_get_name(alpm_list_getdata(i));
+
+    /* only a package by the same name counts, not something providing it */
+    if (!provider_index_version(&sync_index, pkgname)) {
+      ret = alpm_list_add(ret, strdup(pkgname));
     }
   }
+  cwr_printf(LOG_DEBUG, "found %zu foreign packages among %zu local in %.2fms\n",
+      alpm_list_count(ret), alpm_list_count(localpkgs), now_ms() - start);
 
   return ret;
 } /* }}} */
 
-int alpm_pkg_is_foreign(pmpkg_t *pkg) { /* {{{ */
+/**
+ * Loads the local db, and the sync dbs if asked to, and indexes them. libalpm
+ * isn't safe to call from more than one thread at a time, so the dbs are
+ * loaded one after another. This is the only place libalpm loads anything;
+ * once it returns, the indexes answer every question the workers have
+ * without touching libalpm or taking a lock.
+ */
+int alpm_index_dbs(int withsync) { /* {{{ */
   const alpm_list_t *i;
-  const char *pkgname;
+  alpm_list_t *syncdbs = NULL, *localdbs = NULL, **caches, *localcache;
+  size_t n, numdbs = 0;
+  int ret = 0;
+  double start = now_ms();
 
-  pkgname = alpm_pkg_get_name(pkg);
+  if (withsync && !sync_index.table) {
+    syncdbs = alpm_option_get_syncdbs();
+    numdbs = alpm_list_count(syncdbs);
+  }
+  CALLOC(caches, numdbs + 1, sizeof *caches, return 1);
+
+  if (!local_index.table) {
+    localcache = alpm_db_get_pkgcache(db_local);
+    localdbs = alpm_list_add(NULL, db_local);
+    ret = provider_index_init(&local_index, localdbs, &localcache);
+    alpm_list_free(localdbs);
+    cwr_printf(LOG_DEBUG, "indexed local db in %.2fms\n", now_ms() - start);
+  }
 
-  for (i = alpm_option_get_syncdbs(); i; i = alpm_list_next(i)) {
-    if (alpm_db_get_pkg(alpm_list_getdata(i), pkgname)) {
-      return 0;
+  if (syncdbs) {
+    for (i = syncdbs, n = 0; i; i = alpm_list_next(i), n++) {
+      caches[n] = alpm_db_get_pkgcache(alpm_list_getdata(i));
+    }
+    if (provider_index_init(&sync_index, syncdbs, caches) != 0) {
+      ret = 1;
     }
+    cwr_printf(LOG_DEBUG, "indexed %zu sync dbs in %.2fms\n", numdbs, now_ms() - start);
   }
 
-  return 1;
+  free(caches);
+
+  stats_add_phase(STAT_PHASE_INDEX, now_ms() - start);
+  trace_end("alpm", "db index", NULL, start);
+
+  return ret;
 } /* }}} */
 
-const char *alpm_provides_pkg(const char *pkgname) { /* {{{ */
-  const alpm_list_t *i;
-  pmdb_t *db;
+/**
+ * Waits for indexing started on alpm_index_worker to finish, saying so if
+ * it failed.
+ */
+void alpm_index_join(pthread_t indexer) { /* {{{ */
+  void *index_return;
 
-  for (i = alpm_option_get_syncdbs(); i; i = alpm_list_next(i)) {
-    db = alpm_list_getdata(i);
-    if (alpm_find_satisfier(alpm_db_get_pkgcache(db), pkgname)) {
-      return alpm_db_get_name(db);
-    }
+  pthread_join(indexer, &index_return);
+  if (index_return) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to index databases\n");
   }
+  debug_phase("databases indexed");
+} /* }}} */
 
-  return NULL;
+void *alpm_index_worker(void *withsync) { /* {{{ */
+  trace_thread_name("indexer");
+  return (void*)(intptr_t)alpm_index_dbs((intptr_t)withsync);
 } /* }}} */
 
-int archive_extract_file(const struct response_t *file) { /* {{{ */
-  struct archive *archive;
+/**
+ * Tallies the result of one operation from archive_extract_uring, returning
+ * non-zero if it failed.
+ */
+int archive_extract_complete(void *arg, uint64_t userdata, int res) { /* {{{ */
+  struct extract_entry_t *entry = (struct extract_entry_t*)arg + (userdata >> 2);
+
+  switch (userdata & 3) {
+    case EXTRACT_OP_MKDIR:
+      /* an existing directory is fine, its mode is set afterwards anyway.
+       * a symlink, or anything else, standing in for one isn't */
+      if (res == -EEXIST) {
+        struct stat st;
+        if (lstat(entry->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+          return 0;
+        }
+      }
+      break;
+    case EXTRACT_OP_WRITE:
+      if (res >= 0 && (size_t)res != entry->size) {
+        cwr_printf(LOG_DEBUG, "io_uring: short write to %s\n", entry->path);
+        return 1;
+      }
+      break;
+  }
+
+  if (res < 0) {
+    cwr_printf(LOG_DEBUG, "io_uring: %s: %s\n", entry->path, strerror(-res));
+    return 1;
+  }
+
+  return 0;
+} /* }}} */
+
+/**
+ * Extracts a tarball with libarchive writing each entry out itself.
+ */
+int archive_extract_disk(const struct response_t *file, const char *destdir,
+    char **pkgbuild) { /* {{{ */
+  struct archive *archive, *disk;
   struct archive_entry *entry;
+  struct response_t captured;
+  char *path;
   const int archive_flags = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME;
+  char buf[BUFSIZ];
+  ssize_t len;
   int ok, ret = ARCHIVE_OK;
 
+  captured.data = NULL;
+  captured.size = 0;
+
   archive = archive_read_new();
   archive_read_support_compression_all(archive);
   archive_read_support_format_all(archive);
 
+  disk = archive_write_disk_new();
+  archive_write_disk_set_options(disk, archive_flags);
+  archive_write_disk_set_standard_lookup(disk);
+
   ret = archive_read_open_memory(archive, file->data, file->size);
   if (ret == ARCHIVE_OK) {
     while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
-      ok = archive_read_extract(archive, entry, archive_flags);
+      /* tarballs are rooted at pkgname/, so the PKGBUILD is one level down */
+      const char *entryname = strchr(archive_entry_pathname(entry), '/');
+      int capture = pkgbuild && entryname && STREQ(entryname + 1, "PKGBUILD");
+
+      if (destdir) {
+        cwr_asprintf(&path, "%s/%s", destdir, archive_entry_pathname(entry));
+        archive_entry_set_pathname(entry, path);
+        free(path);
+        if (archive_entry_hardlink(entry)) {
+          cwr_asprintf(&path, "%s/%s", destdir, archive_entry_hardlink(entry));
+          archive_entry_set_hardlink(entry, path);
+          free(path);
+        }
+      }
+
+      ok = archive_write_header(disk, entry);
       /* NOOP ON ARCHIVE_{OK,WARN,RETRY} */
-      if (ok == ARCHIVE_FATAL || ok == ARCHIVE_EOF) {
+      if (ok == ARCHIVE_FATAL) {
         ret = ok;
         break;
       }
+
+      /* copy the entry out by hand so that the PKGBUILD can be kept in
+       * memory on its way to disk */
+      while ((len = archive_read_data(archive, buf, sizeof buf)) > 0) {
+        /* a full disk shows up here, and must not pass for a download */
+        if (ok >= ARCHIVE_WARN && archive_write_data(disk, buf, len) != len) {
+          break;
+        }
+        if (capture) {
+          curl_write_response(buf, 1, len, &captured);
+        }
+      }
+      if (len != 0 || (ok >= ARCHIVE_WARN && archive_write_finish_entry(disk) < ARCHIVE_WARN)) {
+        cwr_printf(LOG_DEBUG, "failed to extract %s: %s\n", archive_entry_pathname(entry),
+            len < 0 ? archive_error_string(archive) : archive_error_string(disk));
+        ret = ARCHIVE_FATAL;
+        break;
+      }
     }
     archive_read_close(archive);
   }
   archive_read_finish(archive);
+  archive_write_finish(disk);
 
-  return ret;
-} /* }}} */
-
-int aurpkg_cmp(const void *p1, const void *p2) { /* {{{ */
-  struct aurpkg_t *pkg1 = (struct aurpkg_t*)p1;
-  struct aurpkg_t *pkg2 = (struct aurpkg_t*)p2;
+  if (pkgbuild) {
+    *pkgbuild = captured.data;
+  } else {
+    free(captured.data);
+  }
 
-  return strcmp((const char*)pkg1->name, (const char*)pkg2->name);
+  return ret;
 } /* }}} */
 
-void aurpkg_free(void *pkg) { /* {{{ */
-  struct aurpkg_t *it;
+/**
+ * Extracts a tarball held in memory under destdir, or the working directory
+ * if that's NULL, optionally keeping a copy of the PKGBUILD.
+ */
+int archive_extract_file(const struct response_t *file, const char *destdir,
+    char **pkgbuild) { /* {{{ */
+  int ret;
+  double start = now_ms();
 
-  if (!pkg) {
-    return;
+  ret = archive_extract_uring(file, destdir, pkgbuild);
+  if (ret == ARCHIVE_RETRY) {
+    ret = archive_extract_disk(file, destdir, pkgbuild);
   }
 
-  it = (struct aurpkg_t*)pkg;
-
-  FREE(it->id);
-  FREE(it->name);
-  FREE(it->ver);
-  FREE(it->desc);
-  FREE(it->url);
-  FREE(it->lic);
-  FREE(it->votes);
-
-  FREELIST(it->comments);
-  FREELIST(it->depends);
-  FREELIST(it->makedepends);
-  FREELIST(it->optdepends);
-  FREELIST(it->provides);
-  FREELIST(it->conflicts);
-  FREELIST(it->replaces);
-
-  FREE(it);
-} /* }}} */
-
-struct aurpkg_t *aurpkg_new() { /* {{{ */
-  struct aurpkg_t *pkg;
-
-  CALLOC(pkg, 1, sizeof *pkg, return NULL);
+  stats_add_phase(STAT_PHASE_EXTRACT, now_ms() - start);
+  trace_end("parse", "extract", NULL, start);
 
-  return pkg;
+  return ret;
 } /* }}} */
 
-int cwr_asprintf(char **string, const char *format, ...) { /* {{{ */
-  int ret = 0;
-  va_list args;
+/**
+ * Extracts a tarball like archive_extract_disk, but with directories, files
+ * and links created and written through io_uring, a batch at a time, rather
+ * than a handful of syscalls apiece. io_uring has no way to set modes or
+ * times, so those follow once everything is written, and only where the
+ * umask got the mode wrong. A tarball with entries beneath one of its own
+ * symlinks, or with a path already taken by anything but a directory, is
+ * left to libarchive, so none of its own links are written through here.
+ * Returns ARCHIVE_RETRY, maybe having written some of the tarball, whenever
+ * libarchive should do it instead.
+ */
+int archive_extract_uring(const struct response_t *file, const char *destdir,
+    char **pkgbuild) { /* {{{ */
+  struct archive *archive;
+  struct archive_entry *entry;
+  struct extract_entry_t *entries = NULL, *more, *e;
+  struct io_uring_sqe *sqe;
+  char *captured = NULL;
+  size_t count = 0, alloc = 0, batch = 0, batchbytes = 0, n;
+  unsigned slot = 0;
+  unsigned long syscalls = 0;
+  int drain = 0, failed = 0, ok;
+
+  /* every extracting thread has a ring of its own, and the first to find
+   * there's no io_uring saves the rest from trying */
+  if (__sync_fetch_and_add(&uring_unavailable, 0)) {
+    return ARCHIVE_RETRY;
+  }
+  if (!extract_ring && !(extract_ring = uring_new(URING_ENTRIES))) {
+    __sync_lock_test_and_set(&uring_unavailable, 1);
+    return ARCHIVE_RETRY;
+  }
 
-  va_start(args, format);
-  ret = vasprintf(string, format, args);
-  va_end(args);
+  archive = archive_read_new();
+  archive_read_support_compression_all(archive);
+  archive_read_support_format_all(archive);
 
-  if (ret == -1) {
-    cwr_fprintf(stderr, LOG_ERROR, "failed to allocate string\n");
+  if (archive_read_open_memory(archive, file->data, file->size) != ARCHIVE_OK) {
+    archive_read_finish(archive);
+    return ARCHIVE_RETRY;
   }
 
-  return ret;
-} /* }}} */
+  while (!failed && (ok = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
+    /* tarballs are rooted at pkgname/, so the PKGBUILD is one level down */
+    const char *entryname = strchr(archive_entry_pathname(entry), '/');
+    const char *hardlink = archive_entry_hardlink(entry);
+    mode_t type = archive_entry_filetype(entry);
+    int64_t size = archive_entry_size(entry);
+
+    /* anything more exotic than this is left to libarchive */
+    if (!hardlink && type != AE_IFDIR && type != AE_IFLNK &&
+        (type != AE_IFREG || !archive_entry_size_is_set(entry) || size > INT32_MAX)) {
+      failed = 1;
+      break;
+    }
+    if (hardlink || type != AE_IFREG) {
+      size = 0;
+    }
 
-int cwr_fprintf(FILE *stream, loglevel_t level, const char *format, ...) { /* {{{ */
-  int ret;
-  va_list args;
+    /* everything needed for the batch so far must stay put until it's
+     * flushed, so the batch is flushed before it runs out of anything */
+    if (extract_ring->queued + 3 > URING_ENTRIES || slot == URING_FILES ||
+        (batchbytes && batchbytes + size > URING_BATCH_BYTES)) {
+      if ((failed = uring_flush(extract_ring, archive_extract_complete, entries))) {
+        break;
+      }
+      for (; batch < count; batch++) {
+        FREE(entries[batch].data);
+      }
+      slot = 0;
+      batchbytes = 0;
+      drain = 0;
+    }
 
-  va_start(args, format);
-  ret = cwr_vfprintf(stream, level, format, args);
-  va_end(args);
+    if (count == alloc) {
+      alloc = alloc ? alloc * 2 : 16;
+      if (!(more = realloc(entries, alloc * sizeof *entries))) {
+        failed = 1;
+        break;
+      }
+      entries = more;
+    }
+    e = &entries[count];
+    memset(e, 0, sizeof *e);
 
-  return ret;
-} /* }}} */
+    if (destdir) {
+      cwr_asprintf(&e->path, "%s/%s", destdir, archive_entry_pathname(entry));
+    } else {
+      e->path = strdup(archive_entry_pathname(entry));
+    }
+    /* a trailing slash would have the path resolve through a symlink */
+    for (n = strlen(e->path); n > 1 && e->path[n - 1] == '/'; n--) {
+      e->path[n - 1] = '\0';
+    }
+    e->mode = archive_entry_mode(entry) & 07777;
+    e->created = e->mode;
+    e->settimes = archive_entry_mtime_is_set(entry);
+    e->times[1].tv_sec = archive_entry_mtime(entry);
+    e->times[1].tv_nsec = archive_entry_mtime_nsec(entry);
+    e->times[0] = e->times[1];
+    if (archive_entry_atime_is_set(entry)) {
+      e->times[0].tv_sec = archive_entry_atime(entry);
+      e->times[0].tv_nsec = archive_entry_atime_nsec(entry);
+    }
+    count++;
 
-int cwr_printf(loglevel_t level, const char *format, ...) { /* {{{ */
-  int ret;
-  va_list args;
+    /* O_NOFOLLOW only looks at the last part of a path, and nothing else
+     * here looks at all */
+    if (archive_extract_via_symlink(entries, count - 1, e->path,
+          archive_entry_pathname(entry))) {
+      failed = 1;
+      break;
+    }
 
-  va_start(args, format);
-  ret = cwr_vfprintf(stdout, level, format, args);
-  va_end(args);
+    if (hardlink) {
+      if (destdir) {
+        cwr_asprintf(&e->link, "%s/%s", destdir, hardlink);
+      } else {
+        e->link = strdup(hardlink);
+      }
+      e->settimes = 0;
+      if (archive_extract_via_symlink(entries, count - 1, e->link, hardlink)) {
+        failed = 1;
+        break;
+      }
 
-  return ret;
-} /* }}} */
+      /* the file being linked to has to be there first */
+      sqe = uring_get_sqe(extract_ring);
+      sqe->opcode = IORING_OP_LINKAT;
+      sqe->flags = IOSQE_IO_DRAIN;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)e->link;
+      sqe->len = AT_FDCWD;
+      sqe->addr2 = (uintptr_t)e->path;
+      sqe->user_data = (count - 1) << 2 | EXTRACT_OP_OTHER;
+      drain = 0;
+    } else if (type == AE_IFDIR) {
+      /* created writable for its contents, and given its own mode later */
+      e->created = e->mode | S_IRWXU;
+
+      sqe = uring_get_sqe(extract_ring);
+      sqe->opcode = IORING_OP_MKDIRAT;
+      sqe->flags = drain ? IOSQE_IO_DRAIN : 0;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)e->path;
+      sqe->len = e->created;
+      sqe->user_data = (count - 1) << 2 | EXTRACT_OP_MKDIR;
+
+      /* whatever follows may well be created inside it */
+      drain = 1;
+    } else if (type == AE_IFLNK) {
+      e->link = strdup(archive_entry_symlink(entry));
+      e->symlink = 1;
+
+      sqe = uring_get_sqe(extract_ring);
+      sqe->opcode = IORING_OP_SYMLINKAT;
+      sqe->flags = drain ? IOSQE_IO_DRAIN : 0;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)e->link;
+      sqe->addr2 = (uintptr_t)e->path;
+      sqe->user_data = (count - 1) << 2 | EXTRACT_OP_OTHER;
+
+      /* nothing after it may race it, so that an entry at the same path
+       * always finds the link there and fails to be created */
+      drain = 1;
+    } else {
+      ssize_t len;
 
-int cwr_vfprintf(FILE *stream, loglevel_t level, const char *format, va_list args) { /* {{{ */
-  const char *prefix;
-  char bufout[128];
+      MALLOC(e->data, size + 1, failed = 1);
+      if (failed) {
+        break;
+      }
+      for (e->size = 0; e->size < (size_t)size; e->size += len) {
+        if ((len = archive_read_data(archive, e->data + e->size, size - e->size)) <= 0) {
+          break;
+        }
+      }
+      if (e->size != (size_t)size) {
+        failed = 1;
+        break;
+      }
+      if (pkgbuild && entryname && STREQ(entryname + 1, "PKGBUILD")) {
+        free(captured);
+        MALLOC(captured, e->size + 1, failed = 1);
+        if (failed) {
+          break;
+        }
+        memcpy(captured, e->data, e->size);
+        captured[e->size] = '\0';
+      }
 
-  if (!(cfg.logmask & level)) {
-    return 0;
-  }
+      /* the file is opened into a slot of its own, so that its write and
+       * close can be linked to the open in the same batch. it's only ever
+       * created, never opened: anything already at the path, a symlink
+       * above all, fails the open and leaves the tarball to libarchive.
+       * that only covers the last part of the path; the rest was checked
+       * against the tarball's own symlinks above */
+      sqe = uring_get_sqe(extract_ring);
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->flags = IOSQE_IO_LINK | (drain ? IOSQE_IO_DRAIN : 0);
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)e->path;
+      sqe->len = e->mode;
+      sqe->open_flags = O_CREAT|O_EXCL|O_NOFOLLOW|O_WRONLY;
+      sqe->file_index = slot + 1;
+      sqe->user_data = (count - 1) << 2 | EXTRACT_OP_OTHER;
+
+      if (e->size) {
+        sqe = uring_get_sqe(extract_ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->fd = slot;
+        sqe->addr = (uintptr_t)e->data;
+        sqe->len = e->size;
+        sqe->user_data = (count - 1) << 2 | EXTRACT_OP_WRITE;
+      }
 
-  switch (level) {
-    case LOG_VERBOSE:
-    case LOG_INFO:
-      prefix = colstr->info;
-      break;
-    case LOG_ERROR:
-      prefix = colstr->error;
-      break;
-    case LOG_WARN:
-      prefix = colstr->warn;
-      break;
-    case LOG_DEBUG:
-      prefix = "debug:";
-      break;
-    default:
-      prefix = "";
-      break;
+      sqe = uring_get_sqe(extract_ring);
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->file_index = slot + 1;
+      sqe->user_data = (count - 1) << 2 | EXTRACT_OP_OTHER;
+
+      slot++;
+      batchbytes += e->size;
+      drain = 0;
+    }
+  }
+  if (!failed && ok != ARCHIVE_EOF) {
+    failed = 1;
   }
 
-  /* f.l.w.: 128 should be big enough... */
-  snprintf(bufout, 128, "%s %s", prefix, format);
+  if (!failed) {
+    failed = uring_flush(extract_ring, archive_extract_complete, entries);
+  } else if (failed > 0) {
+    /* nothing queued has reached the kernel yet, so it can just be dropped */
+    uring_discard(extract_ring);
+  }
+  syscalls = extract_ring->syscalls;
+  extract_ring->syscalls = 0;
+  if (failed < 0) {
+    uring_free(extract_ring);
+    extract_ring = NULL;
+  }
 
-  return vfprintf(stream, bufout, args);
-} /* }}} */
+  /* the kernel is done with it all, so the fixups can go ahead */
+  for (n = 0; n < count && !failed; n++) {
+    e = &entries[n];
+    if (e->link && !e->settimes) {
+      continue;
+    }
+    if (!e->link && (e->created & ~process_umask) != e->mode) {
+      syscalls++;
+      if (fchmodat(AT_FDCWD, e->path, e->mode, 0) != 0) {
+        failed = 1;
+      }
+    }
+    if (e->settimes) {
+      syscalls++;
+      if (utimensat(AT_FDCWD, e->path, e->times, AT_SYMLINK_NOFOLLOW) != 0) {
+        failed = 1;
+      }
+    }
+  }
 
-CURL *curl_init_easy_handle(CURL *handle) { /* {{{ */
-  if (!handle) {
-    return NULL;
+  if (failed) {
+    cwr_printf(LOG_DEBUG, "io_uring extraction failed, falling back to libarchive\n");
+  } else {
+    cwr_printf(LOG_DEBUG, "extracted %zu entries with %lu syscalls through io_uring\n",
+        count, syscalls);
   }
 
-  curl_easy_reset(handle);
-  curl_easy_setopt(handle, CURLOPT_USERAGENT, COWER_USERAGENT);
-  curl_easy_setopt(handle, CURLOPT_ENCODING, "deflate, gzip");
-  curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, cfg.timeout);
+  for (n = 0; n < count; n++) {
+    free(entries[n].path);
+    free(entries[n].link);
+    free(entries[n].data);
+  }
+  free(entries);
+  archive_read_close(archive);
+  archive_read_finish(archive);
 
-  /* This is required of multi-threaded apps using timeouts. See
-   * curl_easy_setopt(3) */
-  if (cfg.timeout > 0L) {
-    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+  if (!failed && pkgbuild) {
+    *pkgbuild = captured;
+  } else {
+    free(captured);
   }
 
-  return handle;
+  return failed ? ARCHIVE_RETRY : ARCHIVE_OK;
 } /* }}} */
 
-char *curl_get_url_as_buffer(CURL *curl, const char *url) { /* {{{ */
-  long httpcode;
-  struct response_t response;
-  CURLcode curlstat;
+/**
+ * Says whether creating path, which is name as the tarball has it, could go
+ * through one of the symlinks among the first count entries. Names with
+ * empty, . or .. parts could hide that, so they're counted too.
+ */
+int archive_extract_via_symlink(const struct extract_entry_t *entries, size_t count,
+    const char *path, const char *name) { /* {{{ */
+  const char *part;
+  size_t n, len;
+
+  for (part = name; *part; part += len + (part[len] == '/')) {
+    len = strcspn(part, "/");
+    if (len == 0 || (len == 1 && part[0] == '.') ||
+        (len == 2 && part[0] == '.' && part[1] == '.')) {
+      cwr_printf(LOG_DEBUG, "io_uring: %s is not a plain path\n", name);
+      return 1;
+    }
+  }
 
-  curl = curl_init_easy_handle(curl);
+  for (n = 0; n < count; n++) {
+    if (!entries[n].symlink) {
+      continue;
+    }
+    len = strlen(entries[n].path);
+    if (strncmp(path, entries[n].path, len) == 0 && path[len] == '/') {
+      cwr_printf(LOG_DEBUG, "io_uring: %s is beneath symlink %s\n", path, entries[n].path);
+      return 1;
+    }
+  }
 
-  response.data = NULL;
-  response.size = 0;
+  return 0;
+} /* }}} */
 
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_response);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+int aurpkg_cmp(const void *p1, const void *p2) { /* {{{ */
+  struct aurpkg_t *pkg1 = (struct aurpkg_t*)p1;
+  struct aurpkg_t *pkg2 = (struct aurpkg_t*)p2;
 
-  curlstat = curl_easy_perform(curl);
-  if (curlstat != CURLE_OK) {
-    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", url, curl_easy_strerror(curlstat));
-    goto finish;
-  }
+  return strcmp((const char*)pkg1->name, (const char*)pkg2->name);
+} /* }}} */
 
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
-  if (!(httpcode == 200 || httpcode == 404)) {
-    cwr_fprintf(stderr, LOG_ERROR, "%s: server responded with http%ld\n",
-        url, httpcode);
+void aurpkg_free(void *pkg) { /* {{{ */
+  struct aurpkg_t *it;
+
+  if (!pkg) {
+    return;
   }
 
-finish:
-  return response.data;
-} /* }}} */
+  it = (struct aurpkg_t*)pkg;
 
-size_t curl_write_response(void *ptr, size_t size, size_t nmemb, void *stream) { /* {{{ */
-  size_t realsize = size * nmemb;
-  struct response_t *mem = (struct response_t*)stream;
+  FREE(it->id);
+  FREE(it->name);
+  FREE(it->ver);
+  FREE(it->desc);
+  FREE(it->url);
+  FREE(it->lic);
+  FREE(it->votes);
 
-  mem->data = realloc(mem->data, mem->size + realsize + 1);
-  if (mem->data) {
-    memcpy(&(mem->data[mem->size]), ptr, realsize);
-    mem->size += realsize;
-    mem->data[mem->size] = '\0';
-  }
+  FREELIST(it->comments);
+  FREELIST(it->depends);
+  FREELIST(it->makedepends);
+  FREELIST(it->optdepends);
+  FREELIST(it->provides);
+  FREELIST(it->conflicts);
+  FREELIST(it->replaces);
 
-  return realsize;
+  FREE(it);
 } /* }}} */
 
-alpm_list_t *filter_results(alpm_list_t *list) { /* {{{ */
-  const alpm_list_t *i, *j;
-  alpm_list_t *filterlist = NULL;
+struct aurpkg_t *aurpkg_new() { /* {{{ */
+  struct aurpkg_t *pkg;
 
-  if (!(cfg.opmask & OP_SEARCH)) {
-    return list;
-  }
+  CALLOC(pkg, 1, sizeof *pkg, return NULL);
 
-  for (i = cfg.targets; i; i = alpm_list_next(i)) {
-    regex_t regex;
-    const char *targ = (const char*)alpm_list_getdata(i);
-    filterlist = NULL;
+  return pkg;
+} /* }}} */
 
-    if (regcomp(&regex, targ, REGEX_OPTS) == 0) {
-      for (j = list; j; j = alpm_list_next(j)) {
-        struct aurpkg_t *pkg = alpm_list_getdata(j);
-        const char *name = pkg->name;
-        const char *desc = pkg->desc;
+int buffer_append(const char *data, size_t len) { /* {{{ */
+  if (buffer_reserve(len) != 0) {
+    return 0;
+  }
 
-        if (regexec(&regex, name, 0, 0, 0) != REG_NOMATCH ||
-            regexec(&regex, desc, 0, 0, 0) != REG_NOMATCH) {
-          filterlist = alpm_list_add(filterlist, pkg);
-        } else {
-          aurpkg_free(pkg);
-        }
-      }
-      regfree(&regex);
-    }
+  memcpy(outbuf.data + outbuf.len, data, len);
+  outbuf.len += len;
 
-    /* switcheroo */
-    alpm_list_free(list);
-    list = filterlist;
+  if (outbuf.len >= OUTBUF_FLUSH) {
+    buffer_flush();
   }
 
-  return alpm_list_msort(filterlist, alpm_list_count(filterlist), aurpkg_cmp);
+  return len;
 } /* }}} */
 
-alpm_list_t *get_aur_comments(char *buf) { /* {{{ */
-  char *this_comment, *comment_beg, *comment_end;
-  alpm_list_t *list = NULL;
-
-  for (comment_beg = strstr(buf, COMMENT_BEG_DELIM);
-       comment_beg;
-       comment_beg = strstr(comment_end, COMMENT_BEG_DELIM)) {
-    comment_end = strstr(comment_beg, COMMENT_END_DELIM);
+void buffer_flush() { /* {{{ */
+  const char *p = outbuf.data;
+  ssize_t written;
 
-    /* we have the beginning and ending of the comment. now strip out
-     * all the html tags and save the comment: */
-    comment_beg += strlen(COMMENT_BEG_DELIM);
-    CALLOC(this_comment, comment_end - comment_beg + 1, sizeof(char), return NULL);
-    strncpy(this_comment, comment_beg, comment_end - comment_beg);
-    this_comment = strip_and_sanitize_html(this_comment);
+  /* anything already handed to stdio came first */
+  fflush(stdout);
 
-    list = alpm_list_add(list, this_comment);
+  while (outbuf.len > 0) {
+    written = write(STDOUT_FILENO, p, outbuf.len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    p += written;
+    outbuf.len -= written;
   }
-  return list;
+  outbuf.len = 0;
 } /* }}} */
 
+int buffer_pad(const char *data, size_t len, int width, int leftalign) { /* {{{ */
+  int pad = width > (int)len ? width - (int)len : 0;
 
-int getcols() { /* {{{ */
-  int termwidth = -1;
-  const int default_tty = 80;
-  const int default_notty = 0;
+  if (pad == 0) {
+    return buffer_append(data, len);
+  }
 
-  if(!isatty(fileno(stdout))) {
-    return default_notty;
+  if (buffer_reserve(len + pad) != 0) {
+    return 0;
   }
 
-#ifdef TIOCGSIZE
-  struct ttysize win;
-  if(ioctl(1, TIOCGSIZE, &win) == 0) {
-    termwidth = win.ts_cols;
+  if (leftalign) {
+    memcpy(outbuf.data + outbuf.len, data, len);
+    memset(outbuf.data + outbuf.len + len, ' ', pad);
+  } else {
+    memset(outbuf.data + outbuf.len, ' ', pad);
+    memcpy(outbuf.data + outbuf.len + pad, data, len);
   }
-#elif defined(TIOCGWINSZ)
-  struct winsize win;
-  if(ioctl(1, TIOCGWINSZ, &win) == 0) {
-    termwidth = win.ws_col;
+  outbuf.len += len + pad;
+
+  if (outbuf.len >= OUTBUF_FLUSH) {
+    buffer_flush();
   }
-#endif
-  return termwidth <= 0 ? default_tty : termwidth;
+
+  return len + pad;
 } /* }}} */
 
-char *get_file_as_buffer(const char *path) { /* {{{ */
-  FILE *fp;
-  char *buf;
-  long fsize, nread;
+int buffer_printf(const char *format, ...) { /* {{{ */
+  va_list args;
+  int len;
 
-  fp = fopen(path, "r");
-  if (!fp) {
-    cwr_fprintf(stderr, LOG_ERROR, "fopen: %s\n", strerror(errno));
-    return NULL;
+  if (buffer_reserve(BUFSIZ) != 0) {
+    return 0;
   }
 
-  fseek(fp, 0L, SEEK_END);
-  fsize = ftell(fp);
-  fseek(fp, 0L, SEEK_SET);
-
-  CALLOC(buf, 1, (ssize_t)fsize + 1, return NULL);
+  /* format straight into the free space. only in the rare case of it not
+   * fitting do we need to grow the buffer and go again */
+  va_start(args, format);
+  len = vsnprintf(outbuf.data + outbuf.len, outbuf.size - outbuf.len, format, args);
+  va_end(args);
+  if (len < 0) {
+    return 0;
+  }
 
-  nread = fread(buf, 1, fsize, fp);
-  fclose(fp);
+  if ((size_t)len >= outbuf.size - outbuf.len) {
+    if (buffer_reserve(len + 1) != 0) {
+      return 0;
+    }
+    va_start(args, format);
+    vsnprintf(outbuf.data + outbuf.len, outbuf.size - outbuf.len, format, args);
+    va_end(args);
+  }
+  outbuf.len += len;
 
-  if (nread < fsize) {
-    cwr_fprintf(stderr, LOG_ERROR, "Failed to read full PKGBUILD\n");
-    return NULL;
+  if (outbuf.len >= OUTBUF_FLUSH) {
+    buffer_flush();
   }
 
-  return buf;
+  return len;
 } /* }}} */
 
-void indentprint(const char *str, int indent) { /* {{{ */
-  wchar_t *wcstr;
-  const wchar_t *p;
-  int len, cidx, cols;
+int buffer_putc(char c) { /* {{{ */
+  if (buffer_reserve(1) != 0) {
+    return 0;
+  }
+  outbuf.data[outbuf.len++] = c;
 
-  if (!str) {
-    return;
+  if (outbuf.len >= OUTBUF_FLUSH) {
+    buffer_flush();
   }
 
-  cols = getcols();
+  return 1;
+} /* }}} */
 
-  /* if we're not a tty, print without indenting */
-  if (cols == 0) {
-    printf("%s", str);
-    return;
-  }
+int buffer_puts(const char *str) { /* {{{ */
+  return buffer_append(str, strlen(str));
+} /* }}} */
 
-  len = strlen(str) + 1;
-  CALLOC(wcstr, len, sizeof *wcstr, return);
-  len = mbstowcs(wcstr, str, len);
-  p = wcstr;
-  cidx = indent;
+int buffer_reserve(size_t len) { /* {{{ */
+  size_t newsize;
+  char *newdata;
 
-  if (!p || !len) {
-    return;
+  if (outbuf.size - outbuf.len >= len) {
+    return 0;
   }
 
-  while (*p) {
-    if (*p == L' ') {
-      const wchar_t *q, *next;
-      p++;
-      if (!p || *p == L' ') {
-        continue;
-      }
-      next = wcschr(p, L' ');
-      if (!next) {
-        next = p + wcslen(p);
-      }
+  newsize = outbuf.size ? outbuf.size : 2 * OUTBUF_FLUSH;
+  while (newsize - outbuf.len < len) {
+    newsize *= 2;
+  }
 
-      /* len captures # cols */
-      len = 0;
-      q = p;
+  newdata = realloc(outbuf.data, newsize);
+  if (!newdata) {
+    ALLOC_FAIL(newsize);
+    return 1;
+  }
+  outbuf.data = newdata;
+  outbuf.size = newsize;
 
-      while (q < next) {
-        len += wcwidth(*q++);
-      }
+  return 0;
+} /* }}} */
 
-      if (len > (cols - cidx - 1)) {
-        /* wrap to a newline and reindent */
-        printf("\n%-*s", indent, "");
-        cidx = indent;
-      } else {
-        printf(" ");
-        cidx++;
+void build_order_visit(struct aurpkg_t *pkg, alpm_list_t *pkgs, alpm_list_t **seen,
+    alpm_list_t **order) { /* {{{ */
+  const alpm_list_t *i, *j;
+  alpm_list_t *deps[] = { pkg->depends, pkg->makedepends };
+  size_t n;
+
+  if (alpm_list_find_str(*seen, pkg->name)) {
+    return;
+  }
+  *seen = alpm_list_add(*seen, (void*)pkg->name);
+
+  /* depth first, so everything a package needs is ordered before it */
+  for (n = 0; n < sizeof(deps) / sizeof(deps[0]); n++) {
+    for (i = deps[n]; i; i = alpm_list_next(i)) {
+      const char *depend = alpm_list_getdata(i);
+      size_t len = strcspn(depend, "<>=");
+
+      for (j = pkgs; j; j = alpm_list_next(j)) {
+        struct aurpkg_t *dep = alpm_list_getdata(j);
+        if (strlen(dep->name) == len && strncmp(dep->name, depend, len) == 0) {
+          build_order_visit(dep, pkgs, seen, order);
+          break;
+        }
       }
-      continue;
     }
-    printf("%lc", (wint_t)*p);
-    cidx += wcwidth(*p);
-    p++;
   }
-  free(wcstr);
+
+  *order = alpm_list_add(*order, pkg);
 } /* }}} */
 
-int json_end_map(void *ctx) { /* {{{ */
-  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+/**
+ * Closures are kept apart for each AUR host, which may well resolve the
+ * same package differently.
+ */
+char *cache_closure_path(const struct aurpkg_t *pkg) { /* {{{ */
+  char *kind, *path;
 
-  if (--parse_struct->json_depth > 0) {
-    parse_struct->pkglist = alpm_list_add_sorted(parse_struct->pkglist,
-        parse_struct->aurpkg, aurpkg_cmp);
+  if (strstr(cfg.aurhost, "..")) {
+    return NULL;
   }
 
-  return 1;
+  cwr_asprintf(&kind, "closure/%s", cfg.aurhost);
+  path = cache_path(kind, pkg);
+  free(kind);
+
+  return path;
 } /* }}} */
 
-int json_map_key(void *ctx, const unsigned char *data, size_t size) { /* {{{ */
-  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+/**
+ * Describes the state of the local db and every registered sync db, so
+ * that anything derived from them can be thrown away as soon as a package
+ * is installed or removed, or a repo is synced, added or ignored.
+ */
+char *cache_foreign_stamp() { /* {{{ */
+  const alpm_list_t *i;
+  const char *dbpath = alpm_option_get_dbpath();
+  char *path, *buf;
+  size_t len;
+  struct stat st;
+  FILE *fp;
 
-  strncpy(parse_struct->curkey, (const char*)data, size);
-  parse_struct->curkey[size] = '\0';
+  if (!(fp = open_memstream(&buf, &len))) {
+    return NULL;
+  }
 
-  return 1;
-} /* }}} */
+  cwr_asprintf(&path, "%s/local", dbpath);
+  if (stat(path, &st) == 0) {
+    fprintf(fp, "local:%ld.%09ld:%lld", (long)st.st_mtim.tv_sec,
+        (long)st.st_mtim.tv_nsec, (long long)st.st_size);
+  } else {
+    fprintf(fp, "local:-");
+  }
+  free(path);
 
-int json_start_map(void *ctx) { /* {{{ */
-  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+  for (i = alpm_option_get_syncdbs(); i; i = alpm_list_next(i)) {
+    const char *dbname = alpm_db_get_name(alpm_list_getdata(i));
 
-  if (parse_struct->json_depth++ >= 1) {
-    parse_struct->aurpkg = aurpkg_new();
+    cwr_asprintf(&path, "%s/sync/%s.db", dbpath, dbname);
+    if (stat(path, &st) == 0) {
+      fprintf(fp, " %s:%ld.%09ld:%lld", dbname, (long)st.st_mtim.tv_sec,
+          (long)st.st_mtim.tv_nsec, (long long)st.st_size);
+    } else {
+      fprintf(fp, " %s:-", dbname);
+    }
+    free(path);
   }
 
-  return 1;
+  fclose(fp);
+  return buf;
 } /* }}} */
 
-int json_string(void *ctx, const unsigned char *data, size_t size) { /* {{{ */
-  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
-  const char *val = (const char*)data;
+/**
+ * Answers for a package's dependency closure from the cache. The versions
+ * of its members aren't known without asking the AUR about each, so it's
+ * only trusted while it's younger than the feed of modified packages
+ * reaches back, and the feed doesn't mention any of them since it was
+ * written.
+ */
+int cache_get_closure(struct aurpkg_t *pkg, alpm_list_t **closure) { /* {{{ */
+  FILE *fp;
+  char *path, line[PATH_MAX];
+  alpm_list_t *names = NULL;
+  const alpm_list_t *i;
+  struct stat st;
+  int ret = 1;
 
-  if (STREQ(parse_struct->curkey, AUR_QUERY_TYPE) &&
-      STR_STARTS_WITH(val, AUR_QUERY_ERROR)) {
+  *closure = NULL;
+
+  if (!updates.modified || !(path = cache_closure_path(pkg))) {
     return 1;
   }
 
-  if (STREQ(parse_struct->curkey, AUR_ID)) {
-    parse_struct->aurpkg->id = strndup(val, size);
-  } else if (STREQ(parse_struct->curkey, NAME)) {
-    parse_struct->aurpkg->name = strndup(val, size);
-  } else if (STREQ(parse_struct->curkey, VERSION)) {
-    parse_struct->aurpkg->ver = strndup(val, size);
-  } else if (STREQ(parse_struct->curkey, AUR_CAT)) {
-    parse_struct->aurpkg->cat = atoi(val);
-  } else if (STREQ(parse_struct->curkey, AUR_DESC)) {
-    parse_struct->aurpkg->desc = strndup(val, size);
-  } else if (STREQ(parse_struct->curkey, URL)) {
-    parse_struct->aurpkg->url = strndup(val, size);
-  } else if (STREQ(parse_struct->curkey, AUR_LICENSE)) {
-    parse_struct->aurpkg->lic = strndup(val, size);
-  } else if (STREQ(parse_struct->curkey, AUR_VOTES)) {
-    parse_struct->aurpkg->votes = strndup(val, size);
-  } else if (STREQ(parse_struct->curkey, AUR_OOD)) {
-    parse_struct->aurpkg->ood = strncmp(val, "1", 1) == 0 ? 1 : 0;
+  fp = fopen(path, "r");
+  free(path);
+  if (!fp) {
+    return 1;
+  }
+  if (fstat(fileno(fp), &st) != 0 || time(NULL) - st.st_mtime >= CLOSURE_TTL) {
+    goto finish;
   }
 
-  return 1;
-} /* }}} */
+  /* every member of the closure must still be needed from the AUR and be
+   * unchanged, and its extended info must be cached so that it can be
+   * handed back without parsing */
+  while (fgets(line, PATH_MAX, fp)) {
+    struct update_modified_t *mod;
+    struct aurpkg_t *member;
+    char *ver;
 
-void openssl_crypto_cleanup() { /* {{{ */
-  int i;
+    strtrim(line);
+    if (!(ver = strrchr(line, '@'))) {
+      goto finish;
+    }
+    *ver++ = '\0';
 
-  if (!STREQ(cfg.proto, "https")) {
-    return;
+    if (provider_index_version(&local_index, line) ||
+        provider_index_find(&sync_index, line)) {
+      goto finish;
+    }
+
+    pthread_mutex_lock(&updates.lock);
+    mod = hashtable_get(updates.modified, line);
+    pthread_mutex_unlock(&updates.lock);
+    if (mod && mod->modified >= st.st_mtime) {
+      cwr_printf(LOG_DEBUG, "%s changed since the closure of %s@%s was cached\n",
+          line, pkg->name, pkg->ver);
+      goto finish;
+    }
+
+    member = aurpkg_new();
+    member->name = strdup(line);
+    member->ver = strdup(ver);
+    names = alpm_list_add(names, member);
+
+    alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+      &member->depends, &member->makedepends, &member->optdepends,
+      &member->provides, &member->conflicts, &member->replaces
+    };
+    if (cache_get_extinfo(member, pkg_details) != 0) {
+      goto finish;
+    }
   }
 
-  CRYPTO_set_locking_callback(NULL);
+  alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+    &pkg->depends, &pkg->makedepends, &pkg->optdepends,
+    &pkg->provides, &pkg->conflicts, &pkg->replaces
+  };
+  if (cache_get_extinfo(pkg, pkg_details) != 0) {
+    goto finish;
+  }
 
-  for (i = 0; i < CRYPTO_num_locks(); i++) {
-    pthread_mutex_destroy(&(openssl_lock.lock[i]));
+  /* claim the members just as resolve_dependencies would have */
+  trace_mutex_lock(&targets_lock, "targets_lock");
+  for (i = names; i; i = alpm_list_next(i)) {
+    struct aurpkg_t *member = alpm_list_getdata(i);
+    char *name = strdup(member->name);
+    if (target_claim(name)) {
+      *closure = alpm_list_add(*closure, member);
+    } else {
+      free(name);
+      aurpkg_free(member);
+    }
   }
+  pthread_mutex_unlock(&targets_lock);
+  alpm_list_free(names);
+  names = NULL;
 
-  OPENSSL_free(openssl_lock.lock);
-  OPENSSL_free(openssl_lock.lock_count);
+  cwr_printf(LOG_DEBUG, "using cached dependency closure for %s@%s\n",
+      pkg->name, pkg->ver);
+  ret = 0;
+
+finish:
+  fclose(fp);
+  alpm_list_free_inner(names, aurpkg_free);
+  alpm_list_free(names);
+
+  return ret;
 } /* }}} */
 
-void openssl_crypto_init() { /* {{{ */
-  int i;
+int cache_get_extinfo(struct aurpkg_t *pkg, alpm_list_t **details[]) { /* {{{ */
+  FILE *fp;
+  char *path, line[PATH_MAX];
 
-  openssl_lock.lock = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
-  openssl_lock.lock_count = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(long));
-  for (i = 0; i < CRYPTO_num_locks(); i++) {
-    openssl_lock.lock_count[i] = 0;
-    pthread_mutex_init(&(openssl_lock.lock[i]), NULL);
+  if (!(path = cache_path("extinfo", pkg))) {
+    return 1;
   }
 
-  CRYPTO_set_id_callback(openssl_thread_id);
-  CRYPTO_set_locking_callback(openssl_thread_cb);
-} /* }}} */
+  fp = fopen(path, "r");
+  free(path);
+  if (!fp) {
+    return 1;
+  }
 
-void openssl_thread_cb(int mode, int type, const char *file, int line) { /* {{{ */
-  (void)type; (void)file; (void)line;
+  while (fgets(line, PATH_MAX, fp)) {
+    char *val = line;
+    int type;
 
-  if (mode & CRYPTO_LOCK) {
-    pthread_mutex_lock(&(openssl_lock.lock[type]));
-    openssl_lock.lock_count[type]++;
-  } else {
-    pthread_mutex_unlock(&(openssl_lock.lock[type]));
+    strsep(&val, "\t");
+    if (!val) {
+      continue;
+    }
+    strtrim(val);
+
+    for (type = 0; type < PKGDETAIL_MAX; type++) {
+      if (STREQ(line, pkgdetail_names[type])) {
+        if (details[type]) {
+          *details[type] = alpm_list_add(*details[type], strdup(val));
+        }
+        break;
+      }
+    }
   }
-} /* }}} */
+  fclose(fp);
 
-unsigned long openssl_thread_id(void) { /* {{{ */
-  unsigned long ret;
+  cwr_printf(LOG_DEBUG, "using cached extended info for %s@%s\n", pkg->name, pkg->ver);
 
-  ret = (unsigned long)pthread_self();
-  return(ret);
+  return 0;
 } /* }}} */
 
-alpm_list_t *parse_bash_array(alpm_list_t *deplist, char *array, pkgdetail_t type) { /* {{{ */
-  char *ptr, *token;
+/**
+ * Fills pkgs with the foreign packages recorded by cache_put_foreign if the
+ * dbs haven't changed since, and foreign_versions with the installed
+ * version of each. This lets -u get going without loading a single db.
+ * Returns 0 on a hit, which may well be an empty list.
+ */
+int cache_get_foreign(alpm_list_t **pkgs) { /* {{{ */
+  char *path, *stamp, *line = NULL;
+  size_t len = 0;
+  ssize_t read;
+  FILE *fp;
+  int ret = 1;
 
-  if (!array) {
-    return NULL;
+  *pkgs = NULL;
+
+  if (!cfg.cachedir) {
+    return 1;
   }
 
-  if (type == PKGDETAIL_OPTDEPENDS) {
-    const char *arrayend = rawmemchr(array, '\0');
-    for (token = array; token <= arrayend; token++) {
-      if (*token == '\'' || *token == '\"') {
-        token++;
-        ptr = strchr(token, *(token - 1));
-        *ptr = '\0';
-      } else if (isalpha(*token)) {
-        ptr = token;
-        while (!isspace(*++ptr));
-        *(ptr - 1) = '\0';
-      } else {
-        continue;
-      }
+  cwr_asprintf(&path, "%s/foreign", cfg.cachedir);
+  fp = fopen(path, "r");
+  free(path);
+  if (!fp) {
+    return 1;
+  }
 
-      strtrim(token);
-      cwr_printf(LOG_DEBUG, "adding depend: %s\n", token);
-      deplist = alpm_list_add(deplist, strdup(token));
+  stamp = cache_foreign_stamp();
+  if (!stamp || (read = getline(&line, &len, fp)) <= 0 ||
+      strncmp(line, stamp, read - 1) != 0 || stamp[read - 1] != '\0') {
+    cwr_printf(LOG_DEBUG, "foreign package cache is stale\n");
+    goto finish;
+  }
 
-      token = ptr;
-    }
-    return deplist;
+  foreign_versions = hashtable_new(0);
+  if (!foreign_versions) {
+    goto finish;
   }
 
-  for (token = strtok(array, " \t\n"); token; token = strtok(NULL, " \t\n")) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  while ((read = getline(&line, &len, fp)) > 0) {
+    char *name, *ver = line;
 
-    /* found an embedded comment. skip to the next line */
-    if (*token == '#') {
-      strtok(NULL, "\n");
+    line[strcspn(line, "\n")] = '\0';
+    name = strsep(&ver, "\t");
+    if (!ver || !*name) {
       continue;
     }
 
-    /* unquote the element */
-    if (*token == '\'' || *token == '\"') {
-      token++;
-      ptr = strrchr(token, *(token - 1));
-      if (ptr) {
-        *ptr = '\0';
-      }
-    }
+    name = strdup(name);
+    *pkgs = alpm_list_add(*pkgs, name);
+    hashtable_add(foreign_versions, name, strdup(ver));
+  }
 
-    /* some people feel compelled to do insane things in PKGBUILDs. these people suck */
-    if (!*token || strlen(token) < 2 || *token == '$') {
-      continue;
-    }
+  cwr_printf(LOG_DEBUG, "using %zu cached foreign packages\n", alpm_list_count(*pkgs));
+  ret = 0;
 
-    cwr_printf(LOG_DEBUG, "adding depend: %s\n", token);
+finish:
+  free(line);
+  free(stamp);
+  fclose(fp);
 
-    pthread_mutex_lock(&lock);
-    if (!alpm_list_find_str(deplist, token)) {
-      deplist = alpm_list_add(deplist, strdup(token));
-    }
-    pthread_mutex_unlock(&lock);
+  return ret;
+} /* }}} */
+
+/**
+ * Finds the digest of the tarball cached for a package version, which names
+ * its entry under sha256. Returns 0 and fills hex if there is one.
+ */
+int cache_get_tarball(const struct aurpkg_t *pkg, char *hex) { /* {{{ */
+  char *path, target[PATH_MAX];
+  const char *base;
+  ssize_t len;
+
+  if (!cfg.tarballcache || !(path = cache_path("tarballs", pkg))) {
+    return 1;
   }
 
-  return deplist;
+  len = readlink(path, target, sizeof target - 1);
+  free(path);
+  if (len < 0) {
+    return 1;
+  }
+  target[len] = '\0';
+
+  base = strrchr(target, '/');
+  base = base ? base + 1 : target;
+  if (strlen(base) != SHA256_HEX_LEN) {
+    return 1;
+  }
+  strcpy(hex, base);
+
+  return 0;
 } /* }}} */
 
-int parse_configfile() { /* {{{ */
-  char *xdg_config_home, *home, *config_path;
-  char line[PATH_MAX];
-  int ret = 0;
-  FILE *fp;
+int cache_init() { /* {{{ */
+  char *xdg_cache_home, *home, *path;
+  const char *subdirs[] = { "closure", "extinfo", "sha256", "tarballs", "trees", NULL };
+  const char **subdir;
 
-  xdg_config_home = getenv("XDG_CONFIG_HOME");
-  if (xdg_config_home) {
-    cwr_asprintf(&config_path, "%s/cower/config", xdg_config_home);
+  xdg_cache_home = getenv("XDG_CACHE_HOME");
+  if (xdg_cache_home) {
+    cwr_asprintf(&cfg.cachedir, "%s/cower", xdg_cache_home);
   } else {
     home = getenv("HOME");
     if (!home) {
-      cwr_fprintf(stderr, LOG_ERROR, "Unable to find path to config file.\n");
+      cwr_printf(LOG_DEBUG, "unable to find a cache directory. caching disabled\n");
       return 1;
     }
-    cwr_asprintf(&config_path, "%s/.config/cower/config", getenv("HOME"));
+    cwr_asprintf(&cfg.cachedir, "%s/.cache/cower", home);
   }
 
-  fp = fopen(config_path, "r");
-  if (!fp) {
-    cwr_printf(LOG_DEBUG, "config file not found. skipping parsing\n");
-    return 0; /* not an error, just nothing to do here */
+  for (subdir = subdirs; *subdir; subdir++) {
+    cwr_asprintf(&path, "%s/%s", cfg.cachedir, *subdir);
+    if (mkpath(path) != 0) {
+      cwr_printf(LOG_DEBUG, "cannot create %s: %s. caching disabled\n",
+          path, strerror(errno));
+      free(path);
+      FREE(cfg.cachedir);
+      return 1;
+    }
+    free(path);
   }
 
-  /* don't need this anymore, get rid of it ASAP */
-  free(config_path);
+  cwr_printf(LOG_DEBUG, "cache directory set to: %s\n", cfg.cachedir);
 
-  while (fgets(line, PATH_MAX, fp)) {
-    char *key, *val;
+  return 0;
+} /* }}} */
 
-    strtrim(line);
-    if (strlen(line) == 0 || line[0] == '#') {
-      continue;
-    }
+/**
+ * Fills the working directory from the pristine tree extracted from a
+ * cached tarball, linking instead of copying where the filesystem allows.
+ */
+int cache_link_tree(const char *hex, const char *name) { /* {{{ */
+  char *tree, *src;
+  int ret;
 
-    if ((val = strchr(line, '#'))) {
-      *val = '\0';
-    }
+  cwr_asprintf(&tree, "%s/trees/%s", cfg.cachedir, hex);
+  cwr_asprintf(&src, "%s/%s", tree, name);
 
-    key = val = line;
-    strsep(&val, "=");
-    strtrim(key);
-    strtrim(val);
+  ret = tree_link(src, name);
+  if (ret == 0) {
+    /* the tarball is what's evicted, so it's what marks the tree as used */
+    char *object;
+    cwr_asprintf(&object, "%s/sha256/%s", cfg.cachedir, hex);
+    utimensat(AT_FDCWD, object, NULL, 0);
+    free(object);
+  }
 
-    if (val && !*val) {
-      val = NULL;
-    }
+  free(src);
+  free(tree);
 
-    cwr_printf(LOG_DEBUG, "found config option: %s => %s\n", key, val);
+  return ret;
+} /* }}} */
+
+char *cache_path(const char *kind, const struct aurpkg_t *pkg) { /* {{{ */
+  char *path;
+
+  if (!cfg.cachedir || !pkg->name || !pkg->ver ||
+      strchr(pkg->name, '/') || strchr(pkg->ver, '/')) {
+    return NULL;
+  }
+
+  cwr_asprintf(&path, "%s/%s/%s@%s", cfg.cachedir, kind, pkg->name, pkg->ver);
+
+  return path;
+} /* }}} */
+
+void cache_put_closure(struct aurpkg_t *pkg, alpm_list_t *pkgs) { /* {{{ */
+  const alpm_list_t *i;
+  alpm_list_t *seen = NULL, *order = NULL;
+  char *path, *buf;
+  size_t len;
+  FILE *fp;
+
+  if (!(path = cache_closure_path(pkg))) {
+    return;
+  }
+
+  /* the host's directory is made on first use */
+  *strrchr(path, '/') = '\0';
+  if (mkpath(path) != 0) {
+    free(path);
+    return;
+  }
+  path[strlen(path)] = '/';
+
+  build_order_visit(pkg, pkgs, &seen, &order);
+
+  if ((fp = open_memstream(&buf, &len))) {
+    /* the last member of the order is pkg itself */
+    for (i = order; i && alpm_list_next(i); i = alpm_list_next(i)) {
+      struct aurpkg_t *member = alpm_list_getdata(i);
+      fprintf(fp, "%s@%s\n", member->name, member->ver);
+    }
+    fclose(fp);
+    cache_write(path, buf, len);
+    free(buf);
+  }
+
+  alpm_list_free(seen);
+  alpm_list_free(order);
+  free(path);
+} /* }}} */
+
+void cache_put_extinfo(struct aurpkg_t *pkg, alpm_list_t **details[]) { /* {{{ */
+  const alpm_list_t *i;
+  char *path, *buf;
+  size_t len;
+  FILE *fp;
+  int type;
+
+  if (!(path = cache_path("extinfo", pkg))) {
+    return;
+  }
+
+  if ((fp = open_memstream(&buf, &len))) {
+    for (type = 0; type < PKGDETAIL_MAX; type++) {
+      if (!details[type]) {
+        continue;
+      }
+      for (i = *details[type]; i; i = alpm_list_next(i)) {
+        const char *val = alpm_list_getdata(i);
+        fprintf(fp, "%s\t%.*s\n", pkgdetail_names[type], (int)strcspn(val, "\n"), val);
+      }
+    }
+    fclose(fp);
+    cache_write(path, buf, len);
+    free(buf);
+  }
+
+  free(path);
+} /* }}} */
+
+void cache_put_foreign(alpm_list_t *pkgs) { /* {{{ */
+  const alpm_list_t *i;
+  char *path, *stamp, *buf;
+  size_t len;
+  FILE *fp;
+
+  if (!cfg.cachedir || !(stamp = cache_foreign_stamp())) {
+    return;
+  }
+
+  if ((fp = open_memstream(&buf, &len))) {
+    fprintf(fp, "%s\n", stamp);
+    for (i = pkgs; i; i = alpm_list_next(i)) {
+      const char *ver = provider_index_version(&local_index, alpm_list_getdata(i));
+      if (ver) {
+        fprintf(fp, "%s\t%s\n", (const char*)alpm_list_getdata(i), ver);
+      }
+    }
+    fclose(fp);
+
+    cwr_asprintf(&path, "%s/foreign", cfg.cachedir);
+    cache_write(path, buf, len);
+    free(path);
+    free(buf);
+  }
+
+  free(stamp);
+} /* }}} */
+
+/**
+ * Stores a tarball under its digest, and points the package version at it.
+ * Both are renamed into place so that concurrent runs never see them half
+ * done.
+ */
+void cache_put_tarball(const struct aurpkg_t *pkg, const struct response_t *file,
+    const char *hex) { /* {{{ */
+  char *path, *object, *target, *tmppath;
+
+  if (!cfg.tarballcache || !(path = cache_path("tarballs", pkg))) {
+    return;
+  }
+
+  cwr_asprintf(&object, "%s/sha256/%s", cfg.cachedir, hex);
+  if (access(object, F_OK) != 0 && cache_write(object, file->data, file->size) != 0) {
+    goto finish;
+  }
+
+  cwr_asprintf(&target, "../sha256/%s", hex);
+  cwr_asprintf(&tmppath, "%s.%ld", path, (long)syscall(SYS_gettid));
+  unlink(tmppath);
+  if (symlink(target, tmppath) != 0 || rename(tmppath, path) != 0) {
+    unlink(tmppath);
+  }
+  free(tmppath);
+  free(target);
+
+finish:
+  free(object);
+  free(path);
+} /* }}} */
+
+/**
+ * Extracts a cached tarball once into a tree of its own, for later
+ * downloads to link from.
+ */
+int cache_put_tree(const char *hex, const struct response_t *file) { /* {{{ */
+  char *tree, *tmptree;
+  int ret = 1;
+
+  cwr_asprintf(&tree, "%s/trees/%s", cfg.cachedir, hex);
+  if (access(tree, F_OK) == 0) {
+    free(tree);
+    return 0;
+  }
+
+  cwr_asprintf(&tmptree, "%s.XXXXXX", tree);
+  if (mkdtemp(tmptree)) {
+    ret = archive_extract_file(file, tmptree, NULL);
+    ret = ret == ARCHIVE_OK || ret == ARCHIVE_EOF ? 0 : 1;
+
+    /* losing the race to another run is as good as winning it */
+    if (ret == 0 && rename(tmptree, tree) != 0) {
+      ret = access(tree, F_OK);
+    }
+    if (ret != 0 || access(tmptree, F_OK) == 0) {
+      tree_remove(tmptree);
+    }
+  }
+
+  free(tmptree);
+  free(tree);
+
+  return ret;
+} /* }}} */
+
+/**
+ * Reads a cached tarball into memory, making sure it is still the tarball
+ * its digest says it is.
+ */
+int cache_read_tarball(const char *hex, struct response_t *file) { /* {{{ */
+  char *path, actual[EVP_MAX_MD_SIZE * 2 + 1];
+  EVP_MD_CTX *digest;
+  int ret = 1;
+
+  cwr_asprintf(&path, "%s/sha256/%s", cfg.cachedir, hex);
+  if (file_read(path, file) != 0) {
+    goto finish;
+  }
+
+  digest = EVP_MD_CTX_create();
+  EVP_DigestInit_ex(digest, EVP_sha256(), NULL);
+  EVP_DigestUpdate(digest, file->data, file->size);
+  digest_hex(digest, actual);
+  EVP_MD_CTX_destroy(digest);
+
+  if (!STREQ(actual, hex)) {
+    cwr_printf(LOG_DEBUG, "cached tarball %s is corrupt, dropping it\n", hex);
+    unlink(path);
+    FREE(file->data);
+    file->size = 0;
+    goto finish;
+  }
+
+  utimensat(AT_FDCWD, path, NULL, 0);
+  ret = 0;
+
+finish:
+  free(path);
+
+  return ret;
+} /* }}} */
+
+/**
+ * Evicts the least recently used tarballs, along with the trees extracted
+ * from them, until the cache fits in its limit again. Versions left
+ * pointing at nothing are dropped after.
+ */
+void cache_trim() { /* {{{ */
+  struct cache_object_t {
+    char name[SHA256_HEX_LEN + 1];
+    time_t used;
+    off_t size;
+  } *objects = NULL, *more;
+  size_t count = 0, alloc = 0, n;
+  off_t total = 0;
+  struct dirent *dent;
+  struct stat st;
+  char *path;
+  DIR *dir;
+
+  if (!cfg.cachedir || cfg.tarballcache <= 0) {
+    return;
+  }
+
+  cwr_asprintf(&path, "%s/sha256", cfg.cachedir);
+  dir = opendir(path);
+  free(path);
+  if (!dir) {
+    return;
+  }
+
+  while ((dent = readdir(dir))) {
+    if (strlen(dent->d_name) != SHA256_HEX_LEN ||
+        fstatat(dirfd(dir), dent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (count == alloc) {
+      alloc = alloc ? alloc * 2 : 64;
+      if (!(more = realloc(objects, alloc * sizeof *objects))) {
+        break;
+      }
+      objects = more;
+    }
+    strcpy(objects[count].name, dent->d_name);
+    objects[count].used = st.st_mtime;
+
+    cwr_asprintf(&path, "%s/trees/%s", cfg.cachedir, dent->d_name);
+    objects[count].size = st.st_size + tree_size(path);
+    free(path);
+
+    total += objects[count++].size;
+  }
+  closedir(dir);
+
+  if (total > cfg.tarballcache) {
+    /* oldest first. there are few enough tarballs to sort by hand */
+    for (n = 1; n < count; n++) {
+      struct cache_object_t object = objects[n];
+      size_t k;
+      for (k = n; k > 0 && objects[k - 1].used > object.used; k--) {
+        objects[k] = objects[k - 1];
+      }
+      objects[k] = object;
+    }
+
+    for (n = 0; n < count && total > cfg.tarballcache; n++) {
+      cwr_printf(LOG_DEBUG, "evicting tarball %s from the cache\n", objects[n].name);
+      cwr_asprintf(&path, "%s/trees/%s", cfg.cachedir, objects[n].name);
+      tree_remove(path);
+      free(path);
+      cwr_asprintf(&path, "%s/sha256/%s", cfg.cachedir, objects[n].name);
+      unlink(path);
+      free(path);
+      total -= objects[n].size;
+    }
+
+    cwr_asprintf(&path, "%s/tarballs", cfg.cachedir);
+    if ((dir = opendir(path))) {
+      while ((dent = readdir(dir))) {
+        if (*dent->d_name != '.' && fstatat(dirfd(dir), dent->d_name, &st, 0) != 0) {
+          unlinkat(dirfd(dir), dent->d_name, 0);
+        }
+      }
+      closedir(dir);
+    }
+    free(path);
+  }
+
+  free(objects);
+} /* }}} */
+
+int cache_write(const char *path, const char *data, size_t len) { /* {{{ */
+  char *tmppath;
+  int fd, ok, ret = 1;
+
+  /* entries are written aside and renamed into place, so that concurrent
+   * readers never see a partial file */
+  cwr_asprintf(&tmppath, "%s.XXXXXX", path);
+  fd = mkstemp(tmppath);
+  if (fd >= 0) {
+    /* closed exactly once: a second close could take a descriptor another
+     * thread has just been handed */
+    ok = write(fd, data, len) == (ssize_t)len;
+    if (close(fd) != 0) {
+      ok = 0;
+    }
+    if (ok) {
+      ret = rename(tmppath, path);
+    }
+    if (ret != 0) {
+      unlink(tmppath);
+    }
+  }
+
+  if (ret != 0) {
+    cwr_printf(LOG_DEBUG, "failed to write cache entry %s: %s\n", path, strerror(errno));
+  }
+  free(tmppath);
+
+  return ret;
+} /* }}} */
+
+int complete_namecmp(const void *p1, const void *p2) { /* {{{ */
+  return strcmp(*(const char* const*)p1, *(const char* const*)p2);
+} /* }}} */
+
+/**
+ * Prints each name in the completion list which starts with prefix. The list
+ * is sorted, so the first match is found with a binary search over the mapped
+ * file, and only the pages holding the lines it lands on are ever read.
+ */
+int complete_names(const char *prefix) { /* {{{ */
+  const char *data = MAP_FAILED, *line, *end;
+  char *path;
+  size_t size = 0, lo, hi, plen = strlen(prefix);
+  struct stat st;
+  int fd, ret = 1;
+
+  if (!cfg.cachedir) {
+    return 1;
+  }
+
+  cwr_asprintf(&path, "%s/names", cfg.cachedir);
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd >= 0 && fstat(fd, &st) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd >= 0 && (size = st.st_size) > 0) {
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+
+  /* a list which is missing or old is brought up to date in the background,
+   * and whatever is there in the meantime is answered from */
+  if (fd < 0 || time(NULL) - st.st_mtime > COMPLETE_TTL) {
+    complete_refresh_detached(path);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(path);
+
+  if (data == MAP_FAILED) {
+    return 1;
+  }
+
+  /* find the first line which doesn't sort before prefix. lo only ever
+   * lands on the start of a line */
+  lo = 0;
+  hi = size;
+  while (lo < hi) {
+    size_t start = lo + (hi - lo) / 2, linelen;
+    int cmp;
+
+    while (start > lo && data[start - 1] != '\n') {
+      start--;
+    }
+    end = memchr(data + start, '\n', size - start);
+    linelen = (end ? (size_t)(end - data) : size) - start;
+
+    cmp = memcmp(data + start, prefix, linelen < plen ? linelen : plen);
+    if (cmp < 0 || (cmp == 0 && linelen < plen)) {
+      lo = start + linelen + 1;
+    } else {
+      hi = start;
+    }
+  }
+
+  for (line = data + lo; line < data + size; line = end + 1) {
+    if (!(end = memchr(line, '\n', data + size - line))) {
+      end = data + size;
+    }
+    if ((size_t)(end - line) < plen || memcmp(line, prefix, plen) != 0) {
+      break;
+    }
+    buffer_append(line, end - line);
+    buffer_putc('\n');
+    ret = 0;
+  }
+  buffer_flush();
+
+  munmap((void*)data, size);
+
+  return ret;
+} /* }}} */
+
+/**
+ * Replaces the completion list with the names from the AUR's list of every
+ * package, sorted in strcmp's order for complete_names to search.
+ */
+int complete_refresh() { /* {{{ */
+  struct archive *archive;
+  struct archive_entry *entry;
+  struct response_t response = { NULL, 0 };
+  struct request_t request;
+  char *url = NULL, *path, *list = NULL, *sorted = NULL, *line, *save;
+  char **names = NULL, buf[BUFSIZ];
+  size_t listlen = 0, sortedlen, count = 0, alloc = 0, i;
+  ssize_t len;
+  CURLcode curlstat;
+  CURL *curl = NULL;
+  FILE *fp;
+  int ret = 1;
+
+  if (!cfg.cachedir) {
+    cwr_fprintf(stderr, LOG_ERROR, "no cache directory to keep package names in\n");
+    return 1;
+  }
+
+  pthread_once(&curl_once, curl_global_setup);
+  if (curl_ready != 1 || !(curl = curl_init_easy_handle(curl_get_handle()))) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to initialize curl\n");
+    return 1;
+  }
+
+  cwr_asprintf(&url, AUR_NAMES_URL, cfg.proto, cfg.aurhost);
+  memset(&request, 0, sizeof request);
+  request.type = STAT_REQUEST_NAMES;
+  request.url = url;
+  request.writefn = curl_write_response;
+  request.writedata = &response;
+
+  curlstat = transport_fetch(curl, &request);
+  if (curlstat != CURLE_OK) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", url, curl_easy_strerror(curlstat));
+    goto finish;
+  } else if (request.httpcode != 200) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: server responded with http%ld\n",
+        url, request.httpcode);
+    goto finish;
+  }
+
+  /* the list comes gzipped, which libarchive takes care of as a raw
+   * "archive" with a single entry */
+  archive = archive_read_new();
+  archive_read_support_compression_all(archive);
+  archive_read_support_format_raw(archive);
+  if (archive_read_open_memory(archive, response.data, response.size) == ARCHIVE_OK &&
+      archive_read_next_header(archive, &entry) == ARCHIVE_OK &&
+      (fp = open_memstream(&list, &listlen))) {
+    while ((len = archive_read_data(archive, buf, sizeof buf)) > 0) {
+      fwrite(buf, 1, len, fp);
+    }
+    fclose(fp);
+  }
+  archive_read_finish(archive);
+
+  if (!list) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: failed to decompress package list\n", url);
+    goto finish;
+  }
+
+  for (line = strtok_r(list, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+    /* the list starts with a comment saying when it was generated */
+    if (*line == '#') {
+      continue;
+    }
+    if (count == alloc) {
+      char **newnames;
+      alloc = alloc ? alloc * 2 : 1024;
+      if (!(newnames = realloc(names, alloc * sizeof *names))) {
+        ALLOC_FAIL(alloc * sizeof *names);
+        goto finish;
+      }
+      names = newnames;
+    }
+    names[count++] = line;
+  }
+  qsort(names, count, sizeof *names, complete_namecmp);
+
+  if (!(fp = open_memstream(&sorted, &sortedlen))) {
+    goto finish;
+  }
+  for (i = 0; i < count; i++) {
+    if (i == 0 || !STREQ(names[i], names[i - 1])) {
+      fprintf(fp, "%s\n", names[i]);
+    }
+  }
+  fclose(fp);
+
+  cwr_asprintf(&path, "%s/names", cfg.cachedir);
+  ret = cache_write(path, sorted, sortedlen);
+  free(path);
+  if (ret != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to save package names: %s\n", strerror(errno));
+  } else {
+    cwr_printf(LOG_DEBUG, "saved %zu package names\n", count);
+  }
+
+finish:
+  curl_put_handle(curl);
+  free(response.data);
+  free(names);
+  free(sorted);
+  free(list);
+  free(url);
+
+  return ret;
+} /* }}} */
+
+/**
+ * Starts a cower which refreshes the completion list at path, without
+ * waiting on it. The list is touched first, so that the keypresses which
+ * follow don't all start one of their own.
+ */
+void complete_refresh_detached(const char *path) { /* {{{ */
+  pid_t pid;
+
+  if (utimensat(AT_FDCWD, path, NULL, 0) != 0 && cache_write(path, "", 0) != 0) {
+    return;
+  }
+
+  /* fork twice so that nobody is left to reap the refresh. from here on,
+   * only async-signal-safe calls are made */
+  pid = fork();
+  if (pid == 0) {
+    if (fork() == 0) {
+      int devnull = open("/dev/null", O_RDWR);
+      setsid();
+      dup2(devnull, STDIN_FILENO);
+      dup2(devnull, STDOUT_FILENO);
+      dup2(devnull, STDERR_FILENO);
+      execl("/proc/self/exe", "cower", "--no-daemon", "--complete-refresh",
+          "--aurhost", cfg.aurhost, STREQ(cfg.proto, "http") ? "--nossl" : NULL,
+          (char*)NULL);
+    }
+    _exit(0);
+  } else if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+
+  cwr_printf(LOG_DEBUG, "refreshing package names in the background\n");
+} /* }}} */
+
+int cwr_asprintf(char **string, const char *format, ...) { /* {{{ */
+  int ret = 0;
+  va_list args;
+
+  va_start(args, format);
+  ret = vasprintf(string, format, args);
+  va_end(args);
+
+  if (ret == -1) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to allocate string\n");
+  }
+
+  return ret;
+} /* }}} */
+
+int cwr_fprintf(FILE *stream, loglevel_t level, const char *format, ...) { /* {{{ */
+  int ret;
+  va_list args;
+
+  va_start(args, format);
+  ret = cwr_vfprintf(stream, level, format, args);
+  va_end(args);
+
+  return ret;
+} /* }}} */
+
+int cwr_printf(loglevel_t level, const char *format, ...) { /* {{{ */
+  int ret;
+  va_list args;
+
+  va_start(args, format);
+  ret = cwr_vfprintf(stdout, level, format, args);
+  va_end(args);
+
+  return ret;
+} /* }}} */
+
+/**
+ * Messages are formatted whole on the calling thread, with no limit on
+ * their length, and handed to log_write as a single piece so that lines
+ * from different threads never run into each other.
+ */
+int cwr_vfprintf(FILE *stream, loglevel_t level, const char *format, va_list args) { /* {{{ */
+  const char *prefix;
+  char buf[LOG_LINE_MAX], *line = buf;
+  int len, prefixlen;
+  va_list copy;
+
+  if (!(cfg.logmask & level)) {
+    return 0;
+  }
+
+  switch (level) {
+    case LOG_VERBOSE:
+    case LOG_INFO:
+      prefix = colstr->info;
+      break;
+    case LOG_ERROR:
+      prefix = colstr->error;
+      break;
+    case LOG_WARN:
+      prefix = colstr->warn;
+      break;
+    case LOG_DEBUG:
+      prefix = "debug:";
+      break;
+    default:
+      prefix = "";
+      break;
+  }
+
+  if (level == LOG_DEBUG) {
+    prefixlen = snprintf(buf, sizeof buf, "%s [%9.3fms] [%ld] ", prefix,
+        now_ms() - startup, log_tid());
+  } else {
+    prefixlen = snprintf(buf, sizeof buf, "%s ", prefix);
+  }
+  if (prefixlen < 0 || (size_t)prefixlen >= sizeof buf) {
+    return -1;
+  }
+
+  va_copy(copy, args);
+  len = vsnprintf(buf + prefixlen, sizeof buf - prefixlen, format, copy);
+  va_end(copy);
+  if (len < 0) {
+    return len;
+  }
+
+  /* anything too long for the stack is formatted again on the heap. if
+   * that fails, a truncated message is better than none */
+  if ((size_t)len >= sizeof buf - prefixlen) {
+    if ((line = malloc(prefixlen + len + 1))) {
+      memcpy(line, buf, prefixlen);
+      vsnprintf(line + prefixlen, len + 1, format, args);
+    } else {
+      line = buf;
+      len = sizeof buf - prefixlen - 1;
+    }
+  }
+  len += prefixlen;
+
+  /* debug output is about what's happening now, so it's never held back
+   * with the rest of a job's output */
+  if (level == LOG_DEBUG) {
+    log_write(stream, line, len);
+  } else {
+    job_write(stream, line, len);
+  }
+
+  if (line != buf) {
+    free(line);
+  }
+
+  return len;
+} /* }}} */
+
+/**
+ * Hands out the connection warmed up by curl_prewarm if it's ready, then
+ * any connection a daemon kept from an earlier request, and otherwise a
+ * fresh handle. Either way, the handle shares its DNS cache and TLS sessions
+ * with every other.
+ */
+CURL *curl_get_handle() { /* {{{ */
+  CURL *curl;
+
+  trace_mutex_lock(&prewarm.lock, "prewarm_lock");
+  curl = prewarm.handle;
+  prewarm.handle = NULL;
+  pthread_mutex_unlock(&prewarm.lock);
+
+  if (curl) {
+    cwr_printf(LOG_DEBUG, "[%p]: using prewarmed connection\n", (void*)pthread_self());
+    return curl;
+  }
+
+  if (server.active) {
+    trace_mutex_lock(&server.poollock, "pool_lock");
+    if (server.nhandles > 0) {
+      curl = server.handles[--server.nhandles];
+    }
+    pthread_mutex_unlock(&server.poollock);
+    if (curl) {
+      cwr_printf(LOG_DEBUG, "[%p]: using pooled connection\n", (void*)pthread_self());
+      return curl;
+    }
+  }
+
+  return curl_easy_init();
+} /* }}} */
+
+/**
+ * Run once, on the main thread before any thread that makes requests is
+ * started, since curl_global_init is not thread safe. Operations that never
+ * go near the network never pay for TLS setup.
+ */
+void curl_global_setup() { /* {{{ */
+  int ret, i;
+
+  cwr_printf(LOG_DEBUG, "initializing curl\n");
+  if (STREQ(cfg.proto, "https")) {
+    ret = curl_global_init(CURL_GLOBAL_SSL);
+    openssl_crypto_init();
+  } else {
+    ret = curl_global_init(CURL_GLOBAL_NOTHING);
+  }
+
+  curl_ready = ret == 0 ? 1 : -1;
+
+  /* resolving the host and negotiating TLS only need to happen once */
+  if (curl_ready == 1 && (curl_share = curl_share_init())) {
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+      pthread_mutex_init(&curl_share_locks[i], NULL);
+    }
+    curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+    curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  debug_phase("curl initialized");
+} /* }}} */
+
+/**
+ * Gives back a handle from curl_get_handle. A daemon keeps it, and the
+ * connection it holds open, for the next request.
+ */
+void curl_put_handle(CURL *curl) { /* {{{ */
+  if (server.active) {
+    trace_mutex_lock(&server.poollock, "pool_lock");
+    if (server.nhandles < DAEMON_POOL_MAX) {
+      server.handles[server.nhandles++] = curl;
+      curl = NULL;
+    }
+    pthread_mutex_unlock(&server.poollock);
+  }
+
+  if (curl) {
+    curl_easy_cleanup(curl);
+  }
+} /* }}} */
+
+CURL *curl_init_easy_handle(CURL *handle) { /* {{{ */
+  if (!handle) {
+    return NULL;
+  }
+
+  curl_easy_reset(handle);
+  curl_easy_setopt(handle, CURLOPT_USERAGENT, COWER_USERAGENT);
+  curl_easy_setopt(handle, CURLOPT_ENCODING, "deflate, gzip");
+  curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, cfg.timeout);
+  if (curl_share) {
+    curl_easy_setopt(handle, CURLOPT_SHARE, curl_share);
+  }
+
+  /* This is required of multi-threaded apps using timeouts. See
+   * curl_easy_setopt(3) */
+  if (cfg.timeout > 0L) {
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+  }
+
+  return handle;
+} /* }}} */
+
+/**
+ * Connects to the AUR while the rest of startup carries on, so that DNS,
+ * TCP and TLS are out of the way by the time the first worker wants to make
+ * a request. The connection stays alive in the handle, which is passed on
+ * to a worker by curl_get_handle.
+ */
+void *curl_prewarm(void *arg) { /* {{{ */
+  CURL *curl;
+  CURLcode curlstat;
+  char *url;
+  double start = now_ms();
+
+  (void)arg;
+
+  trace_thread_name("prewarm");
+  if (curl_ready != 1 || !(curl = curl_init_easy_handle(curl_easy_init()))) {
+    return NULL;
+  }
+
+  cwr_asprintf(&url, AUR_BASE_URL, cfg.proto, cfg.aurhost);
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, curl_prewarm_progress);
+
+  curlstat = curl_easy_perform(curl);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+  trace_end("http", "prewarm", url, start);
+  if (curlstat != CURLE_OK) {
+    cwr_printf(LOG_DEBUG, "prewarming %s failed: %s\n", url, curl_easy_strerror(curlstat));
+    curl_easy_cleanup(curl);
+  } else {
+    cwr_printf(LOG_DEBUG, "connected to %s in %.2fms\n", url, now_ms() - start);
+    pthread_mutex_lock(&prewarm.lock);
+    prewarm.handle = curl;
+    pthread_mutex_unlock(&prewarm.lock);
+  }
+
+  free(url);
+  return NULL;
+} /* }}} */
+
+/**
+ * Gives up on connecting as soon as cower_run has, rather than making it
+ * wait out the timeout on its way out.
+ */
+int curl_prewarm_progress(void *arg, double dltotal, double dlnow, double ultotal,
+    double ulnow) { /* {{{ */
+  (void)arg; (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+  return __sync_fetch_and_add(&prewarm.abort, 0);
+} /* }}} */
+
+void curl_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access,
+    void *userptr) { /* {{{ */
+  (void)handle; (void)access; (void)userptr;
+  pthread_mutex_lock(&curl_share_locks[data]);
+} /* }}} */
+
+void curl_share_unlock(CURL *handle, curl_lock_data data, void *userptr) { /* {{{ */
+  (void)handle; (void)userptr;
+  pthread_mutex_unlock(&curl_share_locks[data]);
+} /* }}} */
+
+char *curl_get_pkgbuild(CURL *curl, const char *pkgname) { /* {{{ */
+  char *escaped, *url, *pkgbuild;
+  long httpcode = 0;
+
+  escaped = curl_easy_escape(curl, pkgname, strlen(pkgname));
+  cwr_asprintf(&url, AUR_PKGBUILD_PATH, cfg.proto, cfg.aurhost, escaped);
+  curl_free(escaped);
+
+  pkgbuild = curl_get_url_as_buffer(curl, url, &httpcode);
+  free(url);
+
+  /* don't mistake an error page for a PKGBUILD */
+  if (httpcode != 200) {
+    FREE(pkgbuild);
+  }
+
+  return pkgbuild;
+} /* }}} */
+
+char *curl_get_url_as_buffer(CURL *curl, const char *url, long *httpcode) { /* {{{ */
+  struct response_t response;
+  struct request_t request;
+  CURLcode curlstat;
+
+  curl = curl_init_easy_handle(curl);
+
+  response.data = NULL;
+  response.size = 0;
+
+  memset(&request, 0, sizeof request);
+  request.type = STAT_REQUEST_PKGBUILD;
+  request.url = url;
+  request.writefn = curl_write_response;
+  request.writedata = &response;
+
+  curlstat = transport_fetch(curl, &request);
+  *httpcode = request.httpcode;
+  if (curlstat != CURLE_OK) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", url, curl_easy_strerror(curlstat));
+    goto finish;
+  }
+
+  if (!(request.httpcode == 200 || request.httpcode == 404)) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: server responded with http%ld\n",
+        url, request.httpcode);
+  }
+
+finish:
+  return response.data;
+} /* }}} */
+
+/**
+ * Pulls comments out of the package page as it arrives. Only the comment
+ * being read (or the tail of the page which might hold the start of a
+ * comment header) is ever buffered. Once the requested number of comments
+ * has been seen, the transfer is aborted by claiming a short write.
+ */
+size_t curl_write_comments(void *ptr, size_t size, size_t nmemb, void *stream) { /* {{{ */
+  size_t realsize = size * nmemb;
+  struct comment_parser_t *parser = stream;
+  const size_t beglen = strlen(COMMENT_BEG_DELIM);
+  const size_t endlen = strlen(COMMENT_END_DELIM);
+  char *newbuf, *delim;
+
+  newbuf = realloc(parser->pending, parser->pendlen + realsize);
+  if (!newbuf) {
+    ALLOC_FAIL(parser->pendlen + realsize);
+    return 0;
+  }
+  parser->pending = newbuf;
+  memcpy(parser->pending + parser->pendlen, ptr, realsize);
+  parser->pendlen += realsize;
+
+  for (;;) {
+    size_t consumed;
+
+    if (!parser->incomment) {
+      delim = memmem(parser->pending, parser->pendlen, COMMENT_BEG_DELIM, beglen);
+      if (!delim) {
+        /* keep just enough to match a delimiter split across writes */
+        if (parser->pendlen >= beglen) {
+          memmove(parser->pending, parser->pending + parser->pendlen - beglen + 1,
+              beglen - 1);
+          parser->pendlen = beglen - 1;
+        }
+        break;
+      }
+      consumed = delim - parser->pending + beglen;
+      parser->incomment = 1;
+    } else {
+      struct html_decoder_t decoder;
+      char *this_comment;
+
+      delim = memmem(parser->pending, parser->pendlen, COMMENT_END_DELIM, endlen);
+      if (!delim) {
+        break;
+      }
+
+      CALLOC(this_comment, delim - parser->pending + 1, sizeof(char), return 0);
+      html_decode_init(&decoder, this_comment);
+      html_decode(&decoder, parser->pending, delim - parser->pending);
+      html_decode_finish(&decoder);
+      parser->comments = alpm_list_add(parser->comments, this_comment);
+
+      consumed = delim - parser->pending + endlen;
+      parser->incomment = 0;
+      if (parser->max && ++parser->count >= parser->max) {
+        return 0;
+      }
+    }
+
+    parser->pendlen -= consumed;
+    memmove(parser->pending, parser->pending + consumed, parser->pendlen);
+  }
+
+  return realsize;
+} /* }}} */
+
+size_t curl_write_response(void *ptr, size_t size, size_t nmemb, void *stream) { /* {{{ */
+  size_t realsize = size * nmemb;
+  struct response_t *mem = (struct response_t*)stream;
+
+  mem->data = realloc(mem->data, mem->size + realsize + 1);
+  if (mem->data) {
+    memcpy(&(mem->data[mem->size]), ptr, realsize);
+    mem->size += realsize;
+    mem->data[mem->size] = '\0';
+  }
+
+  return realsize;
+} /* }}} */
+
+size_t curl_write_tarball(void *ptr, size_t size, size_t nmemb, void *stream) { /* {{{ */
+  struct tarball_t *tarball = (struct tarball_t*)stream;
+
+  EVP_DigestUpdate(tarball->digest, ptr, size * nmemb);
+  return curl_write_response(ptr, size, nmemb, &tarball->response);
+} /* }}} */
+
+/**
+ * Makes sure the daemon's view of the dbs is current, reloading them when
+ * pacman has touched them since, or when a request wants a different set
+ * of repos. The IgnorePkg entries found in pacman.conf are remembered, so
+ * that each request gets them without reading it again.
+ */
+int daemon_alpm_refresh() { /* {{{ */
+  const alpm_list_t *i;
+  alpm_list_t *userpkgs;
+  char *stamp;
+  double start;
+  int ret;
+
+  if (alpm_ready) {
+    stamp = daemon_alpm_stamp();
+    if (!stamp || !server.alpmstamp || !STREQ(stamp, server.alpmstamp)) {
+      cwr_printf(LOG_DEBUG, "databases have changed, reloading\n");
+      provider_index_free(&local_index);
+      provider_index_free(&sync_index);
+      alpm_release();
+      alpm_ready = 0;
+    }
+    free(stamp);
+  }
+
+  if (!alpm_ready) {
+    start = now_ms();
+    alpm_ready = 1;
+
+    userpkgs = cfg.ignore.pkgs;
+    cfg.ignore.pkgs = NULL;
+    ret = alpm_init(1);
+    FREELIST(server.ignorepkgs);
+    server.ignorepkgs = cfg.ignore.pkgs;
+    cfg.ignore.pkgs = userpkgs;
+
+    if (ret != 0 || (ret = alpm_index_dbs(1)) != 0) {
+      return ret;
+    }
+    stats_add_phase(STAT_PHASE_ALPM, now_ms() - start);
+    trace_end("alpm", "alpm init", NULL, start);
+
+    FREE(server.alpmstamp);
+    server.alpmstamp = daemon_alpm_stamp();
+  }
+
+  for (i = server.ignorepkgs; i; i = alpm_list_next(i)) {
+    if (!alpm_list_find_str(cfg.ignore.pkgs, alpm_list_getdata(i))) {
+      cfg.ignore.pkgs = alpm_list_add(cfg.ignore.pkgs, strdup(alpm_list_getdata(i)));
+    }
+  }
+
+  return 0;
+} /* }}} */
+
+/**
+ * Describes the dbs as loaded: their files on disk, pacman.conf, and the
+ * options that decide which repos get registered.
+ */
+char *daemon_alpm_stamp() { /* {{{ */
+  const alpm_list_t *i;
+  char *dbstamp, *buf;
+  size_t len;
+  struct stat st;
+  FILE *fp;
+
+  if (!(dbstamp = cache_foreign_stamp())) {
+    return NULL;
+  }
+  if (!(fp = open_memstream(&buf, &len))) {
+    free(dbstamp);
+    return NULL;
+  }
+
+  fprintf(fp, "%s", dbstamp);
+  if (stat("/etc/pacman.conf", &st) == 0) {
+    fprintf(fp, " conf:%ld.%09ld", (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+  }
+  fprintf(fp, " skip:%d", cfg.skiprepos);
+  for (i = cfg.ignore.repos; i; i = alpm_list_next(i)) {
+    fprintf(fp, " -%s", (const char*)alpm_list_getdata(i));
+  }
+
+  fclose(fp);
+  free(dbstamp);
+  return buf;
+} /* }}} */
+
+const struct recording_t *daemon_cache_get(const char *url) { /* {{{ */
+  const struct recording_t *rec = NULL;
+
+  trace_mutex_lock(&server.cachelock, "cache_lock");
+  if (server.cache) {
+    rec = hashtable_get(server.cache, url);
+  }
+  pthread_mutex_unlock(&server.cachelock);
+
+  /* entries are only ever freed between requests, so this one stays put */
+  if (rec && now_ms() - rec->stored > DAEMON_CACHE_TTL * 1000.0) {
+    return NULL;
+  }
+
+  return rec;
+} /* }}} */
+
+/**
+ * Drops expired responses. There is no removing from a hashtable, so the
+ * survivors move to a new one. Only called between requests, when nothing
+ * else can be looking.
+ */
+void daemon_cache_purge() { /* {{{ */
+  struct hashtable_t *fresh;
+  struct recording_t *rec;
+  double now = now_ms();
+  size_t n;
+
+  if (!server.cache || !(fresh = hashtable_new(server.cache->count))) {
+    return;
+  }
+
+  for (n = 0; n < server.cache->size; n++) {
+    if (!server.cache->entries[n].key) {
+      continue;
+    }
+    rec = server.cache->entries[n].value;
+    if (now - rec->stored > DAEMON_CACHE_TTL * 1000.0) {
+      free(rec);
+    } else {
+      hashtable_add(fresh, rec->url, rec);
+    }
+  }
+
+  hashtable_free(server.cache, NULL);
+  server.cache = fresh;
+} /* }}} */
+
+void daemon_cache_put(const char *url, long httpcode, const char *body, size_t len) { /* {{{ */
+  struct recording_t *rec;
+  size_t urllen = strlen(url);
+
+  MALLOC(rec, sizeof *rec + urllen + 1 + len, return);
+  rec->url = (char*)(rec + 1);
+  memcpy(rec->url, url, urllen + 1);
+  rec->body = rec->url + urllen + 1;
+  if (len) {
+    memcpy(rec->body, body, len);
+  }
+  rec->len = len;
+  rec->httpcode = httpcode;
+  rec->stored = now_ms();
+
+  trace_mutex_lock(&server.cachelock, "cache_lock");
+  if (!server.cache) {
+    server.cache = hashtable_new(0);
+  }
+  /* another worker may have fetched the same url in the meantime */
+  if (!server.cache || hashtable_add(server.cache, rec->url, rec) != 0) {
+    free(rec);
+  }
+  pthread_mutex_unlock(&server.cachelock);
+} /* }}} */
+
+/**
+ * Asks a running daemon to do the work instead. The daemon is given our
+ * arguments, our working directory and our standard streams, so that it
+ * can act exactly as we would have, and it hands back our exit status.
+ * It's also shown the parts of our environment listed in daemon_env, and
+ * turns us away if they aren't the same as its own.
+ * Returns -1 if there's no daemon, or it won't take the request, in which
+ * case nothing has been done yet.
+ */
+int daemon_client(int argc, char *argv[]) { /* {{{ */
+  struct sockaddr_un addr;
+  struct daemon_frame_t frame;
+  struct ucred cred;
+  socklen_t credlen = sizeof cred;
+  char *path, *payload = NULL, *reply = NULL, *p;
+  const char **name, *value;
+  int fd = -1, fds[DAEMON_FDS], i, ret = -1;
+  int32_t status;
+  size_t len = 1;
+
+  if (!(path = daemon_socket_path())) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr.sun_path) {
+    goto finish;
+  }
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+    goto finish;
+  }
+
+  /* our streams are about to be handed over, so make sure it's to us */
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+      cred.uid != getuid()) {
+    goto finish;
+  }
+
+  /* the environment goes first as NAME=value strings, ended by an empty
+   * one, and the arguments follow */
+  for (name = daemon_env; *name; name++) {
+    if ((value = getenv(*name))) {
+      len += strlen(*name) + strlen(value) + 2;
+    }
+  }
+  for (i = 1; i < argc; i++) {
+    len += strlen(argv[i]) + 1;
+  }
+  MALLOC(payload, len + 1, goto finish);
+  for (name = daemon_env, p = payload; *name; name++) {
+    if ((value = getenv(*name))) {
+      p += sprintf(p, "%s=%s", *name, value) + 1;
+    }
+  }
+  *p++ = '\0';
+  for (i = 1; i < argc; i++) {
+    p = stpcpy(p, argv[i]) + 1;
+  }
+
+  fds[0] = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (fds[0] < 0) {
+    goto finish;
+  }
+  fds[1] = STDIN_FILENO;
+  fds[2] = STDOUT_FILENO;
+  fds[3] = STDERR_FILENO;
+
+  i = daemon_send(fd, DAEMON_MSG_RUN, payload, len, fds, DAEMON_FDS);
+  close(fds[0]);
+  if (i != 0) {
+    goto finish;
+  }
+
+  /* the request is out of our hands, so there's no falling back now */
+  ret = 1;
+  if (daemon_recv(fd, &frame, &reply, NULL, NULL) != 0) {
+    fprintf(stderr, "error: lost connection to the cower daemon\n");
+    goto finish;
+  }
+
+  if (frame.type == DAEMON_MSG_REFUSED) {
+    ret = -1;
+  } else if (frame.type == DAEMON_MSG_EXIT && frame.len == sizeof status) {
+    memcpy(&status, reply, sizeof status);
+    ret = status;
+  }
+
+finish:
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(reply);
+  free(payload);
+  free(path);
+
+  return ret;
+} /* }}} */
+
+/**
+ * Compares the environment a client sent, a run of NAME=value strings
+ * ending at end, with our own. Only the variables in daemon_env count, and
+ * one set on one side only differs as much as one with another value.
+ */
+int daemon_env_differs(const char *env, const char *end) { /* {{{ */
+  const char **name, *p, *ours, *theirs;
+  size_t namelen;
+
+  for (name = daemon_env; *name; name++) {
+    namelen = strlen(*name);
+    theirs = NULL;
+    for (p = env; p < end; p += strlen(p) + 1) {
+      if (strncmp(p, *name, namelen) == 0 && p[namelen] == '=') {
+        theirs = p + namelen + 1;
+        break;
+      }
+    }
+
+    ours = getenv(*name);
+    if ((ours == NULL) != (theirs == NULL) || (ours && !STREQ(ours, theirs))) {
+      cwr_printf(LOG_DEBUG, "client has a different %s\n", *name);
+      return 1;
+    }
+  }
+
+  return 0;
+} /* }}} */
+
+/**
+ * Runs as a daemon, answering requests from clients one at a time until
+ * told to stop. Between requests, the daemon holds on to the loaded dbs and
+ * their indexes, open connections to the AUR, and recent responses.
+ */
+int daemon_main(int argc, char *argv[]) { /* {{{ */
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  int fd = -1, client, bound = 0, i, ret;
+  mode_t mask;
+
+  startup = now_ms();
+
+  memset(&cfg, 0, sizeof cfg);
+  cfg.color = cfg.maxthreads = cfg.timeout = cfg.replaydelay = UNSET;
+  cfg.tarballcache = UNSET;
+  cfg.delim = LIST_DELIM;
+  cfg.logmask = LOG_ERROR|LOG_WARN|LOG_INFO;
+  cfg.proto = "https";
+
+  /* only the logging options mean anything here */
+  ret = parse_options(argc, argv);
+  if (ret != 0 && ret != 3) {
+    return ret;
+  }
+  if ((ret = parse_configfile()) != 0) {
+    return ret;
+  }
+  cfg.color = 0;
+  cfg.timeout = cfg.timeout == UNSET ? TIMEOUT_DEFAULT : cfg.timeout;
+  server.logmask = cfg.logmask;
+  if ((ret = strings_init()) != 0) {
+    return ret;
+  }
+  ret = 1;
+
+  if (!(server.path = daemon_socket_path())) {
+    goto finish;
+  }
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen(server.path) >= sizeof addr.sun_path) {
+    cwr_fprintf(stderr, LOG_ERROR, "socket path is too long: %s\n", server.path);
+    goto finish;
+  }
+  strcpy(addr.sun_path, server.path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to create socket: %s\n", strerror(errno));
+    goto finish;
+  }
+
+  /* a socket nobody answers on is left over from a daemon that didn't get
+   * to clean up after itself */
+  if (connect(fd, (struct sockaddr*)&addr, sizeof addr) == 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "a daemon is already listening on %s\n", server.path);
+    goto finish;
+  }
+  unlink(server.path);
+
+  mask = umask(0177);
+  i = bind(fd, (struct sockaddr*)&addr, sizeof addr);
+  umask(mask);
+  if (i != 0 || listen(fd, SOMAXCONN) != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to listen on %s: %s\n", server.path,
+        strerror(errno));
+    goto finish;
+  }
+  bound = 1;
+
+  /* no SA_RESTART, so that accept notices */
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = daemon_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  /* a client going away mid-request mustn't take the daemon with it */
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  for (i = 0; i < 3; i++) {
+    server.stdio[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+  }
+  server.cwd = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  server.active = 1;
+
+  /* do up front what every request would otherwise pay for */
+  pthread_once(&curl_once, curl_global_setup);
+  if (curl_ready != 1) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to initialize curl\n");
+    goto finish;
+  }
+  if (daemon_alpm_refresh() != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to initialize alpm library\n");
+    goto finish;
+  }
+  FREELIST(cfg.ignore.pkgs);
+  FREELIST(cfg.ignore.repos);
+  FREE(cfg.aurhost);
+
+  cwr_printf(LOG_INFO, "listening on %s\n", server.path);
+  fflush(stdout);
+
+  while (!server.stopping) {
+    client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      cwr_fprintf(stderr, LOG_ERROR, "accept: %s\n", strerror(errno));
+      goto finish;
+    }
+    daemon_serve(client);
+    close(client);
+    daemon_cache_purge();
+  }
+  ret = 0;
+
+finish:
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (bound) {
+    unlink(server.path);
+  }
+  FREE(server.path);
+
+  if (server.active) {
+    for (i = 0; i < 3; i++) {
+      close(server.stdio[i]);
+    }
+    close(server.cwd);
+  }
+
+  for (i = 0; i < server.nhandles; i++) {
+    curl_easy_cleanup(server.handles[i]);
+  }
+  hashtable_free(server.cache, free);
+  provider_index_free(&local_index);
+  provider_index_free(&sync_index);
+  FREELIST(server.ignorepkgs);
+  FREE(server.alpmstamp);
+  FREELIST(cfg.ignore.pkgs);
+  FREELIST(cfg.ignore.repos);
+  FREE(cfg.aurhost);
+  FREE(colstr);
+
+  if (curl_ready == 1) {
+    if (curl_share) {
+      curl_share_cleanup(curl_share);
+    }
+    openssl_crypto_cleanup();
+    curl_global_cleanup();
+  }
+
+  if (alpm_ready) {
+    alpm_release();
+  }
+
+  return ret;
+} /* }}} */
+
+/**
+ * Reads a frame, its payload, and any file descriptors passed along with
+ * it. The payload is nul terminated for the reader's convenience.
+ */
+int daemon_recv(int fd, struct daemon_frame_t *frame, char **payload, int *fds, int *nfds) { /* {{{ */
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(DAEMON_FDS * sizeof(int))];
+  } control;
+  struct iovec iov = { frame, sizeof *frame };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int received[DAEMON_FDS], nreceived = 0, i;
+  size_t have, count;
+  ssize_t got;
+
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+
+  *payload = NULL;
+
+  do {
+    got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (got < 0 && errno == EINTR);
+  if (got <= 0) {
+    return 1;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (count > DAEMON_FDS) {
+        count = DAEMON_FDS;
+      }
+      memcpy(received, CMSG_DATA(cmsg), count * sizeof(int));
+      nreceived = count;
+    }
+  }
+
+  /* the rest of the frame and the payload come as plain bytes */
+  for (have = got; have < sizeof *frame; have += got) {
+    got = read(fd, (char*)frame + have, sizeof *frame - have);
+    if (got <= 0 && !(got < 0 && errno == EINTR)) {
+      goto fail;
+    }
+    got = got < 0 ? 0 : got;
+  }
+
+  if (frame->len > DAEMON_PAYLOAD_MAX) {
+    goto fail;
+  }
+  MALLOC(*payload, (size_t)frame->len + 1, goto fail);
+  for (have = 0; have < frame->len; have += got) {
+    got = read(fd, *payload + have, frame->len - have);
+    if (got <= 0 && !(got < 0 && errno == EINTR)) {
+      goto fail;
+    }
+    got = got < 0 ? 0 : got;
+  }
+  (*payload)[frame->len] = '\0';
+
+  if (fds) {
+    memcpy(fds, received, nreceived * sizeof(int));
+    *nfds = nreceived;
+  } else {
+    for (i = 0; i < nreceived; i++) {
+      close(received[i]);
+    }
+  }
+
+  return 0;
+
+fail:
+  for (i = 0; i < nreceived; i++) {
+    close(received[i]);
+  }
+  FREE(*payload);
+  return 1;
+} /* }}} */
+
+int daemon_send(int fd, daemon_msg_t type, const void *payload, uint32_t len,
+    const int *fds, int nfds) { /* {{{ */
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(DAEMON_FDS * sizeof(int))];
+  } control;
+  struct daemon_frame_t frame;
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t sent;
+  size_t have, total = sizeof frame + len;
+  char *buf;
+  int ret = 1;
+
+  frame.version = DAEMON_PROTOCOL;
+  frame.type = type;
+  frame.len = len;
+
+  MALLOC(buf, total, return 1);
+  memcpy(buf, &frame, sizeof frame);
+  if (len) {
+    memcpy(buf + sizeof frame, payload, len);
+  }
+  iov[0].iov_base = buf;
+  iov[0].iov_len = total;
+
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  if (nfds > 0 && nfds <= DAEMON_FDS) {
+    memset(&control, 0, sizeof control);
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+
+  do {
+    sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0) {
+    goto finish;
+  }
+
+  /* the descriptors went with the first piece, and the rest is just bytes */
+  for (have = sent; have < total; have += sent) {
+    sent = send(fd, buf + have, total - have, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        sent = 0;
+        continue;
+      }
+      goto finish;
+    }
+  }
+  ret = 0;
+
+finish:
+  free(buf);
+  return ret;
+} /* }}} */
+
+/**
+ * Runs a single request on behalf of a client, as though the client had
+ * run it: its streams stand in for ours, and its working directory for
+ * ours, until the request is done. Its environment can't stand in for
+ * ours in a process full of threads, so a client whose environment would
+ * change the results is refused, and runs the request itself.
+ */
+void daemon_serve(int fd) { /* {{{ */
+  struct daemon_frame_t frame;
+  struct ucred cred;
+  socklen_t credlen = sizeof cred;
+  char *payload = NULL, **argv = NULL, *args, *p;
+  int fds[DAEMON_FDS], nfds = 0, argc, i;
+  int32_t status;
+
+  if (daemon_recv(fd, &frame, &payload, fds, &nfds) != 0) {
+    return;
+  }
+
+  /* only the user running the daemon gets to use it, and only with the
+   * protocol it speaks */
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+      cred.uid != getuid() || frame.version != DAEMON_PROTOCOL ||
+      frame.type != DAEMON_MSG_RUN || nfds != DAEMON_FDS) {
+    cwr_printf(LOG_DEBUG, "refusing request\n");
+    daemon_send(fd, DAEMON_MSG_REFUSED, NULL, 0, NULL, 0);
+    goto finish;
+  }
+
+  /* the environment and then the arguments arrive as runs of nul
+   * terminated strings, with an empty one between them */
+  for (p = payload; p < payload + frame.len && *p; p += strlen(p) + 1);
+  if (p >= payload + frame.len || daemon_env_differs(payload, p)) {
+    cwr_printf(LOG_DEBUG, "refusing request\n");
+    daemon_send(fd, DAEMON_MSG_REFUSED, NULL, 0, NULL, 0);
+    goto finish;
+  }
+  args = p + 1;
+
+  for (argc = 1, p = args; p < payload + frame.len; p += strlen(p) + 1) {
+    argc++;
+  }
+  CALLOC(argv, argc + 1, sizeof *argv,
+      daemon_send(fd, DAEMON_MSG_REFUSED, NULL, 0, NULL, 0); goto finish);
+  argv[0] = "cower";
+  for (i = 1, p = args; i < argc; i++, p += strlen(p) + 1) {
+    argv[i] = p;
+  }
+
+  cwr_printf(LOG_DEBUG, "serving request from pid %d\n", (int)cred.pid);
+  fflush(stdout);
+  fflush(stderr);
+
+  if (fchdir(fds[0]) != 0) {
+    daemon_send(fd, DAEMON_MSG_REFUSED, NULL, 0, NULL, 0);
+    goto finish;
+  }
+  for (i = 0; i < 3; i++) {
+    dup2(fds[i + 1], i);
+  }
+  FREE(colstr);
+
+  status = cower_run(argc, argv);
+
+  fflush(stdout);
+  fflush(stderr);
+  for (i = 0; i < 3; i++) {
+    dup2(server.stdio[i], i);
+  }
+  if (fchdir(server.cwd) != 0) {
+    server.stopping = 1;
+  }
+
+  /* back to the daemon's own settings for its own messages */
+  FREE(colstr);
+  cfg.color = 0;
+  cfg.logmask = server.logmask;
+  strings_init();
+
+  cwr_printf(LOG_DEBUG, "request from pid %d finished with %d\n", (int)cred.pid, status);
+  daemon_send(fd, DAEMON_MSG_EXIT, &status, sizeof status, NULL, 0);
+
+finish:
+  for (i = 0; i < nfds; i++) {
+    close(fds[i]);
+  }
+  free(argv);
+  free(payload);
+} /* }}} */
+
+void daemon_signal(int signum) { /* {{{ */
+  (void)signum;
+  server.stopping = 1;
+} /* }}} */
+
+char *daemon_socket_path() { /* {{{ */
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  char *path;
+  int ret;
+
+  if (runtime && *runtime) {
+    ret = cwr_asprintf(&path, "%s/cower.sock", runtime);
+  } else {
+    ret = cwr_asprintf(&path, "/tmp/cower-%d.sock", (int)getuid());
+  }
+
+  return ret < 0 ? NULL : path;
+} /* }}} */
+
+void debug_phase(const char *phase) { /* {{{ */
+  if (!(cfg.logmask & LOG_DEBUG)) {
+    return;
+  }
+  cwr_printf(LOG_DEBUG, "%s\n", phase);
+} /* }}} */
+
+void digest_hex(EVP_MD_CTX *digest, char *hex) { /* {{{ */
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len, n;
+
+  EVP_DigestFinal_ex(digest, md, &len);
+  for (n = 0; n < len; n++) {
+    sprintf(hex + n * 2, "%02x", md[n]);
+  }
+  hex[len * 2] = '\0';
+} /* }}} */
+
+/**
+ * Reads a whole file into memory, NUL terminated like anything else held in
+ * a response_t.
+ */
+int file_read(const char *path, struct response_t *file) { /* {{{ */
+  struct stat st;
+  int fd, ret = 1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    goto finish;
+  }
+
+  MALLOC(file->data, st.st_size + 1, goto finish);
+  if (read(fd, file->data, st.st_size) != st.st_size) {
+    FREE(file->data);
+    goto finish;
+  }
+  file->size = st.st_size;
+  file->data[file->size] = '\0';
+  ret = 0;
+
+finish:
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  return ret;
+} /* }}} */
+
+alpm_list_t *filter_results(alpm_list_t *list) { /* {{{ */
+  const alpm_list_t *i, *j;
+  alpm_list_t *filterlist = NULL;
+
+  if (!(cfg.opmask & OP_SEARCH)) {
+    return list;
+  }
+
+  for (i = cfg.targets; i; i = alpm_list_next(i)) {
+    regex_t regex;
+    const char *targ = (const char*)alpm_list_getdata(i);
+    filterlist = NULL;
+
+    if (regcomp(&regex, targ, REGEX_OPTS) == 0) {
+      for (j = list; j; j = alpm_list_next(j)) {
+        struct aurpkg_t *pkg = alpm_list_getdata(j);
+        const char *name = pkg->name;
+        const char *desc = pkg->desc;
+
+        if (regexec(&regex, name, 0, 0, 0) != REG_NOMATCH ||
+            regexec(&regex, desc, 0, 0, 0) != REG_NOMATCH) {
+          filterlist = alpm_list_add(filterlist, pkg);
+        } else {
+          aurpkg_free(pkg);
+        }
+      }
+      regfree(&regex);
+    }
+
+    /* switcheroo */
+    alpm_list_free(list);
+    list = filterlist;
+  }
+
+  return alpm_list_msort(filterlist, alpm_list_count(filterlist), aurpkg_cmp);
+} /* }}} */
+
+/**
+ * Turns a --format string into a list of ops, so that printing a package
+ * never has to look at the format string again. Literal text (with escapes
+ * already resolved) is merged into runs, and bad specifiers are reported
+ * here instead of turning up as '?' in the output.
+ */
+int format_compile(const char *format) { /* {{{ */
+  const char *p;
+  char *literal;
+  size_t litlen = 0, nops = 0;
+  struct format_op_t *op;
+
+  /* there can never be more ops than characters, plus the terminator */
+  CALLOC(format_ops, strlen(format) + 1, sizeof *format_ops, return 1);
+  CALLOC(literal, strlen(format) + 1, sizeof(char), return 1);
+
+  for (p = format; *p; p++) {
+    if (*p == '\\') {
+      int c;
+      if (*++p == '\0') {
+        break;
+      }
+      if ((c = unescape_char(*p)) >= 0) {
+        literal[litlen++] = c;
+      }
+      continue;
+    } else if (*p != '%') {
+      literal[litlen++] = *p;
+      continue;
+    }
+
+    /* a conversion specifier. only the width and '-' flag mean anything for
+     * a string, but the rest are still accepted */
+    const char *spec = p++;
+    size_t flaglen = strspn(p, printf_flags);
+    int leftalign = memchr(p, '-', flaglen) != NULL;
+    int width = atoi(p + flaglen);
+
+    p += flaglen;
+    p += strspn(p, digits);
+
+    switch (*p) {
+      case '%':
+        literal[litlen++] = '%';
+        continue;
+      case 'c': case 'd': case 'i': case 'l': case 'n':
+      case 'o': case 'p': case 't': case 'u': case 'v':
+      case 'C': case 'D': case 'M': case 'O': case 'P': case 'R':
+        break;
+      case '\0':
+        cwr_fprintf(stderr, LOG_ERROR, "incomplete format specifier `%s' in format string\n",
+            spec);
+        goto error;
+      default:
+        cwr_fprintf(stderr, LOG_ERROR, "invalid format specifier `%.*s' in format string\n",
+            (int)(p - spec + 1), spec);
+        goto error;
+    }
+
+    /* flush pending literal text ahead of the field */
+    if (litlen) {
+      op = &format_ops[nops++];
+      op->type = FORMAT_LITERAL;
+      op->text = strndup(literal, litlen);
+      op->textlen = litlen;
+      litlen = 0;
+    }
+
+    op = &format_ops[nops++];
+    op->field = *p;
+    op->width = width;
+    op->leftalign = leftalign;
+    if (isupper((unsigned char)*p)) {
+      const char *d;
+      op->type = FORMAT_LIST;
+      CALLOC(op->text, strlen(cfg.delim) + 1, sizeof(char), goto error);
+      for (d = cfg.delim; *d; d++) {
+        int c;
+        if (*d != '\\') {
+          op->text[op->textlen++] = *d;
+        } else if (*++d == '\0') {
+          break;
+        } else if ((c = unescape_char(*d)) >= 0) {
+          op->text[op->textlen++] = c;
+        }
+      }
+    } else {
+      op->type = FORMAT_FIELD;
+      if (*p == 'p') {
+        op->textlen = cwr_asprintf(&op->text, AUR_PKG_URL_FORMAT, cfg.proto,
+            cfg.aurhost);
+      }
+    }
+  }
+
+  if (litlen) {
+    op = &format_ops[nops++];
+    op->type = FORMAT_LITERAL;
+    op->text = strndup(literal, litlen);
+    op->textlen = litlen;
+  }
+
+  free(literal);
+  return 0;
+
+error:
+  free(literal);
+  format_free();
+  return 1;
+} /* }}} */
+
+void format_free() { /* {{{ */
+  struct format_op_t *op;
+
+  if (!format_ops) {
+    return;
+  }
+
+  for (op = format_ops; op->type != FORMAT_END; op++) {
+    free(op->text);
+  }
+  FREE(format_ops);
+} /* }}} */
+
+alpm_list_t *get_aur_comments(CURL *curl, const char *url) { /* {{{ */
+  struct comment_parser_t parser;
+  struct request_t request;
+  CURLcode curlstat;
+
+  curl = curl_init_easy_handle(curl);
+
+  memset(&parser, 0, sizeof(parser));
+  parser.max = cfg.maxcomments;
+
+  memset(&request, 0, sizeof request);
+  request.type = STAT_REQUEST_COMMENTS;
+  request.url = url;
+  request.writefn = curl_write_comments;
+  request.writedata = &parser;
+
+  curlstat = transport_fetch(curl, &request);
+  free(parser.pending);
+
+  /* a write error is how we hang up once we have enough comments */
+  if (curlstat == CURLE_WRITE_ERROR && parser.max && parser.count >= parser.max) {
+    cwr_fprintf(stderr, LOG_DEBUG, "%s: stopped after %d comments\n", url,
+        parser.count);
+    return parser.comments;
+  }
+
+  if (curlstat != CURLE_OK) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", url, curl_easy_strerror(curlstat));
+    return parser.comments;
+  }
+
+  if (!(request.httpcode == 200 || request.httpcode == 404)) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: server responded with http%ld\n",
+        url, request.httpcode);
+  }
+
+  return parser.comments;
+} /* }}} */
+
+int getcols() { /* {{{ */
+  static int termwidth = -1;
+  const int default_tty = 80;
+  const int default_notty = 0;
+
+  /* the ioctl is only repeated once the terminal has been resized */
+  if (!termwidth_stale) {
+    return termwidth;
+  }
+  termwidth_stale = 0;
+
+  if(!isatty(fileno(stdout))) {
+    termwidth = default_notty;
+    return termwidth;
+  }
+
+  termwidth = -1;
+#ifdef TIOCGSIZE
+  struct ttysize win;
+  if(ioctl(1, TIOCGSIZE, &win) == 0) {
+    termwidth = win.ts_cols;
+  }
+#elif defined(TIOCGWINSZ)
+  struct winsize win;
+  if(ioctl(1, TIOCGWINSZ, &win) == 0) {
+    termwidth = win.ws_col;
+  }
+#endif
+  termwidth = termwidth <= 0 ? default_tty : termwidth;
+  return termwidth;
+} /* }}} */
+
+/**
+ * A set of string keys, each with an optional value, using open addressing
+ * with linear probing. Keys are not copied, so they need to outlive the
+ * table. Lookups never modify the table and are safe to share between
+ * threads once it has been filled.
+ */
+int hashtable_add(struct hashtable_t *table, const char *key, void *value) { /* {{{ */
+  size_t idx;
+
+  /* keep the load factor under one half so probe chains stay short */
+  if ((table->count + 1) * 2 > table->size &&
+      hashtable_resize(table, table->size * 2) != 0) {
+    return -1;
+  }
+
+  for (idx = hashtable_hash(key) & (table->size - 1);
+       table->entries[idx].key;
+       idx = (idx + 1) & (table->size - 1)) {
+    if (STREQ(table->entries[idx].key, key)) {
+      return 1;
+    }
+  }
+
+  table->entries[idx].key = key;
+  table->entries[idx].value = value;
+  table->count++;
+
+  return 0;
+} /* }}} */
+
+void hashtable_free(struct hashtable_t *table, void (*freefn)(void*)) { /* {{{ */
+  size_t n;
+
+  if (!table) {
+    return;
+  }
+
+  if (freefn) {
+    for (n = 0; n < table->size; n++) {
+      if (table->entries[n].key) {
+        freefn(table->entries[n].value);
+      }
+    }
+  }
+
+  free(table->entries);
+  free(table);
+} /* }}} */
+
+void *hashtable_get(const struct hashtable_t *table, const char *key) { /* {{{ */
+  size_t idx;
+
+  for (idx = hashtable_hash(key) & (table->size - 1);
+       table->entries[idx].key;
+       idx = (idx + 1) & (table->size - 1)) {
+    if (STREQ(table->entries[idx].key, key)) {
+      /* a key without a value still needs to test true */
+      return table->entries[idx].value ? table->entries[idx].value :
+        (void*)table->entries[idx].key;
+    }
+  }
+
+  return NULL;
+} /* }}} */
+
+unsigned long hashtable_hash(const char *key) { /* {{{ */
+  /* 32-bit FNV-1a */
+  unsigned long hash = 2166136261UL;
+
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+  }
+
+  return hash;
+} /* }}} */
+
+struct hashtable_t *hashtable_new(size_t hint) { /* {{{ */
+  struct hashtable_t *table;
+  size_t size = 16;
+
+  while (size < hint * 2) {
+    size *= 2;
+  }
+
+  MALLOC(table, sizeof *table, return NULL);
+  CALLOC(table->entries, size, sizeof *table->entries, free(table); return NULL);
+  table->size = size;
+
+  return table;
+} /* }}} */
+
+int hashtable_resize(struct hashtable_t *table, size_t size) { /* {{{ */
+  struct hashtable_entry_t *old = table->entries;
+  size_t n, oldsize = table->size;
+
+  CALLOC(table->entries, size, sizeof *table->entries, table->entries = old; return -1);
+  table->size = size;
+  table->count = 0;
+
+  for (n = 0; n < oldsize; n++) {
+    if (old[n].key) {
+      hashtable_add(table, old[n].key, old[n].value);
+    }
+  }
+  free(old);
+
+  return 0;
+} /* }}} */
+
+/**
+ * Strips html tags and decodes character references in a single pass,
+ * writing the text to the buffer given to html_decode_init. Input may be
+ * fed in any number of pieces. The output is never longer than the input,
+ * so a buffer as large as the input plus one is always sufficient. Tabs and
+ * runs of newlines are squeezed out.
+ */
+void html_decode(struct html_decoder_t *dec, const char *html, size_t len) { /* {{{ */
+  const char *p, *end = html + len;
+
+  /* We ignore the possibility of an html attribute containing the
+   * character '>' */
+  for (p = html; p < end; p++) {
+    switch (dec->state) {
+      case READING_TAG:
+        if (*p == '>') { /* end of this tag */
+          dec->state = NOT_READING_TAG;
+        }
+        break;
+      case READING_ENTITY:
+        if (*p == ';') {
+          dec->entity[dec->entitylen++] = *p;
+          dec->entity[dec->entitylen] = '\0';
+          html_decode_entity(dec);
+          dec->state = NOT_READING_TAG;
+          break;
+        } else if ((isalnum((unsigned char)*p) || *p == '#') &&
+                   dec->entitylen < sizeof(dec->entity) - 2) {
+          dec->entity[dec->entitylen++] = *p;
+          break;
+        }
+        /* not a reference after all. pass it through and reconsider this
+         * character on its own */
+        dec->entity[dec->entitylen] = '\0';
+        html_decode_entity(dec);
+        dec->state = NOT_READING_TAG;
+        /* fallthrough */
+      case NOT_READING_TAG:
+        if (*p == '<') { /* here's a new tag */
+          dec->state = READING_TAG;
+        } else if (*p == '&') {
+          dec->state = READING_ENTITY;
+          dec->entity[0] = *p;
+          dec->entitylen = 1;
+        } else {
+          html_decode_putc(dec, *p);
+        }
+        break;
+    }
+  }
+} /* }}} */
+
+void html_decode_entity(struct html_decoder_t *dec) { /* {{{ */
+  const struct html_character_codes_t *code;
+  const char *p, *ref = dec->entity + 1;
+  char *end;
+  unsigned long cp;
+
+  if (dec->entity[dec->entitylen - 1] != ';') {
+    goto literal;
+  }
+
+  if (*ref == '#') {
+    int hex = (ref[1] == 'x' || ref[1] == 'X');
+    ref += hex ? 2 : 1;
+    if (!(hex ? isxdigit((unsigned char)*ref) : isdigit((unsigned char)*ref))) {
+      goto literal;
+    }
+    cp = strtoul(ref, &end, hex ? 16 : 10);
+    if (*end != ';' || cp == 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+      goto literal;
+    }
+
+    /* encode as UTF-8 */
+    if (cp < 0x80) {
+      html_decode_putc(dec, cp);
+    } else if (cp < 0x800) {
+      html_decode_putc(dec, 0xC0 | (cp >> 6));
+      html_decode_putc(dec, 0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+      html_decode_putc(dec, 0xE0 | (cp >> 12));
+      html_decode_putc(dec, 0x80 | ((cp >> 6) & 0x3F));
+      html_decode_putc(dec, 0x80 | (cp & 0x3F));
+    } else {
+      html_decode_putc(dec, 0xF0 | (cp >> 18));
+      html_decode_putc(dec, 0x80 | ((cp >> 12) & 0x3F));
+      html_decode_putc(dec, 0x80 | ((cp >> 6) & 0x3F));
+      html_decode_putc(dec, 0x80 | (cp & 0x3F));
+    }
+    return;
+  }
+
+  for (code = html_character_codes; code->name_code; code++) {
+    if (STREQ(code->name_code, dec->entity)) {
+      for (p = code->glyph; *p; p++) {
+        html_decode_putc(dec, *p);
+      }
+      return;
+    }
+  }
+
+literal:
+  for (p = dec->entity; p < dec->entity + dec->entitylen; p++) {
+    html_decode_putc(dec, *p);
+  }
+} /* }}} */
+
+size_t html_decode_finish(struct html_decoder_t *dec) { /* {{{ */
+  /* a reference cut off by the end of input is just text */
+  if (dec->state == READING_ENTITY) {
+    dec->entity[dec->entitylen] = '\0';
+    html_decode_entity(dec);
+  }
+  dec->state = NOT_READING_TAG;
+  dec->out[dec->len] = '\0';
+
+  return dec->len;
+} /* }}} */
+
+void html_decode_init(struct html_decoder_t *dec, char *out) { /* {{{ */
+  dec->out = out;
+  dec->len = 0;
+  dec->state = NOT_READING_TAG;
+  dec->entitylen = 0;
+} /* }}} */
+
+void html_decode_putc(struct html_decoder_t *dec, char c) { /* {{{ */
+  /* we discard two newlines in a row and all tabs */
+  if (c == '\t' || (c == '\n' && dec->len > 0 && dec->out[dec->len - 1] == '\n')) {
+    return;
+  }
+  dec->out[dec->len++] = c;
+} /* }}} */
+
+void indentprint(const char *str, int indent) { /* {{{ */
+  const char *p, *next;
+  int cidx, cols, width;
+
+  if (!str) {
+    return;
+  }
+
+  cols = getcols();
+
+  /* if we're not a tty, print without indenting */
+  if (cols == 0) {
+    buffer_puts(str);
+    return;
+  }
+
+  p = str;
+  cidx = indent;
+
+  while (*p) {
+    if (*p == ' ') {
+      p++;
+      if (*p == ' ') {
+        continue;
+      }
+
+      /* look ahead to the end of the next word and wrap if it won't fit */
+      next = strchrnul(p, ' ');
+      width = utf8_strwidth(p, next - p);
+      if (width > (cols - cidx - 1)) {
+        buffer_printf("\n%-*s", indent, "");
+        cidx = indent;
+      } else {
+        buffer_putc(' ');
+        cidx++;
+      }
+      continue;
+    }
+
+    next = strchrnul(p, ' ');
+    buffer_append(p, next - p);
+    cidx += utf8_strwidth(p, next - p);
+    p = next;
+  }
+} /* }}} */
+
+/**
+ * Writes out everything a job said while it ran, now that its turn has come.
+ */
+void job_replay(struct job_t *job) { /* {{{ */
+  struct log_message_t *msg;
+
+  while ((msg = job->output)) {
+    job->output = msg->next;
+    fwrite(msg->text, 1, msg->len, msg->stream);
+    free(msg);
+  }
+  job->outtail = &job->output;
+} /* }}} */
+
+/**
+ * Holds on to output from a worker in the middle of a job whose output has to
+ * come out in order, and passes anything else on to log_write.
+ */
+void job_write(FILE *stream, const char *text, size_t len) { /* {{{ */
+  struct log_message_t *msg;
+
+  if (!job_current || !(msg = malloc(sizeof *msg + len))) {
+    log_write(stream, text, len);
+    return;
+  }
+
+  msg->next = NULL;
+  msg->stream = stream;
+  msg->len = len;
+  memcpy(msg->text, text, len);
+
+  *job_current->outtail = msg;
+  job_current->outtail = &msg->next;
+} /* }}} */
+
+int json_end_map(void *ctx) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  if (--parse_struct->json_depth > 0) {
+    parse_struct->pkglist = alpm_list_add_sorted(parse_struct->pkglist,
+        parse_struct->aurpkg, aurpkg_cmp);
+  }
+
+  return 1;
+} /* }}} */
+
+int json_map_key(void *ctx, const unsigned char *data, size_t size) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  strncpy(parse_struct->curkey, (const char*)data, size);
+  parse_struct->curkey[size] = '\0';
+
+  return 1;
+} /* }}} */
+
+/**
+ * The json_raw_* callbacks write each object in the RPC's results back out
+ * on a line of its own. Anything outside of the results is dropped.
+ */
+int json_raw_boolean(void *ctx, int boolean) { /* {{{ */
+  json_raw_write(ctx, boolean ? "true" : "false", boolean ? 4 : 5, 0);
+  return 1;
+} /* }}} */
+
+int json_raw_end_array(void *ctx) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  if (--parse_struct->json_depth == 1) {
+    parse_struct->rawinarray = 0;
+  }
+  if (parse_struct->rawstart) {
+    fputc(']', parse_struct->raw);
+    parse_struct->rawsep = ',';
+  }
+
+  return 1;
+} /* }}} */
+
+int json_raw_end_map(void *ctx) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  if (parse_struct->rawstart) {
+    fputc('}', parse_struct->raw);
+    parse_struct->rawsep = ',';
+    if (parse_struct->json_depth == parse_struct->rawstart) {
+      fputc('\n', parse_struct->raw);
+      parse_struct->rawcount++;
+      parse_struct->rawstart = 0;
+    }
+  }
+  parse_struct->json_depth--;
+
+  return 1;
+} /* }}} */
+
+int json_raw_map_key(void *ctx, const unsigned char *data, size_t size) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  if (parse_struct->json_depth == 1) {
+    parse_struct->rawresults = size == 7 && memcmp(data, "results", 7) == 0;
+  }
+  if (parse_struct->rawstart) {
+    json_raw_write(parse_struct, (const char*)data, size, 1);
+    fputc(':', parse_struct->raw);
+    parse_struct->rawsep = '\0';
+  }
+
+  return 1;
+} /* }}} */
+
+int json_raw_null(void *ctx) { /* {{{ */
+  json_raw_write(ctx, "null", 4, 0);
+  return 1;
+} /* }}} */
+
+int json_raw_number(void *ctx, const char *num, size_t size) { /* {{{ */
+  json_raw_write(ctx, num, size, 0);
+  return 1;
+} /* }}} */
+
+int json_raw_start_array(void *ctx) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  if (parse_struct->rawstart) {
+    json_raw_write(parse_struct, "[", 1, 0);
+    parse_struct->rawsep = '\0';
+  } else if (parse_struct->rawresults && parse_struct->json_depth == 1) {
+    parse_struct->rawinarray = 1;
+  }
+  parse_struct->json_depth++;
+
+  return 1;
+} /* }}} */
+
+int json_raw_start_map(void *ctx) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  /* an info result is an object on its own, and search results are
+   * objects in an array */
+  if (!parse_struct->rawstart && parse_struct->rawresults &&
+      (parse_struct->json_depth == 1 ||
+       (parse_struct->json_depth == 2 && parse_struct->rawinarray))) {
+    parse_struct->rawstart = parse_struct->json_depth + 1;
+    parse_struct->rawsep = '\0';
+  }
+  if (parse_struct->rawstart) {
+    json_raw_write(parse_struct, "{", 1, 0);
+    parse_struct->rawsep = '\0';
+  }
+  parse_struct->json_depth++;
+
+  return 1;
+} /* }}} */
+
+int json_raw_string(void *ctx, const unsigned char *data, size_t size) { /* {{{ */
+  json_raw_write(ctx, (const char*)data, size, 1);
+  return 1;
+} /* }}} */
+
+/**
+ * Writes a value, or the start of one, into the object being passed on,
+ * preceded by a comma if it isn't the first in its container.
+ */
+void json_raw_write(struct yajl_parser_t *parse_struct, const char *text, size_t len,
+    int string) { /* {{{ */
+  if (!parse_struct->rawstart) {
+    return;
+  }
+
+  if (parse_struct->rawsep) {
+    fputc(parse_struct->rawsep, parse_struct->raw);
+  }
+  if (string) {
+    json_write_string(parse_struct->raw, text, len);
+  } else {
+    fwrite(text, 1, len, parse_struct->raw);
+  }
+  parse_struct->rawsep = ',';
+} /* }}} */
+
+int json_start_map(void *ctx) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+
+  if (parse_struct->json_depth++ >= 1) {
+    parse_struct->aurpkg = aurpkg_new();
+  }
+
+  return 1;
+} /* }}} */
+
+int json_string(void *ctx, const unsigned char *data, size_t size) { /* {{{ */
+  struct yajl_parser_t *parse_struct = (struct yajl_parser_t*)ctx;
+  const char *val = (const char*)data;
+
+  if (STREQ(parse_struct->curkey, AUR_QUERY_TYPE) &&
+      STR_STARTS_WITH(val, AUR_QUERY_ERROR)) {
+    return 1;
+  }
+
+  if (STREQ(parse_struct->curkey, AUR_ID)) {
+    parse_struct->aurpkg->id = strndup(val, size);
+  } else if (STREQ(parse_struct->curkey, NAME)) {
+    parse_struct->aurpkg->name = strndup(val, size);
+  } else if (STREQ(parse_struct->curkey, VERSION)) {
+    parse_struct->aurpkg->ver = strndup(val, size);
+  } else if (STREQ(parse_struct->curkey, AUR_CAT)) {
+    parse_struct->aurpkg->cat = atoi(val);
+  } else if (STREQ(parse_struct->curkey, AUR_DESC)) {
+    parse_struct->aurpkg->desc = strndup(val, size);
+  } else if (STREQ(parse_struct->curkey, URL)) {
+    parse_struct->aurpkg->url = strndup(val, size);
+  } else if (STREQ(parse_struct->curkey, AUR_LICENSE)) {
+    parse_struct->aurpkg->lic = strndup(val, size);
+  } else if (STREQ(parse_struct->curkey, AUR_VOTES)) {
+    parse_struct->aurpkg->votes = strndup(val, size);
+  } else if (STREQ(parse_struct->curkey, AUR_OOD)) {
+    parse_struct->aurpkg->ood = strncmp(val, "1", 1) == 0 ? 1 : 0;
+  }
+
+  return 1;
+} /* }}} */
+
+void json_write_string(FILE *fp, const char *str, size_t len) { /* {{{ */
+  const char *end = str + len;
+
+  fputc('"', fp);
+  for (; str < end; str++) {
+    if (*str == '"' || *str == '\\') {
+      fprintf(fp, "\\%c", *str);
+    } else if ((unsigned char)*str < 0x20) {
+      fprintf(fp, "\\u%04x", *str);
+    } else {
+      fputc(*str, fp);
+    }
+  }
+  fputc('"', fp);
+} /* }}} */
+
+/**
+ * Writes out a list taken from the log queue. Messages are pushed onto the
+ * front, so the list is reversed first to put them back in order.
+ */
+void log_drain(struct log_message_t *list) { /* {{{ */
+  struct log_message_t *msg, *ordered = NULL;
+
+  while (list) {
+    msg = list;
+    list = msg->next;
+    msg->next = ordered;
+    ordered = msg;
+  }
+
+  while (ordered) {
+    msg = ordered;
+    ordered = msg->next;
+    fwrite(msg->text, 1, msg->len, msg->stream);
+    free(msg);
+  }
+} /* }}} */
+
+/**
+ * Closes the queue, waits for the writer to finish, and writes out
+ * whatever it hadn't got to. From then on, messages are written directly.
+ * This needs to happen before anything else is printed, so that nothing
+ * comes out of order.
+ */
+void log_flush() { /* {{{ */
+  struct log_message_t *pending;
+
+  if (!logq.started) {
+    return;
+  }
+
+  pending = log_take(&log_closed);
+  __atomic_store_n(&logq.stopping, 1, __ATOMIC_RELEASE);
+  sem_post(&logq.ready);
+  pthread_join(logq.writer, NULL);
+  log_drain(pending);
+
+  sem_destroy(&logq.ready);
+  logq.started = 0;
+} /* }}} */
+
+/**
+ * Starts a thread to do the writing for log messages, so that the threads
+ * logging them only ever pay for formatting and a single atomic push.
+ */
+int log_start() { /* {{{ */
+  if (sem_init(&logq.ready, 0, 0) != 0) {
+    return 1;
+  }
+
+  logq.stopping = 0;
+  if (pthread_create(&logq.writer, NULL, log_writer, NULL) != 0) {
+    sem_destroy(&logq.ready);
+    return 1;
+  }
+
+  logq.started = 1;
+  __atomic_store_n(&logq.head, NULL, __ATOMIC_RELEASE);
+
+  return 0;
+} /* }}} */
+
+/**
+ * Takes everything queued, leaving replacement in its place. Nothing can
+ * be taken from a closed queue.
+ */
+struct log_message_t *log_take(struct log_message_t *replacement) { /* {{{ */
+  struct log_message_t *head = __atomic_load_n(&logq.head, __ATOMIC_ACQUIRE);
+
+  do {
+    if (head == &log_closed) {
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n(&logq.head, &head, replacement, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  return head;
+} /* }}} */
+
+long log_tid() { /* {{{ */
+  static __thread long tid;
+
+  if (!tid) {
+    tid = syscall(SYS_gettid);
+  }
+
+  return tid;
+} /* }}} */
+
+/**
+ * Queues a message for the writer if there is one, and otherwise writes it
+ * straight out.
+ */
+void log_write(FILE *stream, const char *text, size_t len) { /* {{{ */
+  struct log_message_t *msg;
+
+  if (__atomic_load_n(&logq.head, __ATOMIC_ACQUIRE) == &log_closed ||
+      !(msg = malloc(sizeof *msg + len))) {
+    fwrite(text, 1, len, stream);
+    return;
+  }
+
+  msg->stream = stream;
+  msg->len = len;
+  memcpy(msg->text, text, len);
+
+  msg->next = __atomic_load_n(&logq.head, __ATOMIC_RELAXED);
+  do {
+    /* the queue was closed under us */
+    if (msg->next == &log_closed) {
+      fwrite(text, 1, len, stream);
+      free(msg);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&logq.head, &msg->next, msg, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  sem_post(&logq.ready);
+} /* }}} */
+
+void *log_writer(void *arg) { /* {{{ */
+  (void)arg;
+
+  trace_thread_name("log");
+  for (;;) {
+    while (sem_wait(&logq.ready) != 0 && errno == EINTR);
+    log_drain(log_take(NULL));
+    if (__atomic_load_n(&logq.stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+
+  return NULL;
+} /* }}} */
+
+int mkpath(const char *path) { /* {{{ */
+  char *dir, *slash;
+  int ret = 0;
+
+  dir = strdup(path);
+  for (slash = strchr(dir + 1, '/'); ret == 0; slash = strchr(slash + 1, '/')) {
+    if (slash) {
+      *slash = '\0';
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+      ret = 1;
+    }
+    if (!slash) {
+      break;
+    }
+    *slash = '/';
+  }
+  free(dir);
+
+  return ret;
+} /* }}} */
+
+double now_ms() { /* {{{ */
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+} /* }}} */
+
+void openssl_crypto_cleanup() { /* {{{ */
+  int i;
+
+  /* the locks only exist if curl was set up for https */
+  if (!openssl_lock.lock) {
+    return;
+  }
+
+  CRYPTO_set_locking_callback(NULL);
+
+  for (i = 0; i < CRYPTO_num_locks(); i++) {
+    pthread_mutex_destroy(&(openssl_lock.lock[i]));
+  }
+
+  OPENSSL_free(openssl_lock.lock);
+  OPENSSL_free(openssl_lock.lock_count);
+  openssl_lock.lock = NULL;
+  openssl_lock.lock_count = NULL;
+} /* }}} */
+
+void openssl_crypto_init() { /* {{{ */
+  int i;
+
+  openssl_lock.lock = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+  openssl_lock.lock_count = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(long));
+  for (i = 0; i < CRYPTO_num_locks(); i++) {
+    openssl_lock.lock_count[i] = 0;
+    pthread_mutex_init(&(openssl_lock.lock[i]), NULL);
+  }
+
+  CRYPTO_set_id_callback(openssl_thread_id);
+  CRYPTO_set_locking_callback(openssl_thread_cb);
+} /* }}} */
+
+void openssl_thread_cb(int mode, int type, const char *file, int line) { /* {{{ */
+  (void)type; (void)file; (void)line;
+
+  if (mode & CRYPTO_LOCK) {
+    pthread_mutex_lock(&(openssl_lock.lock[type]));
+    openssl_lock.lock_count[type]++;
+  } else {
+    pthread_mutex_unlock(&(openssl_lock.lock[type]));
+  }
+} /* }}} */
+
+unsigned long openssl_thread_id(void) { /* {{{ */
+  unsigned long ret;
+
+  ret = (unsigned long)pthread_self();
+  return(ret);
+} /* }}} */
+
+alpm_list_t *parse_bash_array(alpm_list_t *deplist, char *array, pkgdetail_t type) { /* {{{ */
+  char *ptr, *token;
+
+  if (!array) {
+    return NULL;
+  }
+
+  if (type == PKGDETAIL_OPTDEPENDS) {
+    const char *arrayend = rawmemchr(array, '\0');
+    for (token = array; token <= arrayend; token++) {
+      if (*token == '\'' || *token == '\"') {
+        token++;
+        ptr = strchr(token, *(token - 1));
+        *ptr = '\0';
+      } else if (isalpha(*token)) {
+        ptr = token;
+        while (!isspace(*++ptr));
+        *(ptr - 1) = '\0';
+      } else {
+        continue;
+      }
+
+      strtrim(token);
+      cwr_printf(LOG_DEBUG, "adding depend: %s\n", token);
+      deplist = alpm_list_add(deplist, strdup(token));
+
+      token = ptr;
+    }
+    return deplist;
+  }
+
+  for (token = strtok(array, " \t\n"); token; token = strtok(NULL, " \t\n")) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    /* found an embedded comment. skip to the next line */
+    if (*token == '#') {
+      strtok(NULL, "\n");
+      continue;
+    }
+
+    /* unquote the element */
+    if (*token == '\'' || *token == '\"') {
+      token++;
+      ptr = strrchr(token, *(token - 1));
+      if (ptr) {
+        *ptr = '\0';
+      }
+    }
+
+    /* some people feel compelled to do insane things in PKGBUILDs. these people suck */
+    if (!*token || strlen(token) < 2 || *token == '$') {
+      continue;
+    }
+
+    cwr_printf(LOG_DEBUG, "adding depend: %s\n", token);
+
+    trace_mutex_lock(&lock, "depends_lock");
+    if (!alpm_list_find_str(deplist, token)) {
+      deplist = alpm_list_add(deplist, strdup(token));
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  return deplist;
+} /* }}} */
+
+int parse_configfile() { /* {{{ */
+  char *xdg_config_home, *home, *config_path;
+  char line[PATH_MAX];
+  int ret = 0;
+  FILE *fp;
+
+  xdg_config_home = getenv("XDG_CONFIG_HOME");
+  if (xdg_config_home) {
+    cwr_asprintf(&config_path, "%s/cower/config", xdg_config_home);
+  } else {
+    home = getenv("HOME");
+    if (!home) {
+      cwr_fprintf(stderr, LOG_ERROR, "Unable to find path to config file.\n");
+      return 1;
+    }
+    cwr_asprintf(&config_path, "%s/.config/cower/config", getenv("HOME"));
+  }
+
+  fp = fopen(config_path, "r");
+
+  /* don't need this anymore, get rid of it ASAP */
+  free(config_path);
+
+  if (!fp) {
+    cwr_printf(LOG_DEBUG, "config file not found. skipping parsing\n");
+    return 0; /* not an error, just nothing to do here */
+  }
+
+  while (fgets(line, PATH_MAX, fp)) {
+    char *key, *val;
+
+    strtrim(line);
+    if (strlen(line) == 0 || line[0] == '#') {
+      continue;
+    }
+
+    if ((val = strchr(line, '#'))) {
+      *val = '\0';
+    }
+
+    key = val = line;
+    strsep(&val, "=");
+    strtrim(key);
+    strtrim(val);
+
+    if (val && !*val) {
+      val = NULL;
+    }
+
+    cwr_printf(LOG_DEBUG, "found config option: %s => %s\n", key, val);
+
+    /* colors are not initialized in this section, so usage of cwr_printf
+     * functions is verboten unless we're using loglevel_t LOG_DEBUG */
+    if (STREQ(key, "NoSSL")) {
+      cfg.proto = "http";
+    } else if (STREQ(key, "IgnoreRepo")) {
+      for (key = strtok(val, " "); key; key = strtok(NULL, " ")) {
+        if (!alpm_list_find_str(cfg.ignore.repos, key)) {
+          cwr_printf(LOG_DEBUG, "ignoring repo: %s\n", key);
+          cfg.ignore.repos = alpm_list_add(cfg.ignore.repos, strdup(key));
+        }
+      }
+    } else if (STREQ(key, "IgnorePkg")) {
+      for (key = strtok(val, " "); key; key = strtok(NULL, " ")) {
+        if (!alpm_list_find_str(cfg.ignore.pkgs, key)) {
+          cwr_printf(LOG_DEBUG, "ignoring package: %s\n", key);
+          cfg.ignore.pkgs = alpm_list_add(cfg.ignore.pkgs, strdup(key));
+        }
+      }
+    } else if (STREQ(key, "TargetDir")) {
+      if (val && !cfg.dlpath) {
+        wordexp_t p;
+        if (wordexp(val, &p, 0) == 0) {
+          if (p.we_wordc == 1) {
+            cfg.dlpath = strdup(p.we_wordv[0]);
+          }
+          wordfree(&p);
+          /* error on relative paths */
+          if (*cfg.dlpath != '/') {
+            fprintf(stderr, "error: TargetDir cannot be a relative path\n");
+            ret = 1;
+          }
+        } else {
+          fprintf(stderr, "error: failed to resolve option to TargetDir\n");
+          ret = 1;
+        }
+      }
+    } else if (STREQ(key, "AURHost")) {
+      if (val && !cfg.aurhost) {
+        cfg.aurhost = strdup(val);
+      }
+    } else if (STREQ(key, "MaxThreads")) {
+      if (val && cfg.maxthreads == UNSET) {
+        cfg.maxthreads = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.maxthreads <= 0) {
+          fprintf(stderr, "error: invalid option to MaxThreads: %s\n", val);
+          ret = 1;
+        }
+      }
+    } else if (STREQ(key, "ConnectTimeout")) {
+      if (val && cfg.timeout == UNSET) {
+        cfg.timeout = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.timeout < 0) {
+          fprintf(stderr, "error: invalid option to ConnectTimeout: %s\n", val);
+          ret = 1;
+        }
+      }
+    } else if (STREQ(key, "TarballCacheSize")) {
+      if (val && cfg.tarballcache == UNSET) {
+        cfg.tarballcache = strtol(val, &key, 10);
+        if (*key != '\0' || cfg.tarballcache < 0) {
+          fprintf(stderr, "error: invalid option to TarballCacheSize: %s\n", val);
+          ret = 1;
+        }
+        cfg.tarballcache *= 1024 * 1024;
+      }
+    } else if (STREQ(key, "LinkCache")) {
+      if (val && !cfg.linkcache) {
+        if (STREQ(val, "reflink")) {
+          cfg.linkcache = LINK_REFLINK;
+        } else {
+          fprintf(stderr, "error: invalid option to LinkCache: %s\n", val);
+          ret = 1;
+        }
+      }
+    } else if (STREQ(key, "Color")) {
+      if (cfg.color == UNSET) {
+        if (!val || STREQ(val, "auto")) {
+          if (isatty(fileno(stdout))) {
+            cfg.color = 1;
+          } else {
+            cfg.color = 0;
+          }
+        } else if (STREQ(val, "always")) {
+          cfg.color = 1;
+        } else if (STREQ(val, "never")) {
+          cfg.color = 0;
+        } else {
+          fprintf(stderr, "error: invalid option to Color\n");
+          return 1;
+        }
+      }
+    } else {
+      fprintf(stderr, "ignoring unknown option: %s\n", key);
+    }
+    if (ret > 0) {
+      goto finish;
+    }
+  }
+
+finish:
+  fclose(fp);
+  return ret;
+} /* }}} */
+
+int parse_options(int argc, char *argv[]) { /* {{{ */
+  int opt, option_index = 0;
+
+  static struct option opts[] = {
+    /* operations */
+    {"download",    no_argument,        0, 'd'},
+    {"info",        no_argument,        0, 'i'},
+    {"msearch",     no_argument,        0, 'm'},
+    {"search",      no_argument,        0, 's'},
+    {"update",      no_argument,        0, 'u'},
+    {"complete",    required_argument,  0, OP_COMPLETENAMES},
+    {"complete-refresh", no_argument,   0, OP_COMPLETEREFRESH},
+
+    /* options */
+    {"aurhost",     required_argument,  0, OP_AURHOST},
+    {"brief",       no_argument,        0, 'b'},
+    {"color",       optional_argument,  0, 'c'},
+    {"daemon",      no_argument,        0, OP_DAEMON},
+    {"debug",       no_argument,        0, OP_DEBUG},
+    {"deps-only",   no_argument,        0, OP_DEPSONLY},
+    {"force",       no_argument,        0, 'f'},
+    {"format",      required_argument,  0, OP_FORMAT},
+    {"help",        no_argument,        0, 'h'},
+    {"ignore",      required_argument,  0, OP_IGNOREPKG},
+    {"ignorerepo",  optional_argument,  0, OP_IGNOREREPO},
+    {"incremental", optional_argument,  0, OP_INCREMENTAL},
+    {"json",        optional_argument,  0, OP_JSON},
+    {"link-cache",  required_argument,  0, OP_LINKCACHE},
+    {"listdelim",   required_argument,  0, OP_LISTDELIM},
+    {"comments",    optional_argument,  0, 'n'},
+    {"no-daemon",   no_argument,        0, OP_NODAEMON},
+    {"nossl",       no_argument,        0, OP_NOSSL},
+    {"quiet",       no_argument,        0, 'q'},
+    {"record",      required_argument,  0, OP_RECORD},
+    {"replay",      required_argument,  0, OP_REPLAY},
+    {"replay-delay",required_argument,  0, OP_REPLAYDELAY},
+    {"stats",       optional_argument,  0, OP_STATS},
+    {"target",      required_argument,  0, 't'},
+    {"targets-from",required_argument,  0, OP_TARGETSFROM},
+    {"threads",     required_argument,  0, OP_THREADS},
+    {"trace",       required_argument,  0, OP_TRACE},
+    {"timeout",     required_argument,  0, OP_TIMEOUT},
+    {"verbose",     no_argument,        0, 'v'},
+    {"version",     no_argument,        0, 'V'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt = getopt_long(argc, argv, "bcdfhimnqst:uvV", opts, &option_index)) != -1) {
+    char *token;
+
+    switch (opt) {
+      /* operations */
+      case 's':
+        cfg.opmask |= OP_SEARCH;
+        break;
+      case 'u':
+        cfg.opmask |= OP_UPDATE;
+        break;
+      case 'i':
+        if (!(cfg.opmask & OP_INFO)) {
+          cfg.opmask |= OP_INFO;
+        } else {
+          cfg.extinfo = 1;
+        }
+        break;
+      case 'd':
+        if (!(cfg.opmask & OP_DOWNLOAD)) {
+          cfg.opmask |= OP_DOWNLOAD;
+        } else {
+          cfg.getdeps = 1;
+        }
+        break;
+      case 'm':
+        cfg.opmask |= OP_MSEARCH;
+        break;
+      case OP_COMPLETENAMES:
+        cfg.opmask |= OP_COMPLETE;
+        cfg.complete = optarg;
+        break;
+      case OP_COMPLETEREFRESH:
+        cfg.opmask |= OP_COMPLETE;
+        cfg.completerefresh = 1;
+        break;
+
+      /* options */
+      case 'b':
+        cfg.logmask |= LOG_BRIEF;
+        break;
+      case 'c':
+        if (!optarg || STREQ(optarg, "auto")) {
+          if (isatty(fileno(stdout))) {
+            cfg.color = 1;
+          } else {
+            cfg.color = 0;
+          }
+        } else if (STREQ(optarg, "always")) {
+          cfg.color = 1;
+        } else if (STREQ(optarg, "never")) {
+          cfg.color = 0;
+        } else {
+          fprintf(stderr, "invalid argument to --color\n");
+          return 1;
+        }
+        break;
+      case 'f':
+        cfg.force = 1;
+        break;
+      case 'h':
+        usage();
+        return 1;
+      case 'n':
+        if (optarg) {
+          cfg.maxcomments = strtol(optarg, &token, 10);
+          if (*token != '\0' || cfg.maxcomments < 0) {
+            fprintf(stderr, "error: invalid argument to --comments\n");
+            return 1;
+          }
+        }
+        cfg.printcomments = 1;
+        cfg.extinfo = 1;
+        break;
+      case 'q':
+        cfg.quiet = 1;
+        break;
+      case 't':
+        cfg.dlpath = strdup(optarg);
+        break;
+      case 'v':
+        cfg.logmask |= LOG_VERBOSE;
+        break;
+      case 'V':
+        version();
+        return 2;
+      case OP_AURHOST:
+        free(cfg.aurhost);
+        cfg.aurhost = strdup(optarg);
+        break;
+      case OP_DAEMON:
+      case OP_NODAEMON:
+        /* main has already seen to these */
+        break;
+      case OP_DEBUG:
+        cfg.logmask |= LOG_DEBUG;
+        break;
+      case OP_DEPSONLY:
+        cfg.opmask |= OP_DOWNLOAD;
+        cfg.getdeps = cfg.depsonly = 1;
+        break;
+      case OP_FORMAT:
+        cfg.format = optarg;
+        break;
+      case OP_IGNOREPKG:
+        for (token = strtok(optarg, ","); token; token = strtok(NULL, ",")) {
+          if (!alpm_list_find_str(cfg.ignore.pkgs, token)) {
+            cwr_printf(LOG_DEBUG, "ignoring package: %s\n", token);
+            cfg.ignore.pkgs = alpm_list_add(cfg.ignore.pkgs, strdup(token));
+          }
+        }
+        break;
+      case OP_IGNOREREPO:
+        if (!optarg) {
+          cfg.skiprepos = 1;
+        } else {
+          for (token = strtok(optarg, ","); token; token = strtok(NULL, ",")) {
+            if (!alpm_list_find_str(cfg.ignore.repos, token)) {
+              cwr_printf(LOG_DEBUG, "ignoring repos: %s\n", token);
+              cfg.ignore.repos = alpm_list_add(cfg.ignore.repos, strdup(token));
+            }
+          }
+        }
+        break;
+      case OP_INCREMENTAL:
+        cfg.incremental = UPDATE_TTL;
+        if (optarg) {
+          cfg.incremental = strtol(optarg, &token, 10);
+          if (*token != '\0' || cfg.incremental <= 0) {
+            fprintf(stderr, "error: invalid argument to --incremental\n");
+            return 1;
+          }
+        }
+        break;
+      case OP_JSON:
+        if (!optarg) {
+          cfg.json = JSON_PACKAGES;
+        } else if (STREQ(optarg, "raw")) {
+          cfg.json = JSON_RAW;
+        } else {
+          fprintf(stderr, "error: invalid argument to --json\n");
+          return 1;
+        }
+        break;
+      case OP_LINKCACHE:
+        if (STREQ(optarg, "reflink")) {
+          cfg.linkcache = LINK_REFLINK;
+        } else {
+          fprintf(stderr, "error: invalid argument to --link-cache\n");
+          return 1;
+        }
+        break;
+      case OP_LISTDELIM:
+        cfg.delim = optarg;
+        break;
+      case OP_NOSSL:
+        cfg.proto = "http";
+        break;
+      case OP_RECORD:
+        cfg.recorddir = optarg;
+        break;
+      case OP_REPLAY:
+        cfg.replaydir = optarg;
+        break;
+      case OP_REPLAYDELAY:
+        cfg.replaydelay = strtol(optarg, &token, 10);
+        if (*token != '\0' || cfg.replaydelay < 0) {
+          fprintf(stderr, "error: invalid argument to --replay-delay\n");
+          return 1;
+        }
+        break;
+      case OP_STATS:
+        if (!optarg || STREQ(optarg, "text")) {
+          cfg.stats = STATS_TEXT;
+        } else if (STREQ(optarg, "json")) {
+          cfg.stats = STATS_JSON;
+        } else {
+          fprintf(stderr, "error: invalid argument to --stats\n");
+          return 1;
+        }
+        break;
+      case OP_TARGETSFROM:
+        cfg.targetsfrom = optarg;
+        break;
+      case OP_THREADS:
+        cfg.maxthreads = strtol(optarg, &token, 10);
+        if (*token != '\0' || cfg.maxthreads <= 0) {
+          fprintf(stderr, "error: invalid argument to --threads\n");
+          return 1;
+        }
+        break;
+
+      case OP_TIMEOUT:
+        cfg.timeout = strtol(optarg, &token, 10);
+        if (*token != '\0') {
+          fprintf(stderr, "error: invalid argument to --timeout\n");
+          return 1;
+        }
+        break;
+      case OP_TRACE:
+        cfg.tracefile = optarg;
+        break;
+
+      case '?':
+        return 1;
+      default:
+        return 1;
+    }
+  }
+
+  if (!cfg.opmask) {
+    return 3;
+  }
+
+  /* check for invalid operation combos */
+  if (((cfg.opmask & OP_INFO) && (cfg.opmask & ~OP_INFO)) ||
+     ((cfg.opmask & OP_SEARCH) && (cfg.opmask & ~OP_SEARCH)) ||
+     ((cfg.opmask & OP_MSEARCH) && (cfg.opmask & ~OP_MSEARCH)) ||
+     ((cfg.opmask & OP_COMPLETE) && (cfg.opmask & ~OP_COMPLETE)) ||
+     ((cfg.opmask & (OP_UPDATE|OP_DOWNLOAD)) && (cfg.opmask & ~(OP_UPDATE|OP_DOWNLOAD)))) {
+
+    fprintf(stderr, "error: invalid operation\n");
+    return 2;
+  }
+
+  /* a search filters the results of all of its targets together */
+  if (cfg.targetsfrom && (cfg.opmask & OP_SEARCH)) {
+    fprintf(stderr, "error: --targets-from cannot be used with --search\n");
+    return 1;
+  }
+
+  if (cfg.json && (cfg.format || (cfg.opmask & (OP_DOWNLOAD|OP_COMPLETE)))) {
+    fprintf(stderr, "error: --json cannot be used with --format, --download or --complete\n");
+    return 1;
+  }
+
+  if (cfg.incremental && !(cfg.opmask & OP_UPDATE)) {
+    fprintf(stderr, "error: --incremental can only be used with --update\n");
+    return 1;
+  }
+
+  if (cfg.recorddir && cfg.replaydir) {
+    fprintf(stderr, "error: --record and --replay cannot be used together\n");
+    return 1;
+  }
+
+  while (optind < argc) {
+    if (!alpm_list_find_str(cfg.targets, argv[optind])) {
+      cwr_fprintf(stderr, LOG_DEBUG, "adding target: %s\n", argv[optind]);
+      cfg.targets = alpm_list_add(cfg.targets, strdup(argv[optind]));
+    }
+    optind++;
+  }
+
+  /* the RPC's results can only be passed on as they are when there's
+   * nothing to add to them and nothing to filter out */
+  if (cfg.json == JSON_RAW && (cfg.extinfo || (cfg.opmask & OP_UPDATE) ||
+        ((cfg.opmask & OP_SEARCH) && (alpm_list_count(cfg.targets) != 1 ||
+          strpbrk(alpm_list_getdata(cfg.targets), REGEX_CHARS))))) {
+    fprintf(stderr, "error: --json=raw only works with -i, -m, or -s with a "
+        "single plain search term\n");
+    return 1;
+  }
+
+  return 0;
+} /* }}} */
+
+void pkgbuild_get_extinfo(char *pkgbuild, alpm_list_t **details[]) { /* {{{ */
+  char *lineptr;
+  double start = now_ms();
+
+  for (lineptr = pkgbuild; lineptr; lineptr = strchr(lineptr, '\n')) {
+    char *arrayend;
+    int depth = 1, type = 0;
+    alpm_list_t **deplist;
+
+    strtrim(++lineptr);
+    if (*lineptr == '#' || strlen(lineptr) == 0) {
+      continue;
+    }
+
+    if (STR_STARTS_WITH(lineptr, PKGBUILD_DEPENDS)) {
+      deplist = details[PKGDETAIL_DEPENDS];
+    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_MAKEDEPENDS)) {
+      deplist = details[PKGDETAIL_MAKEDEPENDS];
+    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_OPTDEPENDS)) {
+      deplist = details[PKGDETAIL_OPTDEPENDS];
+      type = PKGDETAIL_OPTDEPENDS;
+    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_PROVIDES)) {
+      deplist = details[PKGDETAIL_PROVIDES];
+    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_REPLACES)) {
+      deplist = details[PKGDETAIL_REPLACES];
+    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_CONFLICTS)) {
+      deplist = details[PKGDETAIL_CONFLICTS];
+    } else {
+      continue;
+    }
+
+    if (deplist) {
+      char *arrayptr = strchr(lineptr, '(') + 1;
+      for (arrayend = arrayptr; depth; arrayend++) {
+        switch (*arrayend) {
+          case ')':
+            depth--;
+            break;
+          case '(':
+            depth++;
+            break;
+        }
+      }
+      *(arrayend - 1) = '\0';
+      *deplist = parse_bash_array(*deplist, arrayptr, type);
+      lineptr = arrayend;
+    }
+  }
+
+  stats_add_phase(STAT_PHASE_PKGBUILD, now_ms() - start);
+  trace_end("parse", "pkgbuild parse", NULL, start);
+} /* }}} */
+
+/**
+ * Downloads run as a pipeline, so that the network workers only ever wait on
+ * the network. A worker hands each tarball to a small pool of extractors,
+ * which unpack it and parse its PKGBUILD, and a single resolver then queues
+ * whatever it depends on as jobs of their own. Each package holds the job
+ * queue open until it's through, since it may yet add to it.
+ */
+void *pipeline_extract(void *arg) { /* {{{ */
+  struct stage_item_t *item;
+  struct response_t pkgbuild;
+  int linked, ret;
+
+  (void)arg;
+  trace_thread_name("extractor");
+
+  while ((item = stage_take(&pipeline.extract))) {
+    double start = now_ms();
+    alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+      &item->pkg->depends, &item->pkg->makedepends, &item->pkg->optdepends,
+      &item->pkg->provides, &item->pkg->conflicts, &item->pkg->replaces
+    };
+
+    pkgbuild.data = NULL;
+    pkgbuild.size = 0;
+
+    linked = item->cached && cfg.linkcache && cache_link_tree(item->hex, item->target) == 0;
+    if (item->cached && !linked && cache_read_tarball(item->hex, &item->tarball) != 0) {
+      /* the cache let us down, so this one goes back to the network */
+      char *path = cache_path("tarballs", item->pkg);
+      if (path) {
+        unlink(path);
+        free(path);
+      }
+      workqueue_push(&workq, item->target, 0);
+      goto next;
+    }
+
+    if (!linked && cfg.linkcache && cfg.tarballcache && cfg.cachedir &&
+        cache_put_tree(item->hex, &item->tarball) == 0) {
+      linked = cache_link_tree(item->hex, item->target) == 0;
+    }
+
+    if (linked) {
+      /* the PKGBUILD is read back from the linked tree */
+      if (cfg.getdeps) {
+        char *path;
+        cwr_asprintf(&path, "%s/PKGBUILD", item->target);
+        file_read(path, &pkgbuild);
+        free(path);
+      }
+    } else {
+      ret = archive_extract_file(&item->tarball, NULL, cfg.getdeps ? &pkgbuild.data : NULL);
+      if (ret != ARCHIVE_EOF && ret != ARCHIVE_OK) {
+        cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", item->target);
+        cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to extract tarball\n", item->target);
+        __sync_add_and_fetch(&dlerrors, 1);
+        FREE(pkgbuild.data);
+      }
+    }
+    FREE(item->tarball.data);
+
+    if (pkgbuild.data) {
+      if (cache_get_extinfo(item->pkg, pkg_details) != 0) {
+        cwr_printf(LOG_DEBUG, "Parsing PKGBUILD for %s for extended info\n", item->pkg->name);
+        pkgbuild_get_extinfo(pkgbuild.data, pkg_details);
+        cache_put_extinfo(item->pkg, pkg_details);
+      }
+      free(pkgbuild.data);
+      trace_end("pipeline", "extract", item->target, start);
+      stage_push(&pipeline.resolve, item);
+      continue;
+    }
+
+next:
+    trace_end("pipeline", "extract", item->target, start);
+    stage_item_free(item);
+    workqueue_release(&workq);
+  }
+
+  uring_free(extract_ring);
+  extract_ring = NULL;
+
+  return NULL;
+} /* }}} */
+
+void *pipeline_resolve(void *arg) { /* {{{ */
+  struct stage_item_t *item;
+  alpm_list_t *claimed;
+  const alpm_list_t *i;
+
+  (void)arg;
+  trace_thread_name("resolver");
+
+  while ((item = stage_take(&pipeline.resolve))) {
+    /* the job queue is never waited on from here, or the stages could end
+     * up waiting on each other */
+    claimed = resolve_claim_depends(item->pkg);
+    for (i = claimed; i; i = alpm_list_next(i)) {
+      workqueue_push(&workq, alpm_list_getdata(i), 0);
+    }
+    alpm_list_free(claimed);
+
+    stage_item_free(item);
+    workqueue_release(&workq);
+  }
+
+  return NULL;
+} /* }}} */
+
+void pipeline_start() { /* {{{ */
+  struct stage_t *stages[] = { &pipeline.extract, &pipeline.resolve };
+  size_t n;
+
+  for (n = 0; n < sizeof stages / sizeof stages[0]; n++) {
+    stages[n]->head = stages[n]->tail = NULL;
+    stages[n]->count = 0;
+    stages[n]->closed = 0;
+    memset(&stages[n]->stat, 0, sizeof stages[n]->stat);
+  }
+
+  /* without a thread for every stage, nothing would make it through */
+  for (pipeline.nthreads = 0; pipeline.nthreads < PIPELINE_EXTRACTORS; pipeline.nthreads++) {
+    if (pthread_create(&pipeline.threads[pipeline.nthreads], NULL, pipeline_extract, NULL) != 0) {
+      break;
+    }
+  }
+  if (pipeline.nthreads == 0 ||
+      pthread_create(&pipeline.threads[pipeline.nthreads], NULL, pipeline_resolve, NULL) != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n", strerror(errno));
+    pipeline_stop();
+    return;
+  }
+  pipeline.nthreads++;
+  pipeline.active = 1;
+} /* }}} */
+
+void pipeline_stop() { /* {{{ */
+  int n;
+
+  stage_close(&pipeline.extract);
+  stage_close(&pipeline.resolve);
+  for (n = 0; n < pipeline.nthreads; n++) {
+    pthread_join(pipeline.threads[n], NULL);
+  }
+  pipeline.nthreads = 0;
+  pipeline.active = 0;
+} /* }}} */
+
+void print_build_order(alpm_list_t *results) { /* {{{ */
+  const alpm_list_t *i;
+  alpm_list_t *seen = NULL, *order = NULL;
+
+  for (i = results; i; i = alpm_list_next(i)) {
+    build_order_visit(alpm_list_getdata(i), results, &seen, &order);
+  }
+
+  for (i = order; i; i = alpm_list_next(i)) {
+    struct aurpkg_t *pkg = alpm_list_getdata(i);
+    buffer_printf("%s%s%s\n", colstr->pkg, pkg->name, colstr->nc);
+  }
+  buffer_flush();
+
+  alpm_list_free(seen);
+  alpm_list_free(order);
+} /* }}} */
+
+int print_escaped(const char *delim) { /* {{{ */
+  const char *f;
+  int c, out = 0;
+
+  for (f = delim; *f != '\0'; f++) {
+    if (*f == '\\') {
+      if (*++f == '\0') {
+        break;
+      }
+      if ((c = unescape_char(*f)) >= 0) {
+        buffer_putc(c);
+      }
+    } else {
+      buffer_putc(*f);
+      ++out;
+    }
+  }
+
+  return(out);
+} /* }}} */
+
+void print_extinfo_list(alpm_list_t *list, const char *fieldname, const char *delim, int wrap) { /* {{{ */
+  const alpm_list_t *next, *i;
+  size_t cols, count = 0;
+
+  if (!list) {
+    return;
+  }
+
+  cols = wrap ? getcols() : 0;
+
+  if (fieldname) {
+    count += buffer_printf("%-*s: ", INFO_INDENT - 2, fieldname);
+  }
+
+  for (i = list; i; i = next) {
+    const char *item = alpm_list_getdata(i);
+    size_t len = strlen(item);
+
+    next = alpm_list_next(i);
+    if (cols > 0 && count + len >= cols) {
+      buffer_printf("%-*c", INFO_INDENT + 1, '\n');
+      count = INFO_INDENT;
+    }
+    count += buffer_append(item, len);
+    if (next) {
+      count += print_escaped(delim);
+    }
+  }
+  buffer_putc('\n');
+} /* }}} */
+
+void print_pkg_formatted(struct aurpkg_t *pkg) { /* {{{ */
+  const struct format_op_t *op;
+
+  for (op = format_ops; op->type != FORMAT_END; op++) {
+    const char *val = NULL;
+    alpm_list_t *list = NULL;
+
+    switch (op->type) {
+      case FORMAT_LITERAL:
+        buffer_append(op->text, op->textlen);
+        break;
+      case FORMAT_FIELD:
+        switch (op->field) {
+          case 'c':
+            val = aur_cat[pkg->cat];
+            break;
+          case 'd':
+            val = pkg->desc;
+            break;
+          case 'i':
+            val = pkg->id;
+            break;
+          case 'l':
+            val = pkg->lic;
+            break;
+          case 'n':
+            val = pkg->name;
+            break;
+          case 'o':
+            val = pkg->votes;
+            break;
+          case 'p': {
+            /* the url prefix was formatted at compile time */
+            size_t idlen = strlen(pkg->id);
+            int pad = op->width - (int)(op->textlen + idlen);
+            if (pad > 0 && !op->leftalign) {
+              buffer_pad("", 0, pad, 0);
+            }
+            buffer_append(op->text, op->textlen);
+            buffer_append(pkg->id, idlen);
+            if (pad > 0 && op->leftalign) {
+              buffer_pad("", 0, pad, 1);
+            }
+            continue;
+          }
+          case 't':
+            val = pkg->ood ? "yes" : "no";
+            break;
+          case 'u':
+            val = pkg->url;
+            break;
+          case 'v':
+            val = pkg->ver;
+            break;
+        }
+        if (!val) {
+          val = "";
+        }
+        buffer_pad(val, strlen(val), op->width, op->leftalign);
+        break;
+      case FORMAT_LIST:
+        switch (op->field) {
+          case 'C':
+            list = pkg->conflicts;
+            break;
+          case 'D':
+            list = pkg->depends;
+            break;
+          case 'M':
+            list = pkg->makedepends;
+            break;
+          case 'O':
+            list = pkg->optdepends;
+            break;
+          case 'P':
+            list = pkg->provides;
+            break;
+          case 'R':
+            list = pkg->replaces;
+            break;
+        }
+        if (!list) {
+          break;
+        }
+        for (; list; list = alpm_list_next(list)) {
+          buffer_puts(alpm_list_getdata(list));
+          if (alpm_list_next(list)) {
+            buffer_append(op->text, op->textlen);
+          }
+        }
+        buffer_putc('\n');
+        break;
+      case FORMAT_END:
+        break;
+    }
+  }
+} /* }}} */
+
+void print_pkg_info(struct aurpkg_t *pkg) { /* {{{ */
+  const char *instver;
+
+  buffer_printf(PKG_REPO "     : %saur%s\n", colstr->repo, colstr->nc);
+  buffer_printf(NAME "           : %s%s%s", colstr->pkg, pkg->name, colstr->nc);
+  if ((instver = provider_index_version(&local_index, pkg->name))) {
+    const char *instcolor;
+    if (alpm_pkg_vercmp(pkg->ver, instver) > 0) {
+      instcolor = colstr->ood;
+    } else {
+      instcolor = colstr->utd;
+    }
+    buffer_printf(" %s[%sinstalled%s]%s", colstr->url, instcolor, colstr->url, colstr->nc);
+  }
+  buffer_putc('\n');
+
+  buffer_printf(VERSION "        : %s%s%s\n",
+      pkg->ood ? colstr->ood : colstr->utd, pkg->ver, colstr->nc);
+  buffer_printf(URL "            : %s%s%s\n", colstr->url, pkg->url, colstr->nc);
+  buffer_printf(PKG_AURPAGE "       : %s" AUR_PKG_URL_FORMAT "%s%s\n",
+      colstr->url, cfg.proto, cfg.aurhost, pkg->id, colstr->nc);
+
+  print_extinfo_list(pkg->depends, PKG_DEPENDS, LIST_DELIM, 1);
+  print_extinfo_list(pkg->makedepends, PKG_MAKEDEPENDS, LIST_DELIM, 1);
+  print_extinfo_list(pkg->provides, PKG_PROVIDES, LIST_DELIM, 1);
+  print_extinfo_list(pkg->conflicts, PKG_CONFLICTS, LIST_DELIM, 1);
+
+  if (pkg->optdepends) {
+    const alpm_list_t *i;
+    buffer_printf(PKG_OPTDEPENDS "  : %s\n", (const char*)alpm_list_getdata(pkg->optdepends));
+    for (i = pkg->optdepends->next; i; i = alpm_list_next(i)) {
+      buffer_printf("%-*s%s\n", INFO_INDENT, "", (const char*)alpm_list_getdata(i));
+    }
+  }
+
+  print_extinfo_list(pkg->replaces, PKG_REPLACES, LIST_DELIM, 1);
+
+  buffer_printf(PKG_CAT "       : %s\n"
+         PKG_LICENSE "        : %s\n"
+         PKG_NUMVOTES "          : %s\n"
+         PKG_OOD "    : %s%s%s\n"
+         PKG_DESC "    : ",
+         aur_cat[pkg->cat], pkg->lic, pkg->votes,
+         pkg->ood ? colstr->ood : colstr->utd,
+         pkg->ood ? "Yes" : "No", colstr->nc);
+
+  indentprint(pkg->desc, INFO_INDENT);
+  buffer_printf("\n\n");
+
+  if (cfg.extinfo && cfg.printcomments) {
+    const alpm_list_t *i;
+    if (alpm_list_count(pkg->comments) == 0) {
+      buffer_printf("%sNo comments%s\n\n", colstr->commentheader, colstr->nc);
+    } else {
+      for (i = pkg->comments; i; i = i->next) {
+        const char *end_of_first_line, *the_comment;
+        the_comment = alpm_list_getdata(i);
+        end_of_first_line = strchrnul(the_comment, '\n');
+        buffer_printf("%s%.*s%s", colstr->commentheader,
+            (int)(end_of_first_line - the_comment), the_comment, colstr->nc);
+        buffer_printf("%s%s%s\n", colstr->comment, end_of_first_line, colstr->nc);
+      }
+    }
+  }
+
+} /* }}} */
+
+/**
+ * Prints a package as a line of JSON, keyed the way the RPC keys it, along
+ * with whatever cower knows that the RPC doesn't.
+ */
+void print_pkg_json(struct aurpkg_t *pkg) { /* {{{ */
+  const alpm_list_t *i;
+  const alpm_list_t *details[PKGDETAIL_MAX] = {
+    pkg->depends, pkg->makedepends, pkg->optdepends,
+    pkg->provides, pkg->conflicts, pkg->replaces
+  };
+  const char *fields[][2] = {
+    { AUR_ID, pkg->id }, { NAME, pkg->name }, { VERSION, pkg->ver },
+    { AUR_DESC, pkg->desc }, { URL, pkg->url }, { AUR_LICENSE, pkg->lic },
+    { AUR_VOTES, pkg->votes }, { "Installed", NULL }
+  };
+  const size_t nfields = sizeof fields / sizeof fields[0];
+  char *buf;
+  size_t len, n;
+  FILE *fp;
+  int type;
+
+  /* an update check may know the installed version without the local db */
+  if (foreign_versions) {
+    fields[nfields - 1][1] = hashtable_get(foreign_versions, pkg->name);
+  }
+  if (!fields[nfields - 1][1]) {
+    fields[nfields - 1][1] = provider_index_version(&local_index, pkg->name);
+  }
+
+  if (!(fp = open_memstream(&buf, &len))) {
+    return;
+  }
+
+  for (n = 0; n < nfields; n++) {
+    fputc(n ? ',' : '{', fp);
+    json_write_string(fp, fields[n][0], strlen(fields[n][0]));
+    fputc(':', fp);
+    if (fields[n][1]) {
+      json_write_string(fp, fields[n][1], strlen(fields[n][1]));
+    } else {
+      fputs("null", fp);
+    }
+  }
+  fprintf(fp, ",\"" AUR_CAT "\":\"%d\",\"" AUR_OOD "\":\"%d\"", pkg->cat, pkg->ood);
+
+  if (cfg.extinfo) {
+    for (type = 0; type < PKGDETAIL_MAX; type++) {
+      fprintf(fp, ",\"%s\":[", pkgdetail_keys[type]);
+      for (i = details[type]; i; i = alpm_list_next(i)) {
+        const char *val = alpm_list_getdata(i);
+        if (i != details[type]) {
+          fputc(',', fp);
+        }
+        json_write_string(fp, val, strlen(val));
+      }
+      fputc(']', fp);
+    }
+  }
+
+  if (cfg.printcomments) {
+    fputs(",\"Comments\":[", fp);
+    for (i = pkg->comments; i; i = alpm_list_next(i)) {
+      const char *comment = alpm_list_getdata(i);
+      if (i != pkg->comments) {
+        fputc(',', fp);
+      }
+      json_write_string(fp, comment, strlen(comment));
+    }
+    fputc(']', fp);
+  }
+
+  fputs("}\n", fp);
+  fclose(fp);
+
+  buffer_append(buf, len);
+  free(buf);
+} /* }}} */
+
+void print_pkg_search(struct aurpkg_t *pkg) { /* {{{ */
+  if (cfg.quiet) {
+    buffer_printf("%s%s%s\n", colstr->pkg, pkg->name, colstr->nc);
+  } else {
+    const char *instver;
+    buffer_printf("%saur/%s%s%s %s%s%s%s (%s)", colstr->repo, colstr->nc, colstr->pkg,
+        pkg->name, pkg->ood ? colstr->ood : colstr->utd, pkg->ver,
+        NCFLAG(pkg->ood, " <!>"), colstr->nc, pkg->votes);
+    if ((instver = provider_index_version(&local_index, pkg->name))) {
+      const char *instcolor;
+      if (alpm_pkg_vercmp(pkg->ver, instver) > 0) {
+        instcolor = colstr->ood;
+      } else {
+        instcolor = colstr->utd;
+      }
+      buffer_printf(" %s[%sinstalled%s]%s", colstr->url, instcolor, colstr->url, colstr->nc);
+    }
+    buffer_printf("\n    ");
+    indentprint(pkg->desc, SRCH_INDENT);
+    buffer_putc('\n');
+  }
+} /* }}} */
+
+void print_results(alpm_list_t *results, void (*printfn)(struct aurpkg_t*)) { /* {{{ */
+  const alpm_list_t *i;
+  struct aurpkg_t *prev = NULL;
+
+  if (!printfn) {
+    return;
+  }
+
+  if (!results && (cfg.opmask & OP_INFO)) {
+    cwr_fprintf(stderr, LOG_ERROR, "no results found\n");
+    return;
+  }
+
+  for (i = results; i; i = alpm_list_next(i)) {
+    struct aurpkg_t *pkg = alpm_list_getdata(i);
+
+    /* don't print duplicates */
+    if (!prev || aurpkg_cmp(pkg, prev) != 0) {
+      printfn(pkg);
+    }
+    prev = pkg;
+  }
+  buffer_flush();
+} /* }}} */
+
+/**
+ * Finds the first package satisfying a dependency string such as "foo" or
+ * "foo>=1.2", by name or by what it provides. An unversioned provide never
+ * satisfies a versioned dependency.
+ */
+const struct provider_t *provider_index_find(const struct provider_index_t *index,
+    const char *depend) { /* {{{ */
+  const struct provider_t *provider;
+  const char *op, *ver;
+  char *name;
+
+  if (!index->table) {
+    return NULL;
+  }
+
+  op = depend + strcspn(depend, "<>=");
+  if (!*op) {
+    return hashtable_get(index->table, depend);
+  }
+
+  name = strndup(depend, op - depend);
+  provider = hashtable_get(index->table, name);
+  free(name);
+
+  ver = op + strspn(op, "<>=");
+  for (; provider; provider = provider->next) {
+    int cmp;
+
+    if (!provider->version) {
+      continue;
+    }
+
+    cmp = alpm_pkg_vercmp(provider->version, ver);
+    if ((STR_STARTS_WITH(op, ">=") && cmp >= 0) ||
+        (STR_STARTS_WITH(op, "<=") && cmp <= 0) ||
+        (STR_STARTS_WITH(op, "=") && cmp == 0) ||
+        (STR_STARTS_WITH(op, ">") && op[1] != '=' && cmp > 0) ||
+        (STR_STARTS_WITH(op, "<") && op[1] != '=' && cmp < 0)) {
+      return provider;
+    }
+  }
+
+  return NULL;
+} /* }}} */
+
+void provider_index_free(struct provider_index_t *index) { /* {{{ */
+  size_t n;
+
+  for (n = 0; n < index->count; n++) {
+    if (index->providers[n].ownkey) {
+      free((void*)index->providers[n].key);
+    }
+  }
+  FREE(index->providers);
+  hashtable_free(index->table, NULL);
+  index->table = NULL;
+  index->count = 0;
+} /* }}} */
+
+/**
+ * Builds a map of every name found in the given dbs, whether a package name
+ * or something provided, to the packages offering it. caches holds the
+ * already loaded package cache of each db. The index is built before any
+ * worker starts and is never modified afterwards, so workers can query it
+ * without taking a lock.
+ */
+int provider_index_init(struct provider_index_t *index, alpm_list_t *dbs,
+    alpm_list_t **caches) { /* {{{ */
+  const alpm_list_t *i, *j, *k;
+  struct provider_t *provider;
+  size_t n, total = 0;
+
+  for (i = dbs, n = 0; i; i = alpm_list_next(i), n++) {
+    for (j = caches[n]; j; j = alpm_list_next(j)) {
+      total += 1 + alpm_list_count(alpm_pkg_get_provides(alpm_list_getdata(j)));
+    }
+  }
+
+  index->table = hashtable_new(total);
+  if (!index->table) {
+    return 1;
+  }
+  CALLOC(index->providers, total ? total : 1, sizeof *index->providers, goto error);
+
+  /* chains are kept in db order, so that the first repo listed still wins */
+  for (i = dbs, n = 0; i; i = alpm_list_next(i), n++) {
+    const char *repo = alpm_db_get_name(alpm_list_getdata(i));
+
+    for (j = caches[n]; j; j = alpm_list_next(j)) {
+      pmpkg_t *pkg = alpm_list_getdata(j);
+
+      provider = &index->providers[index->count++];
+      provider->key = provider->pkgname = alpm_pkg_get_name(pkg);
+      provider->version = alpm_pkg_get_version(pkg);
+      provider->repo = repo;
+
+      for (k = alpm_pkg_get_provides(pkg); k; k = alpm_list_next(k)) {
+        const char *provides = alpm_list_getdata(k);
+        const char *eq = strchr(provides, '=');
+
+        provider = &index->providers[index->count++];
+        provider->pkgname = alpm_pkg_get_name(pkg);
+        provider->repo = repo;
+        if (eq) {
+          provider->key = strndup(provides, eq - provides);
+          provider->ownkey = 1;
+          provider->version = eq + 1;
+        } else {
+          provider->key = provides;
+        }
+      }
+    }
+  }
+
+  for (n = 0; n < index->count; n++) {
+    struct provider_t *head;
+
+    provider = &index->providers[n];
+    if (!provider->key) {
+      continue;
+    }
+    if ((head = hashtable_get(index->table, provider->key))) {
+      while (head->next) {
+        head = head->next;
+      }
+      head->next = provider;
+    } else {
+      hashtable_add(index->table, provider->key, provider);
+    }
+  }
+
+  return 0;
+
+error:
+  provider_index_free(index);
+  return 1;
+} /* }}} */
+
+const char *provider_index_version(const struct provider_index_t *index,
+    const char *pkgname) { /* {{{ */
+  const struct provider_t *provider;
+
+  if (!index->table) {
+    return NULL;
+  }
+
+  for (provider = hashtable_get(index->table, pkgname); provider;
+       provider = provider->next) {
+    if (STREQ(provider->pkgname, pkgname)) {
+      return provider->version;
+    }
+  }
+
+  return NULL;
+} /* }}} */
+
+void queue_stat_push(struct queue_stat_t *stat, size_t depth, double blocked) { /* {{{ */
+  stat->pushed++;
+  stat->depthsum += depth;
+  stat->blocked += blocked;
+  if (depth > stat->maxdepth) {
+    stat->maxdepth = depth;
+  }
+} /* }}} */
+
+alpm_list_t *resolve_dependencies(CURL *curl, struct aurpkg_t *aurpkg) { /* {{{ */
+  const alpm_list_t *i;
+  alpm_list_t *claimed, *ret = NULL;
+  char *pkgbuild;
+
+  curl = curl_init_easy_handle(curl);
+
+  alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+    &aurpkg->depends, &aurpkg->makedepends, &aurpkg->optdepends,
+    &aurpkg->provides, &aurpkg->conflicts, &aurpkg->replaces
+  };
+
+  if (cache_get_extinfo(aurpkg, pkg_details) != 0) {
+    pkgbuild = curl_get_pkgbuild(curl, aurpkg->name);
+    if (!pkgbuild) {
+      cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to fetch PKGBUILD\n", aurpkg->name);
+      __sync_add_and_fetch(&dlerrors, 1);
+      return NULL;
+    }
+
+    cwr_printf(LOG_DEBUG, "Parsing PKGBUILD for %s for extended info\n", aurpkg->name);
+    pkgbuild_get_extinfo(pkgbuild, pkg_details);
+    cache_put_extinfo(aurpkg, pkg_details);
+    free(pkgbuild);
+  }
+
+  for (i = claimed = resolve_claim_depends(aurpkg); i; i = alpm_list_next(i)) {
+    ret = alpm_list_join(ret, task_download(curl, alpm_list_getdata(i)));
+  }
+  alpm_list_free(claimed);
+
+  return ret;
+} /* }}} */
+
+/**
+ * Claims each of a package's depends and makedepends which isn't installed
+ * and isn't already being looked after, returning the names claimed.
+ */
+alpm_list_t *resolve_claim_depends(struct aurpkg_t *aurpkg) { /* {{{ */
+  const alpm_list_t *i;
+  alpm_list_t *deplist = NULL, *ret = NULL;
+
+  /* depends and makedepends are resolved alike */
+  for (i = aurpkg->depends; i; i = alpm_list_next(i)) {
+    deplist = alpm_list_add(deplist, alpm_list_getdata(i));
+  }
+  for (i = aurpkg->makedepends; i; i = alpm_list_next(i)) {
+    if (!alpm_list_find_str(deplist, alpm_list_getdata(i))) {
+      deplist = alpm_list_add(deplist, alpm_list_getdata(i));
+    }
+  }
+
+  for (i = deplist; i; i = alpm_list_next(i)) {
+    const char *depend = alpm_list_getdata(i);
+    char *sanitized = strdup(depend);
+
+    *(sanitized + strcspn(sanitized, "<>=")) = '\0';
+
+    trace_mutex_lock(&targets_lock, "targets_lock");
+    if (!target_claim(sanitized)) {
+      if (cfg.logmask & LOG_BRIEF &&
+              !provider_index_find(&local_index, depend)) {
+          cwr_printf(LOG_BRIEF, "S\t%s\n", sanitized);
+      }
+      FREE(sanitized);
+    }
+    pthread_mutex_unlock(&targets_lock);
+
+    if (sanitized) {
+      if (provider_index_find(&local_index, depend)) {
+        cwr_printf(LOG_DEBUG, "%s is already satisified\n", depend);
+      } else {
+        ret = alpm_list_add(ret, sanitized);
+      }
+    }
+  }
+
+  /* the strings belong to aurpkg */
+  alpm_list_free(deplist);
+
+  return ret;
+} /* }}} */
+
+int set_working_dir() { /* {{{ */
+  char *resolved;
+
+  if (!(cfg.opmask & OP_DOWNLOAD)) {
+    FREE(cfg.dlpath);
+    return 0;
+  }
+
+  resolved = cfg.dlpath ? realpath(cfg.dlpath, NULL) : getcwd(NULL, 0);
+  if (!resolved) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", cfg.dlpath, strerror(errno));
+    FREE(cfg.dlpath);
+    return 1;
+  }
+
+  free(cfg.dlpath);
+  cfg.dlpath = resolved;
+
+  if (access(cfg.dlpath, W_OK) != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "cannot write to %s: %s\n",
+        cfg.dlpath, strerror(errno));
+    FREE(cfg.dlpath);
+    return 1;
+  }
+
+  if (chdir(cfg.dlpath) != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", cfg.dlpath, strerror(errno));
+    return 1;
+  }
+
+  cwr_printf(LOG_DEBUG, "working directory set to: %s\n", cfg.dlpath);
+
+  return 0;
+} /* }}} */
+
+void sigwinch_handler(int signum) { /* {{{ */
+  (void)signum;
+  termwidth_stale = 1;
+} /* }}} */
+
+void stage_close(struct stage_t *stage) { /* {{{ */
+  pthread_mutex_lock(&stage->lock);
+  stage->closed = 1;
+  pthread_cond_broadcast(&stage->ready);
+  pthread_mutex_unlock(&stage->lock);
+} /* }}} */
+
+void stage_item_free(struct stage_item_t *item) { /* {{{ */
+  aurpkg_free(item->pkg);
+  free(item->tarball.data);
+  free(item);
+} /* }}} */
+
+/**
+ * Hands an item to the next stage, waiting while that stage already has as
+ * much as it's allowed to queue.
+ */
+void stage_push(struct stage_t *stage, struct stage_item_t *item) { /* {{{ */
+  double start = now_ms();
+
+  pthread_mutex_lock(&stage->lock);
+  while (stage->count >= PIPELINE_DEPTH) {
+    pthread_cond_wait(&stage->room, &stage->lock);
+  }
+
+  item->next = NULL;
+  if (stage->tail) {
+    stage->tail->next = item;
+  } else {
+    stage->head = item;
+  }
+  stage->tail = item;
+  stage->count++;
+  queue_stat_push(&stage->stat, stage->count, now_ms() - start);
+
+  pthread_cond_signal(&stage->ready);
+  pthread_mutex_unlock(&stage->lock);
+} /* }}} */
+
+struct stage_item_t *stage_take(struct stage_t *stage) { /* {{{ */
+  struct stage_item_t *item;
+
+  pthread_mutex_lock(&stage->lock);
+  while (!stage->head && !stage->closed) {
+    pthread_cond_wait(&stage->ready, &stage->lock);
+  }
+
+  if ((item = stage->head)) {
+    stage->head = item->next;
+    if (!stage->head) {
+      stage->tail = NULL;
+    }
+    stage->count--;
+    pthread_cond_signal(&stage->room);
+  }
+  pthread_mutex_unlock(&stage->lock);
+
+  return item;
+} /* }}} */
+
+void stats_add_phase(stat_phase_t phase, double ms) { /* {{{ */
+  double *newphases;
+  size_t count;
+
+  if (!cfg.stats) {
+    return;
+  }
+
+  pthread_mutex_lock(&stats.lock);
+  count = stats.nphases[phase];
+  /* grow whenever the count reaches a power of two */
+  if ((count & (count - 1)) == 0) {
+    newphases = realloc(stats.phases[phase], (count ? count * 2 : 8) * sizeof *newphases);
+    if (!newphases) {
+      pthread_mutex_unlock(&stats.lock);
+      return;
+    }
+    stats.phases[phase] = newphases;
+  }
+  stats.phases[phase][stats.nphases[phase]++] = ms;
+  pthread_mutex_unlock(&stats.lock);
+} /* }}} */
+
+/**
+ * Records how the last transfer on a handle spent its time. curl reports
+ * each timing as the total since the start of the transfer, so these are
+ * taken apart into the time spent on each step. A reused connection has
+ * nothing to resolve or connect, and curl reports zero for those.
+ */
+void stats_add_request(const struct request_t *request) { /* {{{ */
+  struct request_stat_t *newrequests, *req;
+  stat_request_t type = request->type;
+  size_t count;
+
+  if (!cfg.stats) {
+    return;
+  }
+
+  pthread_mutex_lock(&stats.lock);
+  count = stats.nrequests[type];
+  if ((count & (count - 1)) == 0) {
+    newrequests = realloc(stats.requests[type], (count ? count * 2 : 8) * sizeof *newrequests);
+    if (!newrequests) {
+      pthread_mutex_unlock(&stats.lock);
+      return;
+    }
+    stats.requests[type] = newrequests;
+  }
+  req = &stats.requests[type][stats.nrequests[type]++];
+  *req = request->stat;
+  req->httpcode = request->httpcode;
+  pthread_mutex_unlock(&stats.lock);
+} /* }}} */
+
+void stats_free() { /* {{{ */
+  int i;
+
+  for (i = 0; i < STAT_REQUEST_MAX; i++) {
+    FREE(stats.requests[i]);
+    stats.nrequests[i] = 0;
+  }
+  for (i = 0; i < STAT_PHASE_MAX; i++) {
+    FREE(stats.phases[i]);
+    stats.nphases[i] = 0;
+  }
+} /* }}} */
+
+int stats_cmp(const void *p1, const void *p2) { /* {{{ */
+  double d1 = *(const double*)p1, d2 = *(const double*)p2;
+
+  return (d1 > d2) - (d1 < d2);
+} /* }}} */
+
+/**
+ * Nearest rank percentile of a sorted series.
+ */
+double stats_percentile(const double *sorted, size_t count, double pct) { /* {{{ */
+  size_t rank;
+
+  if (!count) {
+    return 0;
+  }
+
+  rank = (size_t)(pct / 100 * count + 0.999999);
+  rank = rank ? rank : 1;
+  return sorted[(rank > count ? count : rank) - 1];
+} /* }}} */
+
+/**
+ * Reports everything collected over the run to stderr, once the workers
+ * are done and nothing else can be adding to it.
+ */
+void stats_print() { /* {{{ */
+  const struct {
+    const char *name;
+    size_t offset;
+  } timings[] = {
+    { "dns", offsetof(struct request_stat_t, dns) },
+    { "connect", offsetof(struct request_stat_t, connect) },
+    { "tls", offsetof(struct request_stat_t, tls) },
+    { "server", offsetof(struct request_stat_t, server) },
+    { "transfer", offsetof(struct request_stat_t, transfer) },
+    { "total", offsetof(struct request_stat_t, total) }
+  };
+  int i, json = cfg.stats == STATS_JSON, first;
+  size_t n, count;
+  double *series;
+
+  if (!cfg.stats) {
+    return;
+  }
+
+  /* keep the report after anything already written to a shared terminal */
+  fflush(stdout);
+
+  if (json) {
+    fputs("{\"requests\":{", stderr);
+  }
+
+  for (i = 0, first = 1; i < STAT_REQUEST_MAX; i++) {
+    const struct request_stat_t *reqs = stats.requests[i];
+    long codes[8], codecount[8];
+    size_t numcodes = 0, c;
+    double bytes = 0;
+
+    count = stats.nrequests[i];
+    if (!count) {
+      continue;
+    }
+
+    for (n = 0; n < count; n++) {
+      bytes += reqs[n].bytes;
+      for (c = 0; c < numcodes && codes[c] != reqs[n].httpcode; c++);
+      if (c == numcodes && numcodes < 8) {
+        codes[numcodes] = reqs[n].httpcode;
+        codecount[numcodes++] = 0;
+      }
+      if (c < numcodes) {
+        codecount[c]++;
+      }
+    }
+
+    /* cower makes each request exactly once, so there are never retries
+     * to count, but they're reported so that the output says as much */
+    if (json) {
+      fprintf(stderr, "%s\"%s\":{\"count\":%zu,\"bytes\":%.0f,\"retries\":0,\"status\":{",
+          first ? "" : ",", stat_request_names[i], count, bytes);
+      for (c = 0; c < numcodes; c++) {
+        fprintf(stderr, "%s\"%ld\":%ld", c ? "," : "", codes[c], codecount[c]);
+      }
+      fputc('}', stderr);
+    } else {
+      fprintf(stderr, ":: %s: %zu requests, %.1f KiB, 0 retries,", stat_request_names[i],
+          count, bytes / 1024);
+      for (c = 0; c < numcodes; c++) {
+        fprintf(stderr, " http%ld x%ld", codes[c], codecount[c]);
+      }
+      fprintf(stderr, "\n%-16s %9s %9s %9s %9s %9s %10s\n", "", "min", "p50", "p90",
+          "p99", "max", "total");
+    }
+    first = 0;
+
+    /* without room to sort the timings, only the totals are reported */
+    MALLOC(series, count * sizeof *series, series = NULL);
+    if (series) {
+      for (n = 0; n < sizeof timings / sizeof timings[0]; n++) {
+        stats_print_timing(timings[n].name, reqs, count, timings[n].offset, series, json);
+      }
+      free(series);
+    }
+
+    if (json) {
+      fputc('}', stderr);
+    }
+  }
+
+  if (json) {
+    fputs("},\"phases\":{", stderr);
+  } else {
+    fprintf(stderr, ":: local phases\n%-16s %9s %9s %9s %9s %9s %10s\n", "", "min",
+        "p50", "p90", "p99", "max", "total");
+  }
+
+  for (i = 0, first = 1; i < STAT_PHASE_MAX; i++) {
+    if (!stats.nphases[i]) {
+      continue;
+    }
+    if (json && !first) {
+      fputc(',', stderr);
+    }
+    stats_print_series(stat_phase_names[i], stats.phases[i], stats.nphases[i], json);
+    first = 0;
+  }
+
+  /* how far each stage of a download fell behind the one feeding it */
+  if (pipeline.extract.stat.pushed || workq.stat.pushed > 1) {
+    const char *names[] = { "fetch", pipeline.extract.name, pipeline.resolve.name };
+    const struct queue_stat_t *queues[] = {
+      &workq.stat, &pipeline.extract.stat, &pipeline.resolve.stat
+    };
+
+    if (json) {
+      fputs("},\"queues\":{", stderr);
+    } else {
+      fprintf(stderr, ":: queues\n%-16s %9s %9s %9s %10s\n", "", "items", "mean",
+          "max", "blocked");
+    }
+    for (i = 0, first = 1; i < 3; i++) {
+      const struct queue_stat_t *q = queues[i];
+      double mean = q->pushed ? q->depthsum / q->pushed : 0;
+      if (json) {
+        fprintf(stderr, "%s\"%s\":{\"items\":%zu,\"mean\":%.2f,\"max\":%zu,"
+            "\"blocked\":%.3f}", first ? "" : ",", names[i], q->pushed, mean,
+            q->maxdepth, q->blocked);
+      } else {
+        fprintf(stderr, "  %-14s %9zu %9.2f %9zu %8.1fms\n", names[i], q->pushed, mean,
+            q->maxdepth, q->blocked);
+      }
+      first = 0;
+    }
+  }
+
+  if (json) {
+    fputs("}}\n", stderr);
+  }
+} /* }}} */
+
+/**
+ * Prints one row of the report: the spread of a series of times, which
+ * is sorted in place. In JSON, the caller is left to separate members.
+ */
+void stats_print_series(const char *name, double *series, size_t count, int json) { /* {{{ */
+  double sum = 0;
+  size_t n;
+
+  qsort(series, count, sizeof *series, stats_cmp);
+  for (n = 0; n < count; n++) {
+    sum += series[n];
+  }
+
+  if (json) {
+    fprintf(stderr, "\"%s\":{\"count\":%zu,\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,"
+        "\"p99\":%.3f,\"max\":%.3f,\"total\":%.3f}",
+        name, count, series[0],
+        stats_percentile(series, count, 50), stats_percentile(series, count, 90),
+        stats_percentile(series, count, 99), series[count - 1], sum);
+  } else {
+    fprintf(stderr, "  %-14s %7.2fms %7.2fms %7.2fms %7.2fms %7.2fms %8.2fms\n", name,
+        series[0], stats_percentile(series, count, 50),
+        stats_percentile(series, count, 90), stats_percentile(series, count, 99),
+        series[count - 1], sum);
+  }
+} /* }}} */
+
+/**
+ * Prints one of the timings kept for each request of a type, found at
+ * offset in request_stat_t, using series as room to sort them in.
+ */
+void stats_print_timing(const char *name, const struct request_stat_t *reqs,
+    size_t count, size_t offset, double *series, int json) { /* {{{ */
+  size_t n;
+
+  for (n = 0; n < count; n++) {
+    series[n] = *(const double*)((const char*)&reqs[n] + offset);
+  }
+  if (json) {
+    fputc(',', stderr);
+  }
+  stats_print_series(name, series, count, json);
+} /* }}} */
+
+int strings_init() { /* {{{ */
+  MALLOC(colstr, sizeof *colstr, return 1);
+
+  if (cfg.color > 0) {
+    colstr->error = BOLDRED "::" NC;
+    colstr->warn = BOLDYELLOW "::" NC;
+    colstr->info = BOLDBLUE "::" NC;
+    colstr->pkg = BOLD;
+    colstr->repo = BOLDMAGENTA;
+    colstr->url = BOLDCYAN;
+    colstr->ood = BOLDRED;
+    colstr->utd = BOLDGREEN;
+    colstr->nc = NC;
+    colstr->commentheader = BOLDYELLOW;
+    colstr->comment = "\n---";
+  } else {
+    colstr->error = "error:";
+    colstr->warn = "warning:";
+    colstr->info = "::";
+    colstr->pkg = "";
+    colstr->repo = "";
+    colstr->url = "";
+    colstr->ood = "";
+    colstr->utd = "";
+    colstr->nc = "";
+    colstr->commentheader = "";
+    colstr->comment = "\n---";
+  }
+
+  /* guard against delim being something other than LIST_DELIM if extinfo
+   * and format aren't provided */
+  cfg.delim = (cfg.extinfo && cfg.format) ? cfg.delim : LIST_DELIM;
+
+  return 0;
+} /* }}} */
+
+char *strtrim(char *str) { /* {{{ */
+  char *pch = str;
+
+  if (!str || *str == '\0') {
+    return str;
+  }
+
+  while (isspace((unsigned char)*pch)) {
+    pch++;
+  }
+  if (pch != str) {
+    memmove(str, pch, (strlen(pch) + 1));
+  }
+
+  if (*str == '\0') {
+    return str;
+  }
+
+  pch = (str + (strlen(str) - 1));
+  while (isspace((unsigned char)*pch)) {
+    pch--;
+  }
+  *++pch = '\0';
+
+  return str;
+} /* }}} */
+
+/**
+ * Claims name as a target, unless it already is one. The caller holds
+ * targets_lock, and gives up name only if it was claimed.
+ */
+int target_claim(char *name) { /* {{{ */
+  if (targets_claimed) {
+    if (hashtable_add(targets_claimed, name, NULL) == 1) {
+      return 0;
+    }
+  } else if (alpm_list_find_str(cfg.targets, name)) {
+    return 0;
+  }
+
+  cfg.targets = alpm_list_add(cfg.targets, name);
+
+  return 1;
+} /* }}} */
+
+/**
+ * Queues targets read from fp, one per line, while the workers are already
+ * busy with the first of them. Blank lines and targets seen before are
+ * skipped. Once the output falls far enough behind, reading waits for it.
+ */
+void *targets_reader(void *fp) { /* {{{ */
+  char *line = NULL, *name;
+  size_t len = 0;
+  int claimed;
 
-    /* colors are not initialized in this section, so usage of cwr_printf
-     * functions is verboten unless we're using loglevel_t LOG_DEBUG */
-    if (STREQ(key, "NoSSL")) {
-      cfg.proto = "http";
-    } else if (STREQ(key, "IgnoreRepo")) {
-      for (key = strtok(val, " "); key; key = strtok(NULL, " ")) {
-        if (!alpm_list_find_str(cfg.ignore.repos, key)) {
-          cwr_printf(LOG_DEBUG, "ignoring repo: %s\n", key);
-          cfg.ignore.repos = alpm_list_add(cfg.ignore.repos, strdup(key));
-        }
+  trace_thread_name("reader");
+  while (getline(&line, &len, fp) > 0) {
+    strtrim(line);
+    if (!*line || !(name = strdup(line))) {
+      continue;
+    }
+
+    trace_mutex_lock(&targets_lock, "targets_lock");
+    claimed = target_claim(name);
+    pthread_mutex_unlock(&targets_lock);
+
+    if (!claimed) {
+      free(name);
+    } else if (workqueue_push(&workq, name, 1) != 0) {
+      break;
+    }
+  }
+  free(line);
+
+  workqueue_close(&workq);
+
+  return NULL;
+} /* }}} */
+
+void *task_download(CURL *curl, void *arg) { /* {{{ */
+  alpm_list_t *queryresult = NULL;
+  CURLcode curlstat;
+  const struct provider_t *provider;
+  char *url = NULL, *escaped, hex[EVP_MAX_MD_SIZE * 2 + 1];
+  int cached;
+  long httpcode;
+  struct aurpkg_t *aurpkg;
+  struct stage_item_t *item;
+  struct request_t request;
+  struct tarball_t tarball;
+  struct response_t *response = &tarball.response;
+  struct stat st;
+
+  curl = curl_init_easy_handle(curl);
+
+  /* the index is read only by now, so there's nothing to lock */
+  provider = provider_index_find(&sync_index, arg);
+  if (provider) {
+    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_WARN "\t%s\t", (const char*)arg);
+    cwr_fprintf(stderr, LOG_WARN, "%s%s%s is available in %s%s%s\n",
+        colstr->pkg, (const char*)arg, colstr->nc,
+        colstr->repo, provider->repo, colstr->nc);
+    return NULL;
+  }
+
+  queryresult = task_query(curl, arg);
+  if (!queryresult) {
+    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
+    cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", (const char*)arg);
+    __sync_add_and_fetch(&dlerrors, 1);
+    return NULL;
+  }
+
+  if (stat(arg, &st) == 0 && !cfg.force && !cfg.depsonly) {
+    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
+    cwr_fprintf(stderr, LOG_ERROR, "`%s/%s' already exists. Use -f to overwrite.\n",
+        cfg.dlpath, (const char*)arg);
+    alpm_list_free_inner(queryresult, aurpkg_free);
+    alpm_list_free(queryresult);
+    return NULL;
+  }
+
+  response->data = NULL;
+  response->size = 0;
+  tarball.digest = NULL;
+
+  if (cfg.depsonly) {
+    /* the PKGBUILD alone is enough to walk the dependency tree, and a
+     * known tree needs nothing at all */
+    alpm_list_t *closure;
+    if (cache_get_closure(alpm_list_getdata(queryresult), &closure) != 0) {
+      closure = resolve_dependencies(curl, alpm_list_getdata(queryresult));
+    }
+    return alpm_list_join(queryresult, closure);
+  }
+
+  /* a version already in the cache can skip the network altogether */
+  aurpkg = alpm_list_getdata(queryresult);
+  cached = cache_get_tarball(aurpkg, hex) == 0;
+
+  if (!cached) {
+    escaped = curl_easy_escape(curl, arg, strlen(arg));
+    cwr_asprintf(&url, AUR_PKG_URL, cfg.proto, cfg.aurhost, escaped, escaped);
+    curl_free(escaped);
+
+    tarball.digest = EVP_MD_CTX_create();
+    EVP_DigestInit_ex(tarball.digest, EVP_sha256(), NULL);
+
+    memset(&request, 0, sizeof request);
+    request.type = STAT_REQUEST_TARBALL;
+    request.url = url;
+    request.writefn = curl_write_tarball;
+    request.writedata = &tarball;
+    request.identity = 1; /* the tarball is already compressed */
+
+    curlstat = transport_fetch(curl, &request);
+
+    if (curlstat != CURLE_OK) {
+      cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
+      cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", (const char*)arg, curl_easy_strerror(curlstat));
+      goto finish;
+    }
+
+    httpcode = request.httpcode;
+
+    switch (httpcode) {
+      case 200:
+        break;
+      default:
+        cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
+        cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with http%ld\n",
+            (const char*)arg, httpcode);
+        goto finish;
+    }
+
+    digest_hex(tarball.digest, hex);
+    cache_put_tarball(aurpkg, response, hex);
+  } else {
+    cwr_printf(LOG_DEBUG, "%s@%s: using cached tarball %s\n", aurpkg->name,
+        aurpkg->ver, hex);
+  }
+  cwr_printf(LOG_BRIEF, BRIEF_OK "\t%s\t", (const char*)arg);
+  cwr_printf(LOG_INFO, "%s%s%s downloaded to %s\n",
+      colstr->pkg, (const char*)arg, colstr->nc, cfg.dlpath);
+
+  /* everything from here on is disk and cpu work, which is left to the
+   * rest of the pipeline so that this worker can get back to the network */
+  CALLOC(item, 1, sizeof *item, goto finish);
+  CALLOC(item->pkg, 1, sizeof *item->pkg, free(item); goto finish);
+  item->target = arg;
+  item->pkg->name = strdup(aurpkg->name);
+  item->pkg->ver = strdup(aurpkg->ver);
+  item->tarball = *response;
+  strcpy(item->hex, hex);
+  item->cached = cached;
+  response->data = NULL;
+
+  workqueue_hold(&workq);
+  stage_push(&pipeline.extract, item);
+
+finish:
+  if (tarball.digest) {
+    EVP_MD_CTX_destroy(tarball.digest);
+  }
+  FREE(url);
+  FREE(response->data);
+
+  return queryresult;
+} /* }}} */
+
+void *task_query(CURL *curl, void *arg) { /* {{{ */
+  alpm_list_t *pkglist = NULL;
+  CURLcode curlstat;
+  struct yajl_handle_t *yajl_hand = NULL;
+  const char *argstr;
+  char *escaped, *url, *rawdata = NULL;
+  size_t rawlen = 0;
+  long httpcode;
+  int span = 0;
+  double start;
+  struct request_t request;
+  struct yajl_parser_t *parse_struct;
+
+  /* find a valid chunk of search string */
+  if (cfg.opmask & OP_SEARCH) {
+    for (argstr = arg; *argstr; argstr++) {
+      span = strcspn(argstr, REGEX_CHARS);
+
+      /* given 'cow?', we can't include w in the search */
+      if (*(argstr + span) == '?' || *(argstr + span) == '*') {
+        span--;
       }
-    } else if (STREQ(key, "IgnorePkg")) {
-      for (key = strtok(val, " "); key; key = strtok(NULL, " ")) {
-        if (!alpm_list_find_str(cfg.ignore.pkgs, key)) {
-          cwr_printf(LOG_DEBUG, "ignoring package: %s\n", key);
-          cfg.ignore.pkgs = alpm_list_add(cfg.ignore.pkgs, strdup(key));
-        }
+
+      /* a string inside [] or {} cannot be a valid span */
+      if (strchr("[{", *argstr)) {
+        argstr = strpbrk(argstr + span, "]}");
+        continue;
       }
-    } else if (STREQ(key, "TargetDir")) {
-      if (val && !cfg.dlpath) {
-        wordexp_t p;
-        if (wordexp(val, &p, 0) == 0) {
-          if (p.we_wordc == 1) {
-            cfg.dlpath = strdup(p.we_wordv[0]);
-          }
-          wordfree(&p);
-          /* error on relative paths */
-          if (*cfg.dlpath != '/') {
-            fprintf(stderr, "error: TargetDir cannot be a relative path\n");
-            ret = 1;
-          }
-        } else {
-          fprintf(stderr, "error: failed to resolve option to TargetDir\n");
-          ret = 1;
-        }
+
+      if (span >= 2) {
+        break;
       }
-    } else if (STREQ(key, "MaxThreads")) {
-      if (val && cfg.maxthreads == UNSET) {
-        cfg.maxthreads = strtol(val, &key, 10);
-        if (*key != '\0' || cfg.maxthreads <= 0) {
-          fprintf(stderr, "error: invalid option to MaxThreads: %s\n", val);
-          ret = 1;
-        }
+    }
+
+    if (span < 2) {
+      cwr_fprintf(stderr, LOG_ERROR, "search string '%s' too short\n", (const char*)arg);
+      return NULL;
+    }
+  } else {
+    argstr = arg;
+  }
+
+  MALLOC(parse_struct, sizeof *parse_struct, return NULL);
+  parse_struct->pkglist = NULL;
+  parse_struct->json_depth = 0;
+  parse_struct->parsetime = 0;
+  if (cfg.json == JSON_RAW &&
+      !(parse_struct->raw = open_memstream(&rawdata, &rawlen))) {
+    FREE(parse_struct);
+    return NULL;
+  }
+  yajl_hand = yajl_alloc(parse_struct->raw ? &raw_callbacks : &callbacks, NULL,
+      (void*)parse_struct);
+  parse_struct->handle = yajl_hand;
+
+  curl = curl_init_easy_handle(curl);
+
+  escaped = curl_easy_escape(curl, argstr, span);
+  if (cfg.opmask & OP_SEARCH) {
+    cwr_asprintf(&url, AUR_RPC_URL, cfg.proto, cfg.aurhost, AUR_QUERY_TYPE_SEARCH,
+        escaped);
+  } else if (cfg.opmask & OP_MSEARCH) {
+    cwr_asprintf(&url, AUR_RPC_URL, cfg.proto, cfg.aurhost, AUR_QUERY_TYPE_MSRCH,
+        escaped);
+  } else {
+    cwr_asprintf(&url, AUR_RPC_URL, cfg.proto, cfg.aurhost, AUR_QUERY_TYPE_INFO,
+        escaped);
+  }
+
+  memset(&request, 0, sizeof request);
+  request.type = STAT_REQUEST_RPC;
+  request.url = url;
+  request.writefn = yajl_parse_stream;
+  request.writedata = parse_struct;
+
+  cwr_printf(LOG_DEBUG, "[%p]: %s fetch %s\n", (void*)pthread_self(), transport->name, url);
+  curlstat = transport_fetch(curl, &request);
+
+  /* an empty result after a failure doesn't mean the package is gone */
+  query_failed = 1;
+  if (curlstat != CURLE_OK) {
+    cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", (const char*)arg,
+        curl_easy_strerror(curlstat));
+    goto finish;
+  }
+
+  httpcode = request.httpcode;
+  if (httpcode >= 300) {
+    cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with http%ld\n",
+        (const char*)arg, httpcode);
+    goto finish;
+  }
+  query_failed = 0;
+
+  start = now_ms();
+  yajl_complete_parse(yajl_hand);
+  stats_add_phase(STAT_PHASE_JSON, parse_struct->parsetime + now_ms() - start);
+  trace_end("parse", "json parse", NULL, start);
+
+  pkglist = parse_struct->pkglist;
+
+  /* passed on untouched, there are no packages to hand back */
+  if (parse_struct->raw) {
+    fclose(parse_struct->raw);
+    parse_struct->raw = NULL;
+    job_write(stdout, rawdata, rawlen);
+    __sync_add_and_fetch(&rawresults, parse_struct->rawcount);
+  }
+
+  if (pkglist && cfg.extinfo) {
+    struct aurpkg_t *aurpkg;
+    char *pkgbuild, *aurpkgurl;
+
+    aurpkg = alpm_list_getdata(pkglist);
+
+    alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+      &aurpkg->depends, &aurpkg->makedepends, &aurpkg->optdepends,
+      &aurpkg->provides, &aurpkg->conflicts, &aurpkg->replaces
+    };
+
+    if (cache_get_extinfo(aurpkg, pkg_details) != 0) {
+      pkgbuild = curl_get_pkgbuild(curl, aurpkg->name);
+      if (pkgbuild) {
+        pkgbuild_get_extinfo(pkgbuild, pkg_details);
+        cache_put_extinfo(aurpkg, pkg_details);
+        free(pkgbuild);
       }
-    } else if (STREQ(key, "ConnectTimeout")) {
-      if (val && cfg.timeout == UNSET) {
-        cfg.timeout = strtol(val, &key, 10);
-        if (*key != '\0' || cfg.timeout < 0) {
-          fprintf(stderr, "error: invalid option to ConnectTimeout: %s\n", val);
-          ret = 1;
+    }
+
+    if (cfg.printcomments) {
+      cwr_asprintf(&aurpkgurl, AUR_PKG_URL_FORMAT "%s", cfg.proto, cfg.aurhost,
+          aurpkg->id);
+      aurpkg->comments = get_aur_comments(curl, aurpkgurl);
+      free(aurpkgurl);
+    }
+  }
+
+finish:
+  if (parse_struct->raw) {
+    fclose(parse_struct->raw);
+  }
+  free(rawdata);
+  yajl_free(yajl_hand);
+  curl_free(escaped);
+  FREE(parse_struct);
+  FREE(url);
+
+  return pkglist;
+} /* }}} */
+
+void *task_update(CURL *curl, void *arg) { /* {{{ */
+  struct aurpkg_t *aurpkg;
+  const char *localver = NULL;
+  void *dlretval;
+  alpm_list_t *qretval;
+
+  if (alpm_list_find_str(cfg.ignore.pkgs, arg)) {
+    return NULL;
+  }
+
+  /* the foreign package cache already knows what's installed */
+  if (foreign_versions) {
+    localver = hashtable_get(foreign_versions, arg);
+  }
+  if (!localver) {
+    localver = provider_index_version(&local_index, arg);
+  }
+
+  if (cfg.incremental && localver && update_lookup(arg, localver, &qretval) == 0) {
+    cwr_printf(LOG_VERBOSE, "Using last check of %s%s%s for updates\n",
+        colstr->pkg, (const char*)arg, colstr->nc);
+  } else {
+    cwr_printf(LOG_VERBOSE, "Checking %s%s%s for updates...\n",
+        colstr->pkg, (const char*)arg, colstr->nc);
+
+    qretval = task_query(curl, arg);
+    if (localver && !query_failed) {
+      aurpkg = alpm_list_getdata(qretval);
+      update_record(arg, localver, aurpkg ? aurpkg->ver : NULL);
+    }
+  }
+
+  aurpkg = alpm_list_getdata(qretval);
+  if (aurpkg) {
+    if (!localver) {
+      cwr_fprintf(stderr, LOG_WARN, "skipping uninstalled package %s\n",
+          (const char*)arg);
+      goto finish;
+    }
+
+    if (alpm_pkg_vercmp(aurpkg->ver, localver) > 0) {
+      if (cfg.opmask & OP_DOWNLOAD) {
+        dlretval = task_download(curl, (void*)aurpkg->name);
+        if (cfg.depsonly) {
+          /* the build order needs the resolved packages, not the query */
+          alpm_list_free_inner(qretval, aurpkg_free);
+          alpm_list_free(qretval);
+          return dlretval;
         }
-      }
-    } else if (STREQ(key, "Color")) {
-      if (cfg.color == UNSET) {
-        if (!val || STREQ(val, "auto")) {
-          if (isatty(fileno(stdout))) {
-            cfg.color = 1;
-          } else {
-            cfg.color = 0;
+        /* otherwise we don't care about the return, but we do care about leaks */
+        alpm_list_free_inner(dlretval, aurpkg_free);
+        alpm_list_free(dlretval);
+      } else if (!cfg.json) {
+        if (cfg.quiet) {
+          char *line;
+          int len = cwr_asprintf(&line, "%s%s%s\n", colstr->pkg, (const char*)arg, colstr->nc);
+          if (len >= 0) {
+            job_write(stdout, line, len);
+            free(line);
           }
-        } else if (STREQ(val, "always")) {
-          cfg.color = 1;
-        } else if (STREQ(val, "never")) {
-          cfg.color = 0;
         } else {
-          fprintf(stderr, "error: invalid option to Color\n");
-          return 1;
+          cwr_printf(LOG_INFO, "%s%s %s%s%s -> %s%s%s\n",
+              colstr->pkg, (const char*)arg,
+              colstr->ood, localver, colstr->nc,
+              colstr->utd, aurpkg->ver, colstr->nc);
         }
       }
-    } else {
-      fprintf(stderr, "ignoring unknown option: %s\n", key);
-    }
-    if (ret > 0) {
-      goto finish;
+
+      return qretval;
     }
   }
 
 finish:
-  fclose(fp);
-  return ret;
+  alpm_list_free_inner(qretval, aurpkg_free);
+  alpm_list_free(qretval);
+  return NULL;
 } /* }}} */
 
-int parse_options(int argc, char *argv[]) { /* {{{ */
-  int opt, option_index = 0;
+void *thread_pool(void *arg) { /* {{{ */
+  CURL *curl = NULL;
+  struct job_t *job;
+  struct task_t *task;
 
-  static struct option opts[] = {
-    /* operations */
-    {"download",    no_argument,        0, 'd'},
-    {"info",        no_argument,        0, 'i'},
-    {"msearch",     no_argument,        0, 'm'},
-    {"search",      no_argument,        0, 's'},
-    {"update",      no_argument,        0, 'u'},
+  task = (struct task_t*)arg;
 
-    /* options */
-    {"brief",       no_argument,        0, 'b'},
-    {"color",       optional_argument,  0, 'c'},
-    {"debug",       no_argument,        0, OP_DEBUG},
-    {"force",       no_argument,        0, 'f'},
-    {"format",      required_argument,  0, OP_FORMAT},
-    {"help",        no_argument,        0, 'h'},
-    {"ignore",      required_argument,  0, OP_IGNOREPKG},
-    {"ignorerepo",  optional_argument,  0, OP_IGNOREREPO},
-    {"listdelim",   required_argument,  0, OP_LISTDELIM},
-    {"comments",    no_argument,        0, 'n'},
-    {"nossl",       no_argument,        0, OP_NOSSL},
-    {"quiet",       no_argument,        0, 'q'},
-    {"target",      required_argument,  0, 't'},
-    {"threads",     required_argument,  0, OP_THREADS},
-    {"timeout",     required_argument,  0, OP_TIMEOUT},
-    {"verbose",     no_argument,        0, 'v'},
-    {"version",     no_argument,        0, 'V'},
-    {0, 0, 0, 0}
-  };
+  trace_thread_name("worker");
+  if (curl_ready != 1) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to initialize curl\n");
+  } else if (!(curl = curl_get_handle())) {
+    cwr_fprintf(stderr, LOG_ERROR, "curl: failed to initialize handle\n");
+  }
 
-  while ((opt = getopt_long(argc, argv, "bcdfhimnqst:uvV", opts, &option_index)) != -1) {
-    char *token;
+  while ((job = workqueue_take(&workq))) {
+    alpm_list_t *results = NULL;
+    double start = now_ms();
+
+    /* a worker which can't make requests still has to see its jobs
+     * through, or the output would wait on them forever */
+    if (curl) {
+      /* streamed output has to come out in order */
+      job_current = workq.ordered ? job : NULL;
+      results = task->threadfn(curl, (void*)job->target);
+      job_current = NULL;
+    }
+    trace_end("job", "job", job->target, start);
+    workqueue_finish(&workq, job, results);
+  }
 
-    switch (opt) {
-      /* operations */
-      case 's':
-        cfg.opmask |= OP_SEARCH;
-        break;
-      case 'u':
-        cfg.opmask |= OP_UPDATE;
-        break;
-      case 'i':
-        if (!(cfg.opmask & OP_INFO)) {
-          cfg.opmask |= OP_INFO;
-        } else {
-          cfg.extinfo = 1;
-        }
-        break;
-      case 'd':
-        if (!(cfg.opmask & OP_DOWNLOAD)) {
-          cfg.opmask |= OP_DOWNLOAD;
-        } else {
-          cfg.getdeps = 1;
-        }
-        break;
-      case 'm':
-        cfg.opmask |= OP_MSEARCH;
-        break;
+  if (curl) {
+    curl_put_handle(curl);
+  }
 
-      /* options */
-      case 'b':
-        cfg.logmask |= LOG_BRIEF;
-        break;
-      case 'c':
-        if (!optarg || STREQ(optarg, "auto")) {
-          if (isatty(fileno(stdout))) {
-            cfg.color = 1;
-          } else {
-            cfg.color = 0;
-          }
-        } else if (STREQ(optarg, "always")) {
-          cfg.color = 1;
-        } else if (STREQ(optarg, "never")) {
-          cfg.color = 0;
-        } else {
-          fprintf(stderr, "invalid argument to --color\n");
-          return 1;
-        }
-        break;
-      case 'f':
-        cfg.force = 1;
-        break;
-      case 'h':
-        usage();
-        return 1;
-      case 'n':
-        cfg.printcomments = 1;
-        cfg.extinfo = 1;
-        break;
-      case 'q':
-        cfg.quiet = 1;
-        break;
-      case 't':
-        cfg.dlpath = strdup(optarg);
-        break;
-      case 'v':
-        cfg.logmask |= LOG_VERBOSE;
-        break;
-      case 'V':
-        version();
-        return 2;
-      case OP_DEBUG:
-        cfg.logmask |= LOG_DEBUG;
-        break;
-      case OP_FORMAT:
-        cfg.format = optarg;
-        break;
-      case OP_IGNOREPKG:
-        for (token = strtok(optarg, ","); token; token = strtok(NULL, ",")) {
-          if (!alpm_list_find_str(cfg.ignore.pkgs, token)) {
-            cwr_printf(LOG_DEBUG, "ignoring package: %s\n", token);
-            cfg.ignore.pkgs = alpm_list_add(cfg.ignore.pkgs, strdup(token));
-          }
-        }
-        break;
-      case OP_IGNOREREPO:
-        if (!optarg) {
-          cfg.skiprepos = 1;
-        } else {
-          for (token = strtok(optarg, ","); token; token = strtok(NULL, ",")) {
-            if (!alpm_list_find_str(cfg.ignore.repos, token)) {
-              cwr_printf(LOG_DEBUG, "ignoring repos: %s\n", token);
-              cfg.ignore.repos = alpm_list_add(cfg.ignore.repos, strdup(token));
-            }
-          }
-        }
-        break;
-      case OP_LISTDELIM:
-        cfg.delim = optarg;
-        break;
-      case OP_NOSSL:
-        cfg.proto = "http";
-        break;
-      case OP_THREADS:
-        cfg.maxthreads = strtol(optarg, &token, 10);
-        if (*token != '\0' || cfg.maxthreads <= 0) {
-          fprintf(stderr, "error: invalid argument to --threads\n");
-          return 1;
-        }
-        break;
+  return NULL;
+} /* }}} */
 
-      case OP_TIMEOUT:
-        cfg.timeout = strtol(optarg, &token, 10);
-        if (*token != '\0') {
-          fprintf(stderr, "error: invalid argument to --timeout\n");
-          return 1;
-        }
-        break;
+/**
+ * Finds the calling thread's trace buffer, registering a new one the first
+ * time a thread records anything.
+ */
+struct trace_buffer_t *trace_buffer() { /* {{{ */
+  struct trace_buffer_t *buffer;
 
-      case '?':
-        return 1;
-      default:
-        return 1;
-    }
+  if (trace_local) {
+    return trace_local;
   }
 
-  if (!cfg.opmask) {
-    return 3;
-  }
+  CALLOC(buffer, 1, sizeof *buffer, return NULL);
 
-  /* check for invalid operation combos */
-  if (((cfg.opmask & OP_INFO) && (cfg.opmask & ~OP_INFO)) ||
-     ((cfg.opmask & OP_SEARCH) && (cfg.opmask & ~OP_SEARCH)) ||
-     ((cfg.opmask & OP_MSEARCH) && (cfg.opmask & ~OP_MSEARCH)) ||
-     ((cfg.opmask & (OP_UPDATE|OP_DOWNLOAD)) && (cfg.opmask & ~(OP_UPDATE|OP_DOWNLOAD)))) {
+  pthread_mutex_lock(&tracing.lock);
+  buffer->tid = ++tracing.nexttid;
+  buffer->next = tracing.buffers;
+  tracing.buffers = buffer;
+  pthread_mutex_unlock(&tracing.lock);
 
-    fprintf(stderr, "error: invalid operation\n");
-    return 2;
+  return trace_local = buffer;
+} /* }}} */
+
+/**
+ * Records a span from start until now. Nothing is shared between threads
+ * here, so tracing costs a clock read and, now and then, a realloc.
+ */
+void trace_end(const char *cat, const char *name, const char *detail, double start) { /* {{{ */
+  struct trace_buffer_t *buffer;
+  struct trace_event_t *event;
+
+  if (!cfg.tracefile || !(buffer = trace_buffer())) {
+    return;
   }
 
-  while (optind < argc) {
-    if (!alpm_list_find_str(cfg.targets, argv[optind])) {
-      cwr_fprintf(stderr, LOG_DEBUG, "adding target: %s\n", argv[optind]);
-      cfg.targets = alpm_list_add(cfg.targets, strdup(argv[optind]));
+  if (buffer->count == buffer->size) {
+    size_t newsize = buffer->size ? buffer->size * 2 : 64;
+    struct trace_event_t *newevents = realloc(buffer->events, newsize * sizeof *newevents);
+    if (!newevents) {
+      return;
     }
-    optind++;
+    buffer->events = newevents;
+    buffer->size = newsize;
   }
 
-  return 0;
+  event = &buffer->events[buffer->count++];
+  event->cat = cat;
+  event->name = name;
+  event->detail = detail ? strdup(detail) : NULL;
+  event->start = start;
+  event->end = now_ms();
 } /* }}} */
 
-void pkgbuild_get_extinfo(char *pkgbuild, alpm_list_t **details[]) { /* {{{ */
-  char *lineptr;
+/**
+ * Takes a lock, recording how long it took if it wasn't free. An
+ * uncontended lock isn't worth a span.
+ */
+void trace_mutex_lock(pthread_mutex_t *lock, const char *name) { /* {{{ */
+  double start;
 
-  for (lineptr = pkgbuild; lineptr; lineptr = strchr(lineptr, '\n')) {
-    char *arrayend;
-    int depth = 1, type = 0;
-    alpm_list_t **deplist;
+  if (!cfg.tracefile) {
+    pthread_mutex_lock(lock);
+    return;
+  }
 
-    strtrim(++lineptr);
-    if (*lineptr == '#' || strlen(lineptr) == 0) {
-      continue;
-    }
+  if (pthread_mutex_trylock(lock) == 0) {
+    return;
+  }
 
-    if (STR_STARTS_WITH(lineptr, PKGBUILD_DEPENDS)) {
-      deplist = details[PKGDETAIL_DEPENDS];
-    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_MAKEDEPENDS)) {
-      deplist = details[PKGDETAIL_MAKEDEPENDS];
-    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_OPTDEPENDS)) {
-      deplist = details[PKGDETAIL_OPTDEPENDS];
-      type = PKGDETAIL_OPTDEPENDS;
-    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_PROVIDES)) {
-      deplist = details[PKGDETAIL_PROVIDES];
-    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_REPLACES)) {
-      deplist = details[PKGDETAIL_REPLACES];
-    } else if (STR_STARTS_WITH(lineptr, PKGBUILD_CONFLICTS)) {
-      deplist = details[PKGDETAIL_CONFLICTS];
-    } else {
-      continue;
-    }
+  start = now_ms();
+  pthread_mutex_lock(lock);
+  trace_end("lock", name, NULL, start);
+} /* }}} */
 
-    if (deplist) {
-      char *arrayptr = strchr(lineptr, '(') + 1;
-      for (arrayend = arrayptr; depth; arrayend++) {
-        switch (*arrayend) {
-          case ')':
-            depth--;
-            break;
-          case '(':
-            depth++;
-            break;
+void trace_thread_name(const char *name) { /* {{{ */
+  struct trace_buffer_t *buffer;
+
+  if (cfg.tracefile && (buffer = trace_buffer())) {
+    buffer->threadname = name;
+  }
+} /* }}} */
+
+/**
+ * Merges every thread's events into a single file, in the JSON object
+ * format understood by chrome://tracing and Perfetto. Timestamps are in
+ * microseconds since startup.
+ */
+int trace_write() { /* {{{ */
+  struct trace_buffer_t *buffer, *next;
+  FILE *fp;
+  size_t n;
+  int first = 1;
+
+  fp = fopen(cfg.tracefile, "w");
+  if (!fp) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to open %s: %s\n", cfg.tracefile,
+        strerror(errno));
+  } else {
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  }
+
+  for (buffer = tracing.buffers; buffer; buffer = next) {
+    next = buffer->next;
+
+    if (fp) {
+      fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":", first ? "" : ",\n", buffer->tid);
+      if (buffer->threadname) {
+        json_write_string(fp, buffer->threadname, strlen(buffer->threadname));
+      } else {
+        fprintf(fp, "\"thread %d\"", buffer->tid);
+      }
+      fputs("}}", fp);
+      first = 0;
+    }
+
+    for (n = 0; n < buffer->count; n++) {
+      struct trace_event_t *event = &buffer->events[n];
+      if (fp) {
+        fprintf(fp, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"cat\":\"%s\",\"name\":", buffer->tid, (event->start - startup) * 1000,
+            (event->end - event->start) * 1000, event->cat);
+        json_write_string(fp, event->name, strlen(event->name));
+        if (event->detail) {
+          fputs(",\"args\":{\"detail\":", fp);
+          json_write_string(fp, event->detail, strlen(event->detail));
+          fputc('}', fp);
         }
+        fputc('}', fp);
       }
-      *(arrayend - 1) = '\0';
-      *deplist = parse_bash_array(*deplist, arrayptr, type);
-      lineptr = arrayend;
+      free(event->detail);
     }
+
+    free(buffer->events);
+    free(buffer);
   }
-} /* }}} */
+  tracing.buffers = NULL;
+  trace_local = NULL;
 
-int print_escaped(const char *delim) { /* {{{ */
-  const char *f;
-  int out = 0;
+  if (!fp) {
+    return 1;
+  }
 
-  for (f = delim; *f != '\0'; f++) {
-    if (*f == '\\') {
-      switch (*++f) {
-        case '\\':
-          putchar('\\');
-          break;
-        case '"':
-          putchar('\"');
-          break;
-        case 'a':
-          putchar('\a');
-          break;
-        case 'b':
-          putchar('\b');
-          break;
-        case 'e': /* \e is nonstandard */
-          putchar('\033');
-          break;
-        case 'n':
-          putchar('\n');
-          break;
-        case 'r':
-          putchar('\r');
-          break;
-        case 't':
-          putchar('\t');
-          break;
-        case 'v':
-          putchar('\v');
-          break;
-        ++out;
-      }
-    } else {
-      putchar(*f);
-      ++out;
-    }
+  fputs("\n]}\n", fp);
+  if (fclose(fp) != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to write %s: %s\n", cfg.tracefile,
+        strerror(errno));
+    return 1;
   }
 
-  return(out);
+  return 0;
 } /* }}} */
 
-void print_extinfo_list(alpm_list_t *list, const char *fieldname, const char *delim, int wrap) { /* {{{ */
-  const alpm_list_t *next, *i;
-  size_t cols, count = 0;
-
-  if (!list) {
-    return;
+/**
+ * Releases whatever the transport in use set up in transport_init.
+ */
+void transport_cleanup() { /* {{{ */
+  if (transport->cleanup) {
+    transport->cleanup();
   }
+} /* }}} */
 
-  cols = getcols();
+CURLcode transport_curl_fetch(CURL *curl, struct request_t *request) { /* {{{ */
+  double namelookup = 0, connect = 0, appconnect = 0, starttransfer = 0, total = 0;
+  double bytes = 0;
+  CURLcode curlstat;
 
-  if (fieldname) {
-    count += printf("%-*s: ", INFO_INDENT - 2, fieldname);
+  curl_easy_setopt(curl, CURLOPT_URL, request->url);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, request->writefn);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, request->writedata);
+  if (request->identity) {
+    curl_easy_setopt(curl, CURLOPT_ENCODING, "identity");
   }
 
-  for (i = list; i; i = next) {
-    next = alpm_list_next(i);
-    if (wrap && cols > 0 && count + strlen(alpm_list_getdata(i)) >= cols) {
-      printf("%-*c", INFO_INDENT + 1, '\n');
-      count = INFO_INDENT;
-    }
-    count += printf("%s", (const char*)alpm_list_getdata(i));
-    if (next) {
-      count += print_escaped(delim);
-    }
-  }
-  putchar('\n');
+  curlstat = curl_easy_perform(curl);
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &request->httpcode);
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &bytes);
+
+  /* curl's times are cumulative, and a step that didn't happen reads as 0 */
+  connect = connect > namelookup ? connect : namelookup;
+  appconnect = appconnect > connect ? appconnect : connect;
+  starttransfer = starttransfer > appconnect ? starttransfer : appconnect;
+  total = total > starttransfer ? total : starttransfer;
+
+  request->stat.dns = namelookup * 1000;
+  request->stat.connect = (connect - namelookup) * 1000;
+  request->stat.tls = (appconnect - connect) * 1000;
+  request->stat.server = (starttransfer - appconnect) * 1000;
+  request->stat.transfer = (total - starttransfer) * 1000;
+  request->stat.total = total * 1000;
+  request->stat.bytes = bytes;
+
+  return curlstat;
 } /* }}} */
 
-void print_pkg_formatted(struct aurpkg_t *pkg) { /* {{{ */
-  const char *p, *end;
-  char fmt[32], buf[64];
-  int len;
+/**
+ * Hands a body we already have to the request's reader, in the same sized
+ * pieces curl would.
+ */
+CURLcode transport_deliver(struct request_t *request, char *body, size_t len) { /* {{{ */
+  size_t off, chunk;
 
-  end = rawmemchr(cfg.format, '\0');
-
-  for (p = cfg.format; p < end; p++) {
-    len = 0;
-    if (*p == '%') {
-      len = strspn(p + 1 + len, printf_flags);
-      len += strspn(p + 1 + len, digits);
-      snprintf(fmt, len + 3, "%ss", p);
-      fmt[len + 1] = 's';
-      p += len + 1;
-      switch (*p) {
-        /* simple attributes */
-        case 'c':
-          printf(fmt, aur_cat[pkg->cat]);
-          break;
-        case 'd':
-          printf(fmt, pkg->desc);
-          break;
-        case 'i':
-          printf(fmt, pkg->id);
-          break;
-        case 'l':
-          printf(fmt, pkg->lic);
-          break;
-        case 'n':
-          printf(fmt, pkg->name);
-          break;
-        case 'o':
-          printf(fmt, pkg->votes);
-          break;
-        case 'p':
-          snprintf(buf, 64, AUR_PKG_URL_FORMAT "%s", cfg.proto, pkg->id);
-          printf(fmt, buf);
-          break;
-        case 't':
-          printf(fmt, pkg->ood ? "yes" : "no");
-          break;
-        case 'u':
-          printf(fmt, pkg->url);
-          break;
-        case 'v':
-          printf(fmt, pkg->ver);
-          break;
-        /* list based attributes */
-        case 'C':
-          print_extinfo_list(pkg->conflicts, NULL, cfg.delim, 0);
-          break;
-        case 'D':
-          print_extinfo_list(pkg->depends, NULL, cfg.delim, 0);
-          break;
-        case 'M':
-          print_extinfo_list(pkg->makedepends, NULL, cfg.delim, 0);
-          break;
-        case 'O':
-          print_extinfo_list(pkg->optdepends, NULL, cfg.delim, 0);
-          break;
-        case 'P':
-          print_extinfo_list(pkg->provides, NULL, cfg.delim, 0);
-          break;
-        case 'R':
-          print_extinfo_list(pkg->replaces, NULL, cfg.delim, 0);
-          break;
-        case '%':
-          putchar('%');
-          break;
-        default:
-          putchar('?');
-          break;
-      }
-    } else if (*p == '\\') {
-      char ebuf[3];
-      ebuf[0] = *p;
-      ebuf[1] = *++p;
-      ebuf[2] = '\0';
-      print_escaped(ebuf);
-    } else {
-      putchar(*p);
+  for (off = 0; off < len; off += chunk) {
+    chunk = len - off < CURL_MAX_WRITE_SIZE ? len - off : CURL_MAX_WRITE_SIZE;
+    if (request->writefn(body + off, 1, chunk, request->writedata) != chunk) {
+      return CURLE_WRITE_ERROR;
     }
   }
 
-  return;
+  return CURLE_OK;
 } /* }}} */
 
-void print_pkg_info(struct aurpkg_t *pkg) { /* {{{ */
-  pmpkg_t *ipkg;
-
-  printf(PKG_REPO "     : %saur%s\n", colstr->repo, colstr->nc);
-  printf(NAME "           : %s%s%s", colstr->pkg, pkg->name, colstr->nc);
-  if ((ipkg = alpm_db_get_pkg(db_local, pkg->name))) {
-    const char *instcolor;
-    if (alpm_pkg_vercmp(pkg->ver, alpm_pkg_get_version(ipkg)) > 0) {
-      instcolor = colstr->ood;
-    } else {
-      instcolor = colstr->utd;
+/**
+ * Every request to the AUR goes through here, so that each is timed in
+ * the same way, whether for --stats or --trace, no matter which transport
+ * carries it.
+ */
+CURLcode transport_fetch(CURL *curl, struct request_t *request) { /* {{{ */
+  CURLcode curlstat;
+  const struct recording_t *cached = NULL;
+  struct response_t body = { NULL, 0 };
+  double start = now_ms();
+  int cacheable = server.active && request->type != STAT_REQUEST_TARBALL;
+
+  if (cacheable && (cached = daemon_cache_get(request->url))) {
+    cwr_printf(LOG_DEBUG, "using cached response for %s\n", request->url);
+    request->httpcode = cached->httpcode;
+    request->stat.bytes = cached->len;
+    curlstat = transport_deliver(request, cached->body, cached->len);
+  } else if (cacheable) {
+    /* a reader stopping early leaves a partial body, which is no use to
+     * anyone else */
+    curlstat = transport_tee(curl, request, transport->fetch, &body);
+    if (curlstat == CURLE_OK && request->httpcode == 200) {
+      daemon_cache_put(request->url, request->httpcode, body.data, body.size);
     }
-    printf(" %s[%sinstalled%s]%s", colstr->url, instcolor, colstr->url, colstr->nc);
+    free(body.data);
+  } else {
+    curlstat = transport->fetch(curl, request);
   }
-  putchar('\n');
 
-  printf(VERSION "        : %s%s%s\n",
-      pkg->ood ? colstr->ood : colstr->utd, pkg->ver, colstr->nc);
-  printf(URL "            : %s%s%s\n", colstr->url, pkg->url, colstr->nc);
-  printf(PKG_AURPAGE "       : %s" AUR_PKG_URL_FORMAT "%s%s\n",
-      colstr->url, cfg.proto, pkg->id, colstr->nc);
+  trace_end("http", stat_request_names[request->type], request->url, start);
+  stats_add_request(request);
 
-  print_extinfo_list(pkg->depends, PKG_DEPENDS, LIST_DELIM, 1);
-  print_extinfo_list(pkg->makedepends, PKG_MAKEDEPENDS, LIST_DELIM, 1);
-  print_extinfo_list(pkg->provides, PKG_PROVIDES, LIST_DELIM, 1);
-  print_extinfo_list(pkg->conflicts, PKG_CONFLICTS, LIST_DELIM, 1);
+  return curlstat;
+} /* }}} */
 
-  if (pkg->optdepends) {
-    const alpm_list_t *i;
-    printf(PKG_OPTDEPENDS "  : %s\n", (const char*)alpm_list_getdata(pkg->optdepends));
-    for (i = pkg->optdepends->next; i; i = alpm_list_next(i)) {
-      printf("%-*s%s\n", INFO_INDENT, "", (const char*)alpm_list_getdata(i));
-    }
+int transport_init() { /* {{{ */
+  if (cfg.replaydir) {
+    transport = &transports[2];
+  } else if (cfg.recorddir) {
+    transport = &transports[1];
   }
 
-  print_extinfo_list(pkg->replaces, PKG_REPLACES, LIST_DELIM, 1);
+  cwr_printf(LOG_DEBUG, "using %s transport\n", transport->name);
 
-  printf(PKG_CAT "       : %s\n"
-         PKG_LICENSE "        : %s\n"
-         PKG_NUMVOTES "          : %s\n"
-         PKG_OOD "    : %s%s%s\n"
-         PKG_DESC "    : ",
-         aur_cat[pkg->cat], pkg->lic, pkg->votes,
-         pkg->ood ? colstr->ood : colstr->utd,
-         pkg->ood ? "Yes" : "No", colstr->nc);
+  return transport->init ? transport->init() : 0;
+} /* }}} */
 
-  indentprint(pkg->desc, INFO_INDENT);
-  printf("\n\n");
+/**
+ * Recordings are keyed on everything after the host, so that a session
+ * recorded against one server can be replayed in place of another.
+ */
+const char *transport_key(const char *url) { /* {{{ */
+  const char *path;
 
-  if (cfg.extinfo && cfg.printcomments) {
-    const alpm_list_t *i;
-    if (alpm_list_count(pkg->comments) == 0) {
-      printf("%sNo comments%s\n\n", colstr->commentheader, colstr->nc);
-    } else {
-      for (i = pkg->comments; i; i = i->next) {
-        char *comment_header, *end_of_first_line, *the_comment;
-        the_comment = alpm_list_getdata(i);
-        end_of_first_line = strchr(the_comment, '\n');
-        CALLOC(comment_header, end_of_first_line - the_comment + 1, sizeof(char), return);
-        strncpy(comment_header, the_comment, end_of_first_line - the_comment);
-        printf("%s%s%s", colstr->commentheader, comment_header, colstr->nc);
-        printf("%s%s%s\n", colstr->comment, end_of_first_line, colstr->nc);
-        free(comment_header);
-      }
-    }
+  path = strstr(url, "://");
+  if (path && (path = strchr(path + 3, '/'))) {
+    return path;
   }
 
+  return url;
 } /* }}} */
 
-void print_pkg_search(struct aurpkg_t *pkg) { /* {{{ */
-  if (cfg.quiet) {
-    printf("%s%s%s\n", colstr->pkg, pkg->name, colstr->nc);
-  } else {
-    pmpkg_t *ipkg;
-    printf("%saur/%s%s%s %s%s%s%s (%s)", colstr->repo, colstr->nc, colstr->pkg,
-        pkg->name, pkg->ood ? colstr->ood : colstr->utd, pkg->ver,
-        NCFLAG(pkg->ood, " <!>"), colstr->nc, pkg->votes);
-    if ((ipkg = alpm_db_get_pkg(db_local, pkg->name))) {
-      const char *instcolor;
-      if (alpm_pkg_vercmp(pkg->ver, alpm_pkg_get_version(ipkg)) > 0) {
-        instcolor = colstr->ood;
-      } else {
-        instcolor = colstr->utd;
-      }
-      printf(" %s[%sinstalled%s]%s", colstr->url, instcolor, colstr->url, colstr->nc);
-    }
-    printf("\n    ");
-    indentprint(pkg->desc, SRCH_INDENT);
-    putchar('\n');
-  }
-} /* }}} */
+/**
+ * Fetches over the network like the curl transport, keeping a copy of each
+ * response in the record directory along with its status and timings.
+ */
+CURLcode transport_record_fetch(CURL *curl, struct request_t *request) { /* {{{ */
+  struct response_t body;
+  CURLcode curlstat;
+  const char *key = transport_key(request->url);
+  char *header, *path, *buf;
+  int len;
 
-void print_results(alpm_list_t *results, void (*printfn)(struct aurpkg_t*)) { /* {{{ */
-  const alpm_list_t *i;
-  struct aurpkg_t *prev = NULL;
+  curlstat = transport_tee(curl, request, transport_curl_fetch, &body);
 
-  if (!printfn) {
-    return;
+  /* a reader may stop a transfer once it has what it needs, and the
+   * recording should stop at the same place. anything else has failed, and
+   * there is nothing to replay */
+  if (curlstat != CURLE_OK && curlstat != CURLE_WRITE_ERROR) {
+    free(body.data);
+    return curlstat;
   }
 
-  if (!results && (cfg.opmask & OP_INFO)) {
-    cwr_fprintf(stderr, LOG_ERROR, "no results found\n");
-    return;
+  len = cwr_asprintf(&header, RECORD_MAGIC "url: %s\ncode: %ld\nttfb: %.3f\n"
+      "total: %.3f\nlength: %zu\n\n", key, request->httpcode,
+      request->stat.total - request->stat.transfer, request->stat.total, body.size);
+  if (len < 0) {
+    free(body.data);
+    return curlstat;
   }
 
-  for (i = results; i; i = alpm_list_next(i)) {
-    struct aurpkg_t *pkg = alpm_list_getdata(i);
-
-    /* don't print duplicates */
-    if (!prev || aurpkg_cmp(pkg, prev) != 0) {
-      printfn(pkg);
-    }
-    prev = pkg;
+  MALLOC(buf, len + body.size, free(header); free(body.data); return curlstat);
+  memcpy(buf, header, len);
+  if (body.size) {
+    memcpy(buf + len, body.data, body.size);
   }
-} /* }}} */
 
-int resolve_dependencies(CURL *curl, const char *pkgname) { /* {{{ */
-  const alpm_list_t *i;
-  alpm_list_t *deplist = NULL;
-  char *filename, *pkgbuild;
-  static pthread_mutex_t flock = PTHREAD_MUTEX_INITIALIZER;
-  static pthread_mutex_t alock = PTHREAD_MUTEX_INITIALIZER;
-  void *retval;
+  path = transport_record_path(key);
+  if (!path) {
+    cwr_printf(LOG_DEBUG, "failed to record %s: %s\n", key, strerror(errno));
+  } else if (cache_write(path, buf, len + body.size) == 0) {
+    cwr_printf(LOG_DEBUG, "recorded %s to %s\n", key, path);
+  } else {
+    unlink(path);
+  }
 
-  curl = curl_init_easy_handle(curl);
+  free(path);
+  free(buf);
+  free(header);
+  free(body.data);
 
-  cwr_asprintf(&filename, "%s/%s/PKGBUILD", cfg.dlpath, pkgname);
+  return curlstat;
+} /* }}} */
 
-  pkgbuild = get_file_as_buffer(filename);
-  if (!pkgbuild) {
+int transport_record_init() { /* {{{ */
+  if (mkpath(cfg.recorddir) != 0) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to create %s: %s\n", cfg.recorddir,
+        strerror(errno));
     return 1;
   }
 
-  alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
-    &deplist, &deplist, NULL, NULL, NULL, NULL
-  };
-
-  cwr_printf(LOG_DEBUG, "Parsing %s for extended info\n", filename);
-  pkgbuild_get_extinfo(pkgbuild, pkg_details);
-  free(pkgbuild);
-  free(filename);
-
-  for (i = deplist; i; i = alpm_list_next(i)) {
-    const char *depend = alpm_list_getdata(i);
-    char *sanitized = strdup(depend);
+  return 0;
+} /* }}} */
 
-    *(sanitized + strcspn(sanitized, "<>=")) = '\0';
+/**
+ * Finds the file the recording of key belongs in, which is named for a
+ * hash of it. A name already holding some other key moves on to the next
+ * in a chain, and replay never notices since it goes by the url inside.
+ * Free names are claimed on the spot, so two workers can't both take one.
+ */
+char *transport_record_path(const char *key) { /* {{{ */
+  char *path, *line = NULL;
+  size_t len = 0, keylen = strlen(key);
+  unsigned long hash = hashtable_hash(key);
+  int n, fd, same;
+  FILE *fp;
 
-    pthread_mutex_lock(&alock);
-    if (!alpm_list_find_str(cfg.targets, sanitized)) {
-      cfg.targets = alpm_list_add(cfg.targets, sanitized);
+  for (n = 0; ; n++) {
+    if (n == 0) {
+      cwr_asprintf(&path, "%s/%08lx.resp", cfg.recorddir, hash);
     } else {
-      if (cfg.logmask & LOG_BRIEF &&
-              !alpm_find_satisfier(alpm_db_get_pkgcache(db_local), depend)) {
-          cwr_printf(LOG_BRIEF, "S\t%s\n", sanitized);
-      }
-      FREE(sanitized);
+      cwr_asprintf(&path, "%s/%08lx-%d.resp", cfg.recorddir, hash, n);
     }
-    pthread_mutex_unlock(&alock);
 
-    if (sanitized) {
-      pthread_mutex_lock(&flock);
-      alpm_list_t *pkgcache = alpm_db_get_pkgcache(db_local);
-      pmpkg_t *satisfier = alpm_find_satisfier(pkgcache, depend);
-      pthread_mutex_unlock(&flock);
-      if (satisfier) {
-        cwr_printf(LOG_DEBUG, "%s is already satisified\n", depend);
-      } else {
-        retval = task_download(curl, sanitized);
-        alpm_list_free_inner(retval, aurpkg_free);
-        alpm_list_free(retval);
-      }
+    fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    if (fd >= 0) {
+      close(fd);
+      break;
+    } else if (errno != EEXIST) {
+      FREE(path);
+      break;
+    }
+
+    /* the same request is recorded again in place */
+    same = 0;
+    if ((fp = fopen(path, "r"))) {
+      same = getline(&line, &len, fp) > 0 && STREQ(line, RECORD_MAGIC) &&
+        getline(&line, &len, fp) > 0 && STR_STARTS_WITH(line, "url: ") &&
+        strncmp(line + 5, key, keylen) == 0 && STREQ(line + 5 + keylen, "\n");
+      fclose(fp);
+    }
+    if (same) {
+      break;
     }
+    free(path);
   }
 
-  FREELIST(deplist);
+  free(line);
+  return path;
+} /* }}} */
 
-  return 0;
+void transport_replay_cleanup() { /* {{{ */
+  hashtable_free(recordings, free);
+  recordings = NULL;
 } /* }}} */
 
-int set_working_dir() { /* {{{ */
-  char *resolved;
+/**
+ * Hands a recorded response to the request's reader after waiting as long
+ * as the original took, or as long as --replay-delay says.
+ */
+CURLcode transport_replay_fetch(CURL *curl, struct request_t *request) { /* {{{ */
+  const struct recording_t *rec;
+  struct timespec ts;
+  double delay, ttfb;
 
-  if (!(cfg.opmask & OP_DOWNLOAD)) {
-    FREE(cfg.dlpath);
-    return 0;
+  (void)curl;
+
+  rec = hashtable_get(recordings, transport_key(request->url));
+  if (!rec) {
+    cwr_printf(LOG_DEBUG, "no recording of %s\n", request->url);
+    return CURLE_REMOTE_FILE_NOT_FOUND;
   }
 
-  resolved = cfg.dlpath ? realpath(cfg.dlpath, NULL) : getcwd(NULL, 0);
-  if (!resolved) {
-    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", cfg.dlpath, strerror(errno));
-    FREE(cfg.dlpath);
-    return 1;
+  if (cfg.replaydelay == UNSET) {
+    delay = rec->total;
+    ttfb = rec->ttfb;
+  } else {
+    delay = ttfb = cfg.replaydelay;
   }
 
-  free(cfg.dlpath);
-  cfg.dlpath = resolved;
+  if (delay > 0) {
+    ts.tv_sec = delay / 1000;
+    ts.tv_nsec = (long)(delay * 1000000) % 1000000000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+  }
 
-  if (access(cfg.dlpath, W_OK) != 0) {
-    cwr_fprintf(stderr, LOG_ERROR, "cannot write to %s: %s\n",
-        cfg.dlpath, strerror(errno));
-    FREE(cfg.dlpath);
+  request->httpcode = rec->httpcode;
+  request->stat.server = ttfb;
+  request->stat.transfer = delay - ttfb;
+  request->stat.total = delay;
+  request->stat.bytes = rec->len;
+
+  return transport_deliver(request, rec->body, rec->len);
+} /* }}} */
+
+/**
+ * Reads every recording in the replay directory up front, so that workers
+ * only ever do lookups.
+ */
+int transport_replay_init() { /* {{{ */
+  DIR *dir;
+  struct dirent *ent;
+  struct recording_t *rec;
+  struct stat st;
+  char *path, *p, *line, *eol;
+  FILE *fp;
+  size_t len;
+
+  dir = opendir(cfg.replaydir);
+  if (!dir) {
+    cwr_fprintf(stderr, LOG_ERROR, "failed to open %s: %s\n", cfg.replaydir,
+        strerror(errno));
     return 1;
   }
 
-  if (chdir(cfg.dlpath) != 0) {
-    cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", cfg.dlpath, strerror(errno));
+  recordings = hashtable_new(0);
+  if (!recordings) {
+    closedir(dir);
     return 1;
   }
 
-  cwr_printf(LOG_DEBUG, "working directory set to: %s\n", cfg.dlpath);
+  while ((ent = readdir(dir))) {
+    len = strlen(ent->d_name);
+    if (len < 5 || !STREQ(ent->d_name + len - 5, ".resp")) {
+      continue;
+    }
 
-  return 0;
-} /* }}} */
+    cwr_asprintf(&path, "%s/%s", cfg.replaydir, ent->d_name);
+    fp = fopen(path, "r");
+    if (!fp || fstat(fileno(fp), &st) != 0) {
+      cwr_fprintf(stderr, LOG_WARN, "failed to read %s: %s\n", path, strerror(errno));
+      goto next;
+    }
 
-int strings_init() { /* {{{ */
-  MALLOC(colstr, sizeof *colstr, return 1);
+    MALLOC(rec, sizeof *rec + st.st_size + 1, goto next);
+    memset(rec, 0, sizeof *rec);
+    p = (char*)(rec + 1);
+    len = fread(p, 1, st.st_size, fp);
+    p[len] = '\0';
 
-  if (cfg.color > 0) {
-    colstr->error = BOLDRED "::" NC;
-    colstr->warn = BOLDYELLOW "::" NC;
-    colstr->info = BOLDBLUE "::" NC;
-    colstr->pkg = BOLD;
-    colstr->repo = BOLDMAGENTA;
-    colstr->url = BOLDCYAN;
-    colstr->ood = BOLDRED;
-    colstr->utd = BOLDGREEN;
-    colstr->nc = NC;
-    colstr->commentheader = BOLDYELLOW;
-    colstr->comment = "\n---";
-  } else {
-    colstr->error = "error:";
-    colstr->warn = "warning:";
-    colstr->info = "::";
-    colstr->pkg = "";
-    colstr->repo = "";
-    colstr->url = "";
-    colstr->ood = "";
-    colstr->utd = "";
-    colstr->nc = "";
-    colstr->commentheader = "";
-    colstr->comment = "\n---";
+    if (!STR_STARTS_WITH(p, RECORD_MAGIC)) {
+      cwr_fprintf(stderr, LOG_WARN, "%s is not a recording\n", path);
+      free(rec);
+      goto next;
+    }
+
+    /* headers run up to the first empty line, and the body follows */
+    for (line = p + strlen(RECORD_MAGIC); (eol = strchr(line, '\n')) && eol != line; line = eol + 1) {
+      *eol = '\0';
+      if (STR_STARTS_WITH(line, "url: ")) {
+        rec->url = line + 5;
+      } else if (STR_STARTS_WITH(line, "code: ")) {
+        rec->httpcode = strtol(line + 6, NULL, 10);
+      } else if (STR_STARTS_WITH(line, "ttfb: ")) {
+        rec->ttfb = strtod(line + 6, NULL);
+      } else if (STR_STARTS_WITH(line, "total: ")) {
+        rec->total = strtod(line + 7, NULL);
+      } else if (STR_STARTS_WITH(line, "length: ")) {
+        rec->len = strtoul(line + 8, NULL, 10);
+      }
+    }
+
+    if (!eol || !rec->url || (size_t)(p + len - (eol + 1)) != rec->len) {
+      cwr_fprintf(stderr, LOG_WARN, "%s is truncated or malformed\n", path);
+      free(rec);
+      goto next;
+    }
+    rec->body = eol + 1;
+
+    if (hashtable_add(recordings, rec->url, rec) != 0) {
+      free(rec);
+    }
+
+next:
+    if (fp) {
+      fclose(fp);
+    }
+    free(path);
   }
+  closedir(dir);
 
-  /* guard against delim being something other than LIST_DELIM if extinfo
-   * and format aren't provided */
-  cfg.delim = (cfg.extinfo && cfg.format) ? cfg.delim : LIST_DELIM;
+  cwr_printf(LOG_DEBUG, "loaded %zu recordings from %s\n", recordings->count, cfg.replaydir);
 
   return 0;
 } /* }}} */
 
 /**
- * Strips html tags from input string, returning the result. Also
- * removes superfluous whitespace and replaces special html
- * characters.
+ * Fetches with the given transport, keeping a copy in body of everything
+ * the request's reader was given.
  */
-char *strip_and_sanitize_html(char *html) { /* {{{ */
-  int i, output_ind=0, len;
-  char *output;
-  html_strip_state_t html_state;
-  struct html_character_codes_t html_code_mapping;
+CURLcode transport_tee(CURL *curl, struct request_t *request,
+    CURLcode (*fetch)(CURL*, struct request_t*), struct response_t *body) { /* {{{ */
+  struct tee_t tee;
+  struct request_t inner = *request;
+  CURLcode curlstat;
 
-  len = strlen(html);
-  CALLOC(output, len+1, sizeof(char), return NULL);
+  tee.request = request;
+  tee.body.data = NULL;
+  tee.body.size = 0;
 
-  /* Finite state machine with 2 states: reading a tag or not. We
-   * ignore the possibility of an html attribute containing the
-   * character '>' */
-  html_state = NOT_READING_TAG;
-  for (i = 0; i < len; ++i) {
-    if (html_state == READING_TAG) {
-      if (html[i] == '>') /* end of this tag */
-        html_state = NOT_READING_TAG;
-    } else {
-      if (html[i] == '<') /* here's a new tag */
-        html_state = READING_TAG;
-      else
-        /* we discard two newlines in a row and all tabs */
-        if (!(html[i] == '\t' || (output_ind > 0 &&
-                                  output[output_ind-1] == '\n' && html[i] == '\n')))
-          output[output_ind++] = html[i];
-    }
-  }
-  output[output_ind] = '\0';
-  free(html);
+  inner.writefn = transport_tee_write;
+  inner.writedata = &tee;
 
-  /* Clean up some special html characters */
-  i=0;
-  for (;;) {
-    html_code_mapping = html_character_codes[i++];
-    if (html_code_mapping.name_code == NULL) break;
+  curlstat = fetch(curl, &inner);
+  request->httpcode = inner.httpcode;
+  request->stat = inner.stat;
+  *body = tee.body;
 
-    /* avoid the mallocs and frees associated with string replace if possible: */
-    if (strstr(output, html_code_mapping.name_code) != NULL) {
-      char *output_before = output;
-      output = strreplace(output, html_code_mapping.name_code, html_code_mapping.glyph);
-      FREE(output_before);
-    }
-  }
+  return curlstat;
+} /* }}} */
+
+size_t transport_tee_write(void *ptr, size_t size, size_t nmemb, void *userdata) { /* {{{ */
+  struct tee_t *tee = userdata;
+
+  /* the reader has seen this chunk even if it turns the rest down */
+  curl_write_response(ptr, size, nmemb, &tee->body);
 
-  return output;
+  return tee->request->writefn(ptr, size, nmemb, tee->request->writedata);
 } /* }}} */
 
 /**
- * String replace. The pointer that is returned should be free'd by
- * the user.
+ * Recreates the tree at src as dst, cloning each file. Clones share no
+ * inode with the cache, so nothing done to dst can reach the tree. Anything
+ * already at dst is replaced. Returns nonzero if a file couldn't be cloned,
+ * e.g. across filesystems, leaving the caller to fall back on extracting.
  */
-char *strreplace(const char *st,
-                 const char *replace,
-                 const char *replace_with) { /* {{{ */
-    char *ret, *found, *replace_, *replace_with_, *st_, *tmp, *last, *writing;
-    size_t newlen;
-    int len_replace, len_replace_with, len_st, cnt;
-
-    len_replace      = strlen(replace);
-    len_replace_with = strlen(replace_with);
-    len_st           = strlen(st);
-
-    MALLOC(replace_, (size_t)len_replace + 1, return NULL);
-    MALLOC(replace_with_, (size_t)len_replace_with + 1, return NULL);
-    MALLOC(st_, (size_t)len_st + 1, return NULL);
-    strcpy(st_, st); /* what we won't do for const... */
-    found         = strstr(st_, replace);
-    if (found == NULL) {
-        /* can't assign directly due to const: */
-        ret = (char *) malloc(strlen(st_)+1);
-        strcpy(ret, st_);
-        goto finishup;
-    }
+int tree_link(const char *src, const char *dst) { /* {{{ */
+  struct timespec times[2];
+  struct dirent *dent;
+  struct stat st;
+  int ret = 0, in, out;
+  DIR *dir;
 
-    strcpy(replace_, replace);
-    strcpy(replace_with_, replace_with);
+  if (lstat(src, &st) != 0) {
+    return 1;
+  }
 
-    tmp = st_;
-    for (cnt = 0; ; cnt++) {
-        found = strstr(tmp, replace);
-        if (found == NULL) break;
-        tmp = found + len_replace;
+  if (S_ISDIR(st.st_mode)) {
+    if (mkdir(dst, st.st_mode & 07777) != 0 && errno != EEXIST) {
+      return 1;
     }
-
-    newlen = len_st - (cnt * len_replace) + (cnt * len_replace_with) + 1;
-    MALLOC(ret, newlen, return NULL);
-
-    tmp = last = st_;
-    writing = ret;
-    for (int i=0; i < cnt; i++) {
-        /* write the good piece */
-        tmp = strstr(last, replace);
-        memcpy(writing, last, tmp - last);
-        /* update where we're writing and where we just matched */
-        writing += tmp - last;
-        last = tmp + len_replace;
-        /* write the replacement string */
-        memcpy(writing, replace_with, len_replace_with);
-        /* update where we're writing */
-        writing += len_replace_with;
+    if (!(dir = opendir(src))) {
+      return 1;
     }
-    if (writing < ret + newlen) {
-        /* finish it out */
-        memcpy(writing, last, st_ + len_st - last);
+    while (ret == 0 && (dent = readdir(dir))) {
+      char *srcpath, *dstpath;
+      if (STREQ(dent->d_name, ".") || STREQ(dent->d_name, "..")) {
+        continue;
+      }
+      cwr_asprintf(&srcpath, "%s/%s", src, dent->d_name);
+      cwr_asprintf(&dstpath, "%s/%s", dst, dent->d_name);
+      ret = tree_link(srcpath, dstpath);
+      free(srcpath);
+      free(dstpath);
     }
-    ret[newlen-1] = '\0';
+    closedir(dir);
 
-finishup:
-    FREE(replace_);
-    FREE(replace_with_);
-    FREE(st_);
+    /* the directory's times only settle once its contents are in */
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    utimensat(AT_FDCWD, dst, times, 0);
     return ret;
-} /* }}} */
-
+  }
 
-char *strtrim(char *str) { /* {{{ */
-  char *pch = str;
+  unlink(dst);
 
-  if (!str || *str == '\0') {
-    return str;
+  if (S_ISLNK(st.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(src, target, sizeof target - 1);
+    if (len < 0) {
+      return 1;
+    }
+    target[len] = '\0';
+    return symlink(target, dst);
   }
 
-  while (isspace((unsigned char)*pch)) {
-    pch++;
+  in = open(src, O_RDONLY);
+  out = open(dst, O_WRONLY|O_CREAT|O_TRUNC, st.st_mode & 07777);
+  ret = in < 0 || out < 0 || ioctl(out, FICLONE, in) != 0;
+  if (ret == 0) {
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    fchmod(out, st.st_mode & 07777);
+    futimens(out, times);
   }
-  if (pch != str) {
-    memmove(str, pch, (strlen(pch) + 1));
+  if (in >= 0) {
+    close(in);
+  }
+  if (out >= 0) {
+    close(out);
+    if (ret != 0) {
+      unlink(dst);
+    }
   }
+  return ret;
+} /* }}} */
 
-  if (*str == '\0') {
-    return str;
+int tree_remove(const char *path) { /* {{{ */
+  struct dirent *dent;
+  struct stat st;
+  DIR *dir;
+
+  if (lstat(path, &st) != 0) {
+    return errno == ENOENT ? 0 : 1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return unlink(path);
   }
 
-  pch = (str + (strlen(str) - 1));
-  while (isspace((unsigned char)*pch)) {
-    pch--;
+  if ((dir = opendir(path))) {
+    while ((dent = readdir(dir))) {
+      char *child;
+      if (STREQ(dent->d_name, ".") || STREQ(dent->d_name, "..")) {
+        continue;
+      }
+      cwr_asprintf(&child, "%s/%s", path, dent->d_name);
+      tree_remove(child);
+      free(child);
+    }
+    closedir(dir);
   }
-  *++pch = '\0';
 
-  return str;
+  return rmdir(path);
 } /* }}} */
 
-void *task_download(CURL *curl, void *arg) { /* {{{ */
-  alpm_list_t *queryresult = NULL;
-  CURLcode curlstat;
-  const char *db;
-  char *url, *escaped;
-  const void *self;
-  int ret;
-  long httpcode;
-  struct response_t response;
+off_t tree_size(const char *path) { /* {{{ */
+  struct dirent *dent;
   struct stat st;
-  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
-  curl = curl_init_easy_handle(curl);
-
-  self = (const void*)pthread_self();
+  off_t size = 0;
+  DIR *dir;
 
-  pthread_mutex_lock(&lock);
-  cwr_printf(LOG_DEBUG, "[%p]: locking alpm mutex\n", self);
-  db = alpm_provides_pkg(arg);
-  cwr_printf(LOG_DEBUG, "[%p]: unlocking alpm mutex\n", self);
-  pthread_mutex_unlock(&lock);
-
-  if (db) {
-    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_WARN "\t%s\t", (const char*)arg);
-    cwr_fprintf(stderr, LOG_WARN, "%s%s%s is available in %s%s%s\n",
-        colstr->pkg, (const char*)arg, colstr->nc,
-        colstr->repo, db, colstr->nc);
-    return NULL;
+  if (lstat(path, &st) != 0) {
+    return 0;
   }
-
-  queryresult = task_query(curl, arg);
-  if (!queryresult) {
-    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-    cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", (const char*)arg);
-    return NULL;
+  if (!S_ISDIR(st.st_mode)) {
+    return st.st_size;
   }
 
-  if (stat(arg, &st) == 0 && !cfg.force) {
-    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-    cwr_fprintf(stderr, LOG_ERROR, "`%s/%s' already exists. Use -f to overwrite.\n",
-        cfg.dlpath, (const char*)arg);
-    alpm_list_free_inner(queryresult, aurpkg_free);
-    alpm_list_free(queryresult);
-    return NULL;
+  if ((dir = opendir(path))) {
+    while ((dent = readdir(dir))) {
+      char *child;
+      if (STREQ(dent->d_name, ".") || STREQ(dent->d_name, "..")) {
+        continue;
+      }
+      cwr_asprintf(&child, "%s/%s", path, dent->d_name);
+      size += tree_size(child);
+      free(child);
+    }
+    closedir(dir);
   }
 
-  response.data = NULL;
-  response.size = 0;
+  return size;
+} /* }}} */
 
-  curl_easy_setopt(curl, CURLOPT_ENCODING, "identity"); /* disable compression */
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_response);
+/**
+ * Reads the umask, which can only be had by setting it. Any file created
+ * while it's set to 0 gets the widest mode, so this is done once, before
+ * there are other threads to create anything.
+ */
+void umask_read(void) { /* {{{ */
+  process_umask = umask(0);
+  umask(process_umask);
+} /* }}} */
 
-  escaped = curl_easy_escape(curl, arg, strlen(arg));
-  cwr_asprintf(&url, AUR_PKG_URL, cfg.proto, escaped, escaped);
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_free(escaped);
+int unescape_char(char c) { /* {{{ */
+  switch (c) {
+    case '\\':
+      return '\\';
+    case '"':
+      return '\"';
+    case 'a':
+      return '\a';
+    case 'b':
+      return '\b';
+    case 'e': /* \e is nonstandard */
+      return '\033';
+    case 'n':
+      return '\n';
+    case 'r':
+      return '\r';
+    case 't':
+      return '\t';
+    case 'v':
+      return '\v';
+  }
 
-  curlstat = curl_easy_perform(curl);
+  return -1;
+} /* }}} */
 
-  if (curlstat != CURLE_OK) {
-    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-    cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", (const char*)arg, curl_easy_strerror(curlstat));
-    goto finish;
+void update_entry_free(void *ptr) { /* {{{ */
+  struct update_entry_t *entry = ptr;
+
+  if (!entry) {
+    return;
   }
 
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
+  free(entry->name);
+  free(entry->localver);
+  free(entry->aurver);
+  free(entry);
+} /* }}} */
 
-  switch (httpcode) {
-    case 200:
-      break;
-    default:
-      cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-      cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with http%ld\n",
-          (const char*)arg, httpcode);
-      goto finish;
-  }
-  cwr_printf(LOG_BRIEF, BRIEF_OK "\t%s\t", (const char*)arg);
-  cwr_printf(LOG_INFO, "%s%s%s downloaded to %s\n",
-      colstr->pkg, (const char*)arg, colstr->nc, cfg.dlpath);
+/**
+ * Reads the AUR's feed of recently modified packages, so that a package
+ * which changed since it was last checked is checked again before its
+ * entry expires. The feed only reaches back so far, which the expiry
+ * covers for. Incremental updates and cached closures both go by it, so
+ * it's only ever read once a run.
+ */
+int update_feed_fetch() { /* {{{ */
+  struct response_t response = { NULL, 0 };
+  struct request_t request;
+  char *url, *item, *end;
+  CURLcode curlstat;
+  CURL *curl = NULL;
+  int ret = 1;
 
-  ret = archive_extract_file(&response);
-  if (ret != ARCHIVE_EOF && ret != ARCHIVE_OK) {
-    cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-    cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to extract tarball\n",
-        (const char*)arg);
-    goto finish;
+  if (updates.modified) {
+    return 0;
   }
 
-  if (cfg.getdeps) {
-    resolve_dependencies(curl, arg);
+  pthread_once(&curl_once, curl_global_setup);
+  if (curl_ready != 1 || !(curl = curl_init_easy_handle(curl_get_handle()))) {
+    return 1;
   }
 
-finish:
-  FREE(url);
-  FREE(response.data);
-
-  return queryresult;
-} /* }}} */
+  cwr_asprintf(&url, AUR_MODIFIED_URL, cfg.proto, cfg.aurhost);
+  memset(&request, 0, sizeof request);
+  request.type = STAT_REQUEST_FEED;
+  request.url = url;
+  request.writefn = curl_write_response;
+  request.writedata = &response;
 
-void *task_query(CURL *curl, void *arg) { /* {{{ */
-  alpm_list_t *pkglist = NULL;
-  CURLcode curlstat;
-  struct yajl_handle_t *yajl_hand = NULL;
-  const char *argstr;
-  char *escaped, *url;
-  long httpcode;
-  int span = 0;
-  struct yajl_parser_t *parse_struct;
+  curlstat = transport_fetch(curl, &request);
+  if (curlstat != CURLE_OK || request.httpcode != 200 || !response.data) {
+    cwr_printf(LOG_DEBUG, "%s: unavailable, relying on expiry alone\n", url);
+    goto finish;
+  }
 
-  /* find a valid chunk of search string */
-  if (cfg.opmask & OP_SEARCH) {
-    for (argstr = arg; *argstr; argstr++) {
-      span = strcspn(argstr, REGEX_CHARS);
+  if (!(updates.modified = hashtable_new(0))) {
+    goto finish;
+  }
 
-      /* given 'cow?', we can't include w in the search */
-      if (*(argstr + span) == '?' || *(argstr + span) == '*') {
-        span--;
-      }
+  for (item = response.data; (item = strstr(item, "<item>")); item = end + 1) {
+    struct update_modified_t *mod;
+    char *title, *date;
+    struct tm tm;
+    size_t len;
 
-      /* a string inside [] or {} cannot be a valid span */
-      if (strchr("[{", *argstr)) {
-        argstr = strpbrk(argstr + span, "]}");
-        continue;
-      }
+    if (!(end = strstr(item, "</item>"))) {
+      break;
+    }
+    *end = '\0';
 
-      if (span >= 2) {
-        break;
+    if (!(title = strstr(item, "<title>"))) {
+      continue;
+    }
+    title += strlen("<title>");
+    len = strcspn(title, "<");
+
+    MALLOC(mod, sizeof *mod + len + 1, break);
+    memcpy(mod->name, title, len);
+    mod->name[len] = '\0';
+
+    /* an item without a usable date might be as new as it gets. a zone
+     * other than a numeric offset is taken to be GMT */
+    mod->modified = time(NULL);
+    memset(&tm, 0, sizeof tm);
+    if ((date = strstr(item, "<pubDate>")) &&
+        (date = strptime(date + strlen("<pubDate>"), "%a, %d %b %Y %H:%M:%S", &tm))) {
+      long offset = 0;
+      date += strspn(date, " ");
+      if (*date == '+' || *date == '-') {
+        offset = strtol(date + 1, NULL, 10);
+        offset = (offset / 100 * 3600 + offset % 100 * 60) * (*date == '-' ? -1 : 1);
       }
+      mod->modified = timegm(&tm) - offset;
     }
 
-    if (span < 2) {
-      cwr_fprintf(stderr, LOG_ERROR, "search string '%s' too short\n", (const char*)arg);
-      return NULL;
+    /* the feed is newest first, so the first mention of a package wins */
+    if (hashtable_add(updates.modified, mod->name, mod) != 0) {
+      free(mod);
     }
-  } else {
-    argstr = arg;
   }
 
-  MALLOC(parse_struct, sizeof *parse_struct, return NULL);
-  parse_struct->pkglist = NULL;
-  parse_struct->json_depth = 0;
-  yajl_hand = yajl_alloc(&callbacks, NULL, (void*)parse_struct);
+  cwr_printf(LOG_DEBUG, "%zu recently modified packages\n", updates.modified->count);
+  ret = 0;
 
-  curl = curl_init_easy_handle(curl);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, yajl_parse_stream);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, yajl_hand);
+finish:
+  curl_put_handle(curl);
+  free(response.data);
+  free(url);
 
-  escaped = curl_easy_escape(curl, argstr, span);
-  if (cfg.opmask & OP_SEARCH) {
-    cwr_asprintf(&url, AUR_RPC_URL, cfg.proto, AUR_QUERY_TYPE_SEARCH, escaped);
-  } else if (cfg.opmask & OP_MSEARCH) {
-    cwr_asprintf(&url, AUR_RPC_URL, cfg.proto, AUR_QUERY_TYPE_MSRCH, escaped);
-  } else {
-    cwr_asprintf(&url, AUR_RPC_URL, cfg.proto, AUR_QUERY_TYPE_INFO, escaped);
+  return ret;
+} /* }}} */
+
+/**
+ * Answers an update check for a package from the last one, when that's
+ * recent enough, the same version is still installed and the AUR hasn't
+ * said the package changed since. Returns 0 and fills pkgs with what the
+ * AUR had then, or 1 if the package needs checking.
+ */
+int update_lookup(const char *name, const char *localver, alpm_list_t **pkgs) { /* {{{ */
+  struct update_entry_t *entry = NULL;
+  struct update_modified_t *mod = NULL;
+  struct aurpkg_t *pkg;
+
+  *pkgs = NULL;
+
+  pthread_mutex_lock(&updates.lock);
+  if (updates.entries) {
+    entry = hashtable_get(updates.entries, name);
+  }
+  if (updates.modified) {
+    mod = hashtable_get(updates.modified, name);
   }
-  curl_easy_setopt(curl, CURLOPT_URL, url);
 
-  cwr_printf(LOG_DEBUG, "[%p]: curl_easy_perform %s\n", (void*)pthread_self(), url);
-  curlstat = curl_easy_perform(curl);
+  if (!entry || time(NULL) - entry->checked >= cfg.incremental ||
+      !STREQ(entry->localver, localver) || (mod && mod->modified >= entry->checked)) {
+    pthread_mutex_unlock(&updates.lock);
+    return 1;
+  }
 
-  if (curlstat != CURLE_OK) {
-    cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", (const char*)arg,
-        curl_easy_strerror(curlstat));
-    goto finish;
+  if (entry->aurver) {
+    CALLOC(pkg, 1, sizeof *pkg, pthread_mutex_unlock(&updates.lock); return 1);
+    pkg->name = strdup(name);
+    pkg->ver = strdup(entry->aurver);
+    *pkgs = alpm_list_add(NULL, pkg);
   }
+  updates.cached++;
+  pthread_mutex_unlock(&updates.lock);
 
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
-  if (httpcode >= 300) {
-    cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with http%ld\n",
-        (const char*)arg, httpcode);
+  return 0;
+} /* }}} */
+
+void update_record(const char *name, const char *localver, const char *aurver) { /* {{{ */
+  struct update_entry_t *entry;
+
+  pthread_mutex_lock(&updates.lock);
+  if (!updates.entries && !(updates.entries = hashtable_new(0))) {
     goto finish;
   }
 
-  yajl_complete_parse(yajl_hand);
+  if (!(entry = hashtable_get(updates.entries, name))) {
+    CALLOC(entry, 1, sizeof *entry, goto finish);
+    entry->name = strdup(name);
+    if (hashtable_add(updates.entries, entry->name, entry) != 0) {
+      update_entry_free(entry);
+      goto finish;
+    }
+  }
 
-  pkglist = parse_struct->pkglist;
+  free(entry->localver);
+  free(entry->aurver);
+  entry->localver = strdup(localver);
+  entry->aurver = aurver ? strdup(aurver) : NULL;
+  entry->checked = time(NULL);
+  updates.dirty = 1;
 
-  if (pkglist && cfg.extinfo) {
-    struct aurpkg_t *aurpkg;
-    char *pburl, *pkgbuild, *aurpkgurl, *aurpkgpage;
+finish:
+  pthread_mutex_unlock(&updates.lock);
+} /* }}} */
 
-    aurpkg = alpm_list_getdata(pkglist);
+/**
+ * Loads what the last checks for updates found, one package per line:
+ * its name, the version installed then, the version in the AUR or - if it
+ * wasn't there, and when it was checked.
+ */
+void update_state_load() { /* {{{ */
+  char *path, *line = NULL;
+  size_t len = 0;
+  FILE *fp;
 
-    cwr_asprintf(&pburl, AUR_PKGBUILD_PATH, cfg.proto, escaped);
-    pkgbuild = curl_get_url_as_buffer(curl, pburl);
-    free(pburl);
+  if (!cfg.cachedir) {
+    return;
+  }
 
-    alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
-      &aurpkg->depends, &aurpkg->makedepends, &aurpkg->optdepends,
-      &aurpkg->provides, &aurpkg->conflicts, &aurpkg->replaces
-    };
+  cwr_asprintf(&path, "%s/updates", cfg.cachedir);
+  fp = fopen(path, "r");
+  free(path);
+  if (!fp || !(updates.entries = hashtable_new(0))) {
+    goto finish;
+  }
 
-    pkgbuild_get_extinfo(pkgbuild, pkg_details);
-    free(pkgbuild);
+  while (getline(&line, &len, fp) > 0) {
+    struct update_entry_t *entry;
+    char *fields[4], *ptr = line, *token;
+    int n;
+
+    line[strcspn(line, "\n")] = '\0';
+    for (n = 0; n < 4 && (fields[n] = strsep(&ptr, "\t")); n++);
+    if (n < 4 || !*fields[0]) {
+      continue;
+    }
 
-    cwr_asprintf(&aurpkgurl, AUR_PKG_URL_FORMAT "%s", cfg.proto, aurpkg->id);
-    aurpkgpage = curl_get_url_as_buffer(curl, aurpkgurl);
-    aurpkg->comments = get_aur_comments(aurpkgpage);
+    CALLOC(entry, 1, sizeof *entry, break);
+    entry->name = strdup(fields[0]);
+    entry->localver = strdup(fields[1]);
+    entry->aurver = STREQ(fields[2], "-") ? NULL : strdup(fields[2]);
+    entry->checked = strtol(fields[3], &token, 10);
+    if (*token != '\0' || hashtable_add(updates.entries, entry->name, entry) != 0) {
+      update_entry_free(entry);
+    }
   }
 
-finish:
-  yajl_free(yajl_hand);
-  curl_free(escaped);
-  FREE(parse_struct);
-  FREE(url);
+  cwr_printf(LOG_DEBUG, "loaded %zu update checks\n", updates.entries->count);
 
-  return pkglist;
+finish:
+  free(line);
+  if (fp) {
+    fclose(fp);
+  }
 } /* }}} */
 
-void *task_update(CURL *curl, void *arg) { /* {{{ */
-  pmpkg_t *pmpkg;
-  struct aurpkg_t *aurpkg;
-  void *dlretval, *qretval;
+void update_state_save() { /* {{{ */
+  char *path, *buf;
+  size_t len, n;
+  FILE *fp;
 
-  if (alpm_list_find_str(cfg.ignore.pkgs, arg)) {
-    return NULL;
+  if (!cfg.cachedir || !updates.dirty) {
+    return;
   }
 
-  cwr_printf(LOG_VERBOSE, "Checking %s%s%s for updates...\n",
-      colstr->pkg, (const char*)arg, colstr->nc);
+  if (!(fp = open_memstream(&buf, &len))) {
+    return;
+  }
 
-  qretval = task_query(curl, arg);
-  aurpkg = alpm_list_getdata(qretval);
-  if (aurpkg) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  for (n = 0; n < updates.entries->size; n++) {
+    const struct update_entry_t *entry = updates.entries->entries[n].value;
+    if (entry) {
+      fprintf(fp, "%s\t%s\t%s\t%ld\n", entry->name, entry->localver,
+          entry->aurver ? entry->aurver : "-", (long)entry->checked);
+    }
+  }
+  fclose(fp);
 
-    pthread_mutex_lock(&lock);
-    pmpkg = alpm_db_get_pkg(db_local, arg);
-    pthread_mutex_unlock(&lock);
+  cwr_asprintf(&path, "%s/updates", cfg.cachedir);
+  if (cache_write(path, buf, len) != 0) {
+    cwr_printf(LOG_DEBUG, "failed to save update checks: %s\n", strerror(errno));
+  }
+  free(path);
+  free(buf);
+} /* }}} */
 
-    if (!pmpkg) {
-      cwr_fprintf(stderr, LOG_WARN, "skipping uninstalled package %s\n",
-          (const char*)arg);
-      goto finish;
+/**
+ * Forgets whatever has been queued on a ring but not yet submitted.
+ */
+void uring_discard(struct uring_t *ring) { /* {{{ */
+  ring->tail -= ring->queued;
+  ring->queued = 0;
+} /* }}} */
+
+/**
+ * Submits everything queued on a ring and waits for all of it, passing each
+ * result to complete. Returns 1 if anything failed, or -1 if the ring itself
+ * did and can't be used again.
+ */
+int uring_flush(struct uring_t *ring, int (*complete)(void*, uint64_t, int),
+    void *arg) { /* {{{ */
+  struct io_uring_cqe *cqe;
+  unsigned head, pending = ring->queued;
+  long ret;
+  int failed = 0;
+
+  __atomic_store_n(ring->sqtail, ring->tail, __ATOMIC_RELEASE);
+
+  while (pending) {
+    ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, pending,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+    ring->syscalls++;
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cwr_printf(LOG_DEBUG, "io_uring_enter: %s\n", strerror(errno));
+      return -1;
+    }
+    ring->queued -= ret;
+
+    head = *ring->cqhead;
+    while (head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & *ring->cqmask];
+      failed |= complete(arg, cqe->user_data, cqe->res);
+      head++;
+      pending--;
     }
+    __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+  }
 
-    if (alpm_pkg_vercmp(aurpkg->ver, alpm_pkg_get_version(pmpkg)) > 0) {
-      if (cfg.opmask & OP_DOWNLOAD) {
-        /* we don't care about the return, but we do care about leaks */
-        dlretval = task_download(curl, (void*)aurpkg->name);
-        alpm_list_free_inner(dlretval, aurpkg_free);
-        alpm_list_free(dlretval);
-      } else {
-        if (cfg.quiet) {
-          printf("%s%s%s\n", colstr->pkg, (const char*)arg, colstr->nc);
-        } else {
-          cwr_printf(LOG_INFO, "%s%s %s%s%s -> %s%s%s\n",
-              colstr->pkg, (const char*)arg,
-              colstr->ood, alpm_pkg_get_version(pmpkg), colstr->nc,
-              colstr->utd, aurpkg->ver, colstr->nc);
-        }
-      }
+  return failed;
+} /* }}} */
 
-      return qretval;
-    }
+void uring_free(struct uring_t *ring) { /* {{{ */
+  if (!ring) {
+    return;
   }
 
-finish:
-  alpm_list_free_inner(qretval, aurpkg_free);
-  alpm_list_free(qretval);
-  return NULL;
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqessize);
+  }
+  if (ring->cqring) {
+    munmap(ring->cqring, ring->cqringsize);
+  }
+  if (ring->sqring) {
+    munmap(ring->sqring, ring->sqringsize);
+  }
+  close(ring->fd);
+  free(ring);
 } /* }}} */
 
-void *thread_pool(void *arg) { /* {{{ */
-  alpm_list_t *ret = NULL;
-  CURL *curl;
-  void *job;
-  struct task_t *task;
-  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Hands out the next free submission entry, cleared. The caller makes sure
+ * there is one.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring) { /* {{{ */
+  unsigned index = ring->tail & *ring->sqmask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
 
-  task = (struct task_t*)arg;
-  curl = curl_easy_init();
-  if (!curl) {
-    cwr_fprintf(stderr, LOG_ERROR, "curl: failed to initialize handle\n");
+  memset(sqe, 0, sizeof *sqe);
+  ring->sqarray[index] = index;
+  ring->tail++;
+  ring->queued++;
+
+  return sqe;
+} /* }}} */
+
+/**
+ * Sets up a ring for extraction, with a table of URING_FILES slots for files
+ * to be opened into. Returns NULL on kernels without io_uring, or without
+ * everything extraction needs from it.
+ */
+struct uring_t *uring_new(unsigned entries) { /* {{{ */
+  const int needed[] = {
+    IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE,
+    IORING_OP_MKDIRAT, IORING_OP_SYMLINKAT, IORING_OP_LINKAT
+  };
+  struct io_uring_params params;
+  struct io_uring_probe *probe = NULL;
+  struct uring_t *ring;
+  int files[URING_FILES];
+  size_t n;
+
+  CALLOC(ring, 1, sizeof *ring, return NULL);
+
+  memset(&params, 0, sizeof params);
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    cwr_printf(LOG_DEBUG, "io_uring unavailable: %s\n", strerror(errno));
+    free(ring);
     return NULL;
   }
 
-  while (1) {
-    /* try to pop off the work queue */
-    pthread_mutex_lock(&lock);
-    job = alpm_list_getdata(workq);
-    workq = alpm_list_next(workq);
-    pthread_mutex_unlock(&lock);
+  ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqessize, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqring == MAP_FAILED || ring->cqring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    cwr_printf(LOG_DEBUG, "failed to map io_uring: %s\n", strerror(errno));
+    ring->sqring = ring->sqring == MAP_FAILED ? NULL : ring->sqring;
+    ring->cqring = ring->cqring == MAP_FAILED ? NULL : ring->cqring;
+    ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+    goto fail;
+  }
 
-    /* make sure we hooked a new job */
-    if (!job) {
-      break;
+  ring->sqhead = (unsigned*)((char*)ring->sqring + params.sq_off.head);
+  ring->sqtail = (unsigned*)((char*)ring->sqring + params.sq_off.tail);
+  ring->sqmask = (unsigned*)((char*)ring->sqring + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned*)((char*)ring->sqring + params.sq_off.array);
+  ring->cqhead = (unsigned*)((char*)ring->cqring + params.cq_off.head);
+  ring->cqtail = (unsigned*)((char*)ring->cqring + params.cq_off.tail);
+  ring->cqmask = (unsigned*)((char*)ring->cqring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cqring + params.cq_off.cqes);
+  ring->tail = *ring->sqtail;
+
+  /* creating files and directories only came along in 5.15 */
+  CALLOC(probe, 1, sizeof *probe + IORING_OP_LAST * sizeof probe->ops[0], goto fail);
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe,
+        IORING_OP_LAST) < 0) {
+    cwr_printf(LOG_DEBUG, "failed to probe io_uring: %s\n", strerror(errno));
+    goto fail;
+  }
+  for (n = 0; n < sizeof needed / sizeof needed[0]; n++) {
+    if (needed[n] > probe->last_op || !(probe->ops[needed[n]].flags & IO_URING_OP_SUPPORTED)) {
+      cwr_printf(LOG_DEBUG, "io_uring lacks operation %d\n", needed[n]);
+      goto fail;
     }
+  }
 
-    ret = alpm_list_join(ret, task->threadfn(curl, job));
+  /* the slots start out empty */
+  for (n = 0; n < URING_FILES; n++) {
+    files[n] = -1;
+  }
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files,
+        URING_FILES) < 0) {
+    cwr_printf(LOG_DEBUG, "failed to register io_uring files: %s\n", strerror(errno));
+    goto fail;
   }
 
-  curl_easy_cleanup(curl);
+  free(probe);
+  return ring;
 
-  return ret;
+fail:
+  free(probe);
+  uring_free(ring);
+  return NULL;
 } /* }}} */
 
 void usage() { /* {{{ */
@@ -2274,33 +8411,147 @@ void usage() { /* {{{ */
       " Operations:\n"
       "  -d, --download          download target(s) -- pass twice to "
                                    "download AUR dependencies\n"
+      "      --deps-only         resolve AUR dependencies of target(s) without "
+                                   "downloading and print them in build order\n"
       "  -i, --info              show info for target(s) -- pass twice for "
                                    "more detail\n"
       "  -m, --msearch           show packages maintained by target(s)\n"
       "  -s, --search            search for target(s)\n"
       "  -u, --update            check for updates against AUR -- can be combined "
-                                   "with the -d flag\n\n");
+                                   "with the -d flag\n"
+      "      --complete <prefix> list AUR packages whose names start with prefix\n"
+      "      --complete-refresh  fetch the list of AUR package names used by\n"
+      "                            --complete\n\n");
   fprintf(stderr, " General options:\n"
+      "      --aurhost <host>    talk to host[:port] instead of " AUR_HOST_DEFAULT "\n"
+      "      --daemon            stay running, and answer requests from other\n"
+      "                            invocations of cower\n"
       "  -f, --force             overwrite existing files when downloading\n"
       "  -h, --help              display this help and exit\n"
       "      --ignore <pkg>      ignore a package upgrade (can be used more than once)\n"
       "      --ignorerepo <repo> ignore some or all binary repos\n"
+      "      --incremental[=<s>] only check packages for updates whose last check is\n"
+      "                            older than s seconds, or that changed since\n"
+      "      --link-cache <how>  fill download directories from the tarball cache\n"
+      "                            by `reflink'\n"
+      "      --no-daemon         do not hand this request to a running daemon\n"
       "      --nossl             do not use https connections\n"
-      "  -n, --comments          print comments from the AUR web interface (implies -ii)\n"
+      "      --record <dir>      save every response from the AUR to dir\n"
+      "      --replay <dir>      answer requests from responses saved with --record\n"
+      "                            instead of the network\n"
+      "      --replay-delay <ms> wait ms for each replayed response, rather than\n"
+      "                            as long as it originally took\n"
+      "  -n, --comments[=N]      print comments from the AUR web interface, at most N\n"
+      "                            if given (implies -ii)\n"
       "  -t, --target <dir>      specify an alternate download directory\n"
+      "      --targets-from <file>\n"
+      "                          read more targets from file, one per line, or from\n"
+      "                            stdin if file is `-'\n"
       "      --threads <num>     limit number of threads created\n"
       "      --timeout <num>     specify connection timeout in seconds\n"
+      "      --trace <file>      write a timeline of the run to file, in Chrome's\n"
+      "                            trace event format\n"
       "  -V, --version           display version\n\n");
   fprintf(stderr, " Output options:\n"
       "  -b, --brief             show output in a more script friendly format\n"
       "  -c, --color[=WHEN]      use colored output. WHEN is `never', `always', or `auto'\n"
       "      --debug             show debug output\n"
       "      --format <string>   print package output according to format string\n"
+      "      --json[=raw]        print each package as a line of JSON. with raw, pass\n"
+      "                            on the AUR's results as they are\n"
       "      --listdelim <delim> change list format delimeter\n"
       "  -q, --quiet             output less\n"
+      "      --stats[=FORMAT]    report request and phase timings on exit. FORMAT\n"
+      "                            is `text' or `json'\n"
       "  -v, --verbose           output more\n\n");
 } /* }}} */
 
+/**
+ * Decodes the UTF-8 sequence at str, storing its length in bytes in *bytes
+ * and returning the number of columns it occupies. Malformed sequences are
+ * treated as a single byte, one column wide.
+ */
+int utf8_charwidth(const char *str, int *bytes) { /* {{{ */
+  const unsigned char *s = (const unsigned char*)str;
+  unsigned int cp;
+  int i, len, lo, hi;
+
+  if (*s < 0x80) {
+    *bytes = 1;
+    return (*s < 0x20 || *s == 0x7F) ? 0 : 1;
+  } else if ((*s & 0xE0) == 0xC0) {
+    len = 2;
+    cp = *s & 0x1F;
+  } else if ((*s & 0xF0) == 0xE0) {
+    len = 3;
+    cp = *s & 0x0F;
+  } else if ((*s & 0xF8) == 0xF0) {
+    len = 4;
+    cp = *s & 0x07;
+  } else {
+    *bytes = 1;
+    return 1;
+  }
+
+  for (i = 1; i < len; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *bytes = 1;
+      return 1;
+    }
+    cp = (cp << 6) | (s[i] & 0x3F);
+  }
+  *bytes = len;
+
+  /* both tables are small enough that a binary search beats anything fancier */
+  lo = 0;
+  hi = sizeof(zero_width_chars) / sizeof(zero_width_chars[0]) - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < zero_width_chars[mid].first) {
+      hi = mid - 1;
+    } else if (cp > zero_width_chars[mid].last) {
+      lo = mid + 1;
+    } else {
+      return 0;
+    }
+  }
+
+  lo = 0;
+  hi = sizeof(wide_chars) / sizeof(wide_chars[0]) - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < wide_chars[mid].first) {
+      hi = mid - 1;
+    } else if (cp > wide_chars[mid].last) {
+      lo = mid + 1;
+    } else {
+      return 2;
+    }
+  }
+
+  return 1;
+} /* }}} */
+
+int utf8_strwidth(const char *str, size_t len) { /* {{{ */
+  const char *p, *end = str + len;
+  int bytes, width = 0;
+
+  for (p = str; p < end; p += bytes) {
+    /* plain ascii is by far the common case */
+    if ((unsigned char)*p >= 0x20 && (unsigned char)*p < 0x7F) {
+      bytes = 1;
+      width++;
+      continue;
+    }
+    width += utf8_charwidth(p, &bytes);
+    if (p + bytes > end) {
+      break;
+    }
+  }
+
+  return width;
+} /* }}} */
+
 void version() { /* {{{ */
   printf("\n  " COWER_VERSION "\n");
   printf("     \\\n"
@@ -2314,19 +8565,152 @@ void version() { /* {{{ */
          "             Cower....\n\n");
 } /* }}} */
 
+/**
+ * Stops workers waiting for more jobs once the queue runs dry.
+ */
+void workqueue_close(struct workqueue_t *queue) { /* {{{ */
+  trace_mutex_lock(&queue->lock, "workq_lock");
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->ready);
+  pthread_cond_broadcast(&queue->done);
+  pthread_mutex_unlock(&queue->lock);
+} /* }}} */
+
+void workqueue_finish(struct workqueue_t *queue, struct job_t *job, alpm_list_t *results) { /* {{{ */
+  trace_mutex_lock(&queue->lock, "workq_lock");
+  job->results = results;
+  job->done = 1;
+  if (job == queue->head) {
+    pthread_cond_signal(&queue->done);
+  }
+  pthread_mutex_unlock(&queue->lock);
+} /* }}} */
+
+/**
+ * Keeps a queue from running dry while something else may still push to
+ * it, even once it's closed.
+ */
+void workqueue_hold(struct workqueue_t *queue) { /* {{{ */
+  trace_mutex_lock(&queue->lock, "workq_lock");
+  queue->held++;
+  pthread_mutex_unlock(&queue->lock);
+} /* }}} */
+
+/**
+ * Queues a job for target. With wait, this blocks for as long as the queue
+ * already holds as many jobs as it's allowed to.
+ */
+int workqueue_push(struct workqueue_t *queue, const char *target, int wait) { /* {{{ */
+  struct job_t *job;
+  double start = now_ms();
+
+  CALLOC(job, 1, sizeof *job, return 1);
+  job->target = target;
+  job->outtail = &job->output;
+
+  trace_mutex_lock(&queue->lock, "workq_lock");
+  while (wait && queue->count >= queue->depth) {
+    pthread_cond_wait(&queue->room, &queue->lock);
+  }
+
+  if (queue->tail) {
+    queue->tail->next = job;
+  } else {
+    queue->head = job;
+    pthread_cond_signal(&queue->done);
+  }
+  queue->tail = job;
+  if (!queue->pending) {
+    queue->pending = job;
+  }
+  queue->count++;
+  queue_stat_push(&queue->stat, queue->count, now_ms() - start);
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+} /* }}} */
+
+void workqueue_release(struct workqueue_t *queue) { /* {{{ */
+  trace_mutex_lock(&queue->lock, "workq_lock");
+  if (--queue->held == 0) {
+    pthread_cond_broadcast(&queue->ready);
+    pthread_cond_broadcast(&queue->done);
+  }
+  pthread_mutex_unlock(&queue->lock);
+} /* }}} */
+
+/**
+ * Takes the oldest job off the queue once it's finished, waiting for it if
+ * need be. Returns NULL once the queue is closed and empty.
+ */
+struct job_t *workqueue_retire(struct workqueue_t *queue) { /* {{{ */
+  struct job_t *job;
+
+  trace_mutex_lock(&queue->lock, "workq_lock");
+  while (!(queue->head && queue->head->done) &&
+      !(queue->closed && !queue->held && !queue->head)) {
+    pthread_cond_wait(&queue->done, &queue->lock);
+  }
+
+  if ((job = queue->head)) {
+    queue->head = job->next;
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+    queue->count--;
+    pthread_cond_signal(&queue->room);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+} /* }}} */
+
+/**
+ * Hands a worker its next job, waiting for one to be queued if need be.
+ * Returns NULL once the queue is closed and has nothing left to hand out.
+ */
+struct job_t *workqueue_take(struct workqueue_t *queue) { /* {{{ */
+  struct job_t *job;
+
+  trace_mutex_lock(&queue->lock, "workq_lock");
+  while (!queue->pending && !(queue->closed && !queue->held)) {
+    pthread_cond_wait(&queue->ready, &queue->lock);
+  }
+
+  if ((job = queue->pending)) {
+    queue->pending = job->next;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return job;
+} /* }}} */
+
 size_t yajl_parse_stream(void *ptr, size_t size, size_t nmemb, void *stream) { /* {{{ */
-  struct yajl_handle_t *hand;
+  struct yajl_parser_t *parse_struct;
   size_t realsize = size * nmemb;
+  double start = now_ms();
 
-  hand = (struct yajl_handle_t*)stream;
-  yajl_parse(hand, ptr, realsize);
+  parse_struct = (struct yajl_parser_t*)stream;
+  yajl_parse(parse_struct->handle, ptr, realsize);
+  parse_struct->parsetime += now_ms() - start;
 
   return realsize;
 } /* }}} */
 
-int main(int argc, char *argv[]) {
-  alpm_list_t *results = NULL, *thread_return = NULL;
-  int ret, n, num_threads;
+/**
+ * Does everything asked of a single invocation. A daemon runs this once per
+ * request, so every bit of state it relies on is set up afresh here.
+ */
+int cower_run(int argc, char *argv[]) {
+  alpm_list_t *results = NULL;
+  const alpm_list_t *i;
+  int ret, n, num_threads, num_targets, needsync, needlocal, indexing = 0;
+  int reading = 0, streaming, found = 0;
+  pthread_t indexer, reader;
+  FILE *targetsfp = NULL;
+  struct job_t *job;
+  double printstart;
   pthread_attr_t attr;
   pthread_t *threads;
   struct task_t task = {
@@ -2334,11 +8718,16 @@ int main(int argc, char *argv[]) {
     .threadfn = task_query
   };
 
-  setlocale(LC_ALL, "");
+  startup = now_ms();
+  dlerrors = rawresults = 0;
+  termwidth_stale = 1;
+  transport = &transports[0];
+  optind = 0;
 
   /* initialize config */
   memset(&cfg, 0, sizeof cfg);
-  cfg.color = cfg.maxthreads = cfg.timeout = UNSET;
+  cfg.color = cfg.maxthreads = cfg.timeout = cfg.replaydelay = UNSET;
+  cfg.tarballcache = UNSET;
   cfg.delim = LIST_DELIM;
   cfg.logmask = LOG_ERROR|LOG_WARN|LOG_INFO; 
   cfg.proto = "https";
@@ -2351,57 +8740,184 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, "error: no operation specified (use -h for help)\n");
     case 1: /* these provide their own error mesg */
     case 2:
-      return ret;
+      goto cleanup;
   }
 
   if ((ret = parse_configfile() != 0)) {
-    return ret;
+    goto cleanup;
   }
+  debug_phase("configuration parsed");
+  trace_thread_name("main");
 
   /* fallback from sentinel values */
   cfg.maxthreads = cfg.maxthreads == UNSET ? THREAD_DEFAULT : cfg.maxthreads;
   cfg.timeout = cfg.timeout == UNSET ? TIMEOUT_DEFAULT : cfg.timeout;
   cfg.color = cfg.color == UNSET ? 0 : cfg.color;
+  cfg.tarballcache = cfg.tarballcache == UNSET ? TARBALL_CACHE_DEFAULT : cfg.tarballcache;
+  if (!cfg.aurhost) {
+    cfg.aurhost = strdup(AUR_HOST_DEFAULT);
+  }
 
   if ((ret = strings_init()) != 0) {
-    return ret;
+    goto cleanup;
   }
 
-  if ((ret = set_working_dir()) != 0) {
+  /* completion is answered within a keypress from the cache alone, so
+   * nothing else needs setting up for it */
+  if (cfg.opmask & OP_COMPLETE) {
+    cache_init();
+    if (!cfg.completerefresh) {
+      ret = complete_names(cfg.complete);
+      goto finish;
+    }
+  }
+
+  if (cfg.format && (ret = format_compile(cfg.format)) != 0) {
     goto finish;
   }
 
-  cwr_printf(LOG_DEBUG, "initializing curl\n");
-  if (STREQ(cfg.proto, "https")) {
-    ret = curl_global_init(CURL_GLOBAL_SSL);
-    openssl_crypto_init();
-  } else {
-    ret = curl_global_init(CURL_GLOBAL_NOTHING);
+  if ((ret = transport_init()) != 0) {
+    goto finish;
   }
-  if (ret != 0) {
-    cwr_fprintf(stderr, LOG_ERROR, "failed to initialize curl\n");
+
+  if (cfg.opmask & OP_COMPLETE) {
+    ret = complete_refresh();
+    if (ret == 0 && cfg.complete) {
+      ret = complete_names(cfg.complete);
+    }
     goto finish;
   }
 
-  if ((ret = alpm_init()) != 0) {
-    cwr_fprintf(stderr, LOG_ERROR, "failed to initialize alpm library\n");
+  if (isatty(fileno(stdout))) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigwinch_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+  }
+
+  if ((ret = set_working_dir()) != 0) {
+    goto finish;
+  }
+
+  /* stdin is read through a stream of its own, so that a daemon's stdin
+   * doesn't carry anything over from one request to the next */
+  if (cfg.targetsfrom) {
+    if (STREQ(cfg.targetsfrom, "-")) {
+      n = dup(STDIN_FILENO);
+      targetsfp = n < 0 ? NULL : fdopen(n, "r");
+    } else {
+      targetsfp = fopen(cfg.targetsfrom, "r");
+    }
+    if (!targetsfp) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to open %s: %s\n", cfg.targetsfrom,
+          strerror(errno));
+      ret = 1;
+      goto finish;
+    }
+  }
+
+  /* an update without targets finds its own, anything else has nothing to
+   * do without them */
+  if (!cfg.targets && !targetsfp && !(cfg.opmask & OP_UPDATE)) {
+    fprintf(stderr, "error: no targets specified (use -h for help)\n");
     goto finish;
   }
 
+  /* every operation from here on talks to the AUR */
+  pthread_once(&curl_once, curl_global_setup);
+
+  /* so get connected while the rest of startup happens. a replay never
+   * goes near the network, and a daemon already has connections to hand
+   * out */
+  if (!cfg.replaydir && !server.active &&
+      pthread_create(&prewarm.thread, NULL, curl_prewarm, NULL) == 0) {
+    prewarm.started = 1;
+  }
+
+  /* not fatal: cower works just the same without a cache */
+  cache_init();
+  debug_phase("cache ready");
+
+  /* only touch the dbs an operation actually needs. the sync dbs are for
+   * finding foreign packages and for skipping repo packages when
+   * downloading. the local db is for anything annotated with what's
+   * installed, which quiet searches and --format never are */
+  needsync = (cfg.opmask & OP_DOWNLOAD) ||
+    ((cfg.opmask & OP_UPDATE) && !cfg.targets && !cfg.targetsfrom);
+  needlocal = (cfg.opmask & (OP_UPDATE|OP_DOWNLOAD)) ||
+    ((cfg.opmask & OP_INFO) && !cfg.format && cfg.json != JSON_RAW) ||
+    ((cfg.opmask & (OP_SEARCH|OP_MSEARCH)) && !cfg.format && !cfg.quiet &&
+     cfg.json != JSON_RAW);
+
+  if (server.active) {
+    if ((ret = daemon_alpm_refresh()) != 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to initialize alpm library\n");
+      goto finish;
+    }
+  } else if (needsync || needlocal) {
+    double start = now_ms();
+    alpm_ready = 1;
+    if ((ret = alpm_init(needsync)) != 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to initialize alpm library\n");
+      goto finish;
+    }
+    stats_add_phase(STAT_PHASE_ALPM, now_ms() - start);
+    trace_end("alpm", "alpm init", NULL, start);
+    debug_phase("alpm initialized");
+  }
+
   /* allow specific updates to be provided instead of examining all foreign pkgs */
-  if ((cfg.opmask & OP_UPDATE) && !cfg.targets) {
-    cfg.targets = alpm_find_foreign_pkgs();
+  if ((cfg.opmask & OP_UPDATE) && !cfg.targets && !cfg.targetsfrom) {
+    if (cache_get_foreign(&cfg.targets) != 0) {
+      cfg.targets = alpm_find_foreign_pkgs();
+      cache_put_foreign(cfg.targets);
+    }
+    debug_phase("foreign packages found");
+  }
+
+  /* every check is remembered, whether or not this one is incremental */
+  if (cfg.opmask & OP_UPDATE) {
+    update_state_load();
+    if (cfg.incremental && updates.entries && updates.entries->count) {
+      update_feed_fetch();
+    }
+  }
+
+  /* cached dependency closures are checked against the same feed */
+  if (cfg.depsonly && cfg.cachedir) {
+    update_feed_fetch();
   }
 
-  workq = cfg.targets;
-  num_threads = alpm_list_count(cfg.targets);
-  if (num_threads == 0) {
+  /* a build order can only be worked out once every target is resolved,
+   * and a search filters the results of all of its targets together. JSON
+   * is streamed whenever it can be */
+  streaming = (targetsfp || cfg.json) && !cfg.depsonly && !(cfg.opmask & OP_SEARCH);
+
+  num_threads = num_targets = alpm_list_count(cfg.targets);
+  if (num_threads == 0 && !targetsfp) {
     fprintf(stderr, "error: no targets specified (use -h for help)\n");
     goto finish;
-  } else if (num_threads > cfg.maxthreads) {
+  } else if (targetsfp || num_threads > cfg.maxthreads) {
     num_threads = cfg.maxthreads;
   }
 
+  /* targets read from a file only get so far ahead of the output. the ones
+   * already in hand are all queued up front */
+  workq.pending = workq.tail = NULL;
+  workq.count = 0;
+  workq.depth = num_threads * WORKQ_JOBS_PER_THREAD;
+  workq.closed = workq.held = 0;
+  workq.ordered = streaming || cfg.json;
+  memset(&workq.stat, 0, sizeof workq.stat);
+  targets_claimed = hashtable_new(num_targets);
+  for (i = cfg.targets; i; i = alpm_list_next(i)) {
+    if (targets_claimed) {
+      hashtable_add(targets_claimed, alpm_list_getdata(i), NULL);
+    }
+    workqueue_push(&workq, alpm_list_getdata(i), 0);
+  }
+
   CALLOC(threads, num_threads, sizeof *threads, goto finish);
 
   pthread_attr_init(&attr);
@@ -2410,6 +8926,11 @@ int main(int argc, char *argv[]) {
   /* override task behavior */
   if (cfg.opmask & OP_UPDATE) {
     task.threadfn = task_update;
+    task.printfn = cfg.json ? print_pkg_json : NULL;
+  } else if (cfg.json == JSON_RAW) {
+    /* task_query prints the results itself */
+  } else if (cfg.json) {
+    task.printfn = print_pkg_json;
   } else if (cfg.opmask & OP_INFO) {
     task.printfn = cfg.format ? print_pkg_formatted : print_pkg_info;
   } else if (cfg.opmask & (OP_SEARCH|OP_MSEARCH)) {
@@ -2418,24 +8939,125 @@ int main(int argc, char *argv[]) {
     task.threadfn = task_download;
   }
 
-  /* filthy, filthy hack: prepopulate the package cache */
-  alpm_db_get_pkgcache(db_local);
+  /* the indexes have to be complete before any worker looks at them.
+   * downloads check every target against the sync dbs, and only an update
+   * working from the foreign package cache can do without the local db */
+  if (needlocal && (!foreign_versions || (cfg.opmask & OP_DOWNLOAD))) {
+    if (cfg.opmask & (OP_UPDATE|OP_DOWNLOAD)) {
+      if (alpm_index_dbs(cfg.opmask & OP_DOWNLOAD) != 0) {
+        cwr_fprintf(stderr, LOG_ERROR, "failed to index databases\n");
+        ret = 1;
+        goto finish;
+      }
+      debug_phase("databases indexed");
+    } else if (pthread_create(&indexer, NULL, alpm_index_worker, (void*)0) == 0) {
+      /* searches only look at the local db once the results are printed,
+       * so it can load while the workers wait on the network */
+      indexing = 1;
+    } else if (alpm_index_dbs(0) != 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to index databases\n");
+      ret = 1;
+      goto finish;
+    }
+  }
+
+  /* from here until the workers are done, logging goes through a writer
+   * thread. not fatal: without one, messages are written directly */
+  log_start();
+
+  if ((cfg.opmask & OP_DOWNLOAD) && !cfg.depsonly) {
+    pipeline_start();
+    if (!pipeline.active) {
+      ret = 1;
+      goto finish;
+    }
+  }
 
   for (n = 0; n < num_threads; n++) {
     ret = pthread_create(&threads[n], &attr, thread_pool, &task);
     if (ret != 0) {
       cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n",
           strerror(ret));
-      return(ret); /* we don't want to recover from this */
+      break;
     }
     cwr_printf(LOG_DEBUG, "[%p]: spawned\n", (void*)threads[n]);
   }
+  if (ret != 0) {
+    /* we don't want to recover from this, but a daemon has to carry on, so
+     * the workers already running see out their jobs and nothing more */
+    trace_mutex_lock(&workq.lock, "workq_lock");
+    workq.pending = NULL;
+    pthread_mutex_unlock(&workq.lock);
+    workqueue_close(&workq);
+    while (n--) {
+      pthread_join(threads[n], NULL);
+    }
+    if (pipeline.active) {
+      pipeline_stop();
+    }
+    free(threads);
+    pthread_attr_destroy(&attr);
+    goto finish;
+  }
+  debug_phase("workers started");
+
+  if (targetsfp) {
+    ret = pthread_create(&reader, NULL, targets_reader, targetsfp);
+    if (ret != 0) {
+      cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n",
+          strerror(ret));
+    }
+    reading = ret == 0;
+  }
+  if (!reading) {
+    workqueue_close(&workq);
+  }
+
+  /* jobs are retired in the order they were queued, whichever order they
+   * finish in. streamed output is printed as each job's turn comes, and
+   * everything else waits for the lot */
+  while ((job = workqueue_retire(&workq))) {
+    job_replay(job);
+    if (streaming) {
+      /* printing checks each package against the local db, so the index
+       * has to be complete before the first one goes out */
+      if (indexing && job->results) {
+        alpm_index_join(indexer);
+        indexing = 0;
+      }
+      if (job->results) {
+        found = 1;
+        print_results(job->results, task.printfn);
+        alpm_list_free_inner(job->results, aurpkg_free);
+        alpm_list_free(job->results);
+      }
+      fflush(stdout);
+    } else {
+      results = alpm_list_join(results, job->results);
+    }
+    free(job);
+  }
 
   for (n = 0; n < num_threads; n++) {
-    pthread_join(threads[n], (void**)&thread_return);
+    pthread_join(threads[n], NULL);
     cwr_printf(LOG_DEBUG, "[%p]: joined\n", (void*)threads[n]);
-    results = alpm_list_join(results, thread_return);
   }
+  if (reading) {
+    pthread_join(reader, NULL);
+    reading = 0;
+  }
+  if (pipeline.active) {
+    pipeline_stop();
+    cwr_printf(LOG_DEBUG, "queue depths: fetch max %zu, extract max %zu, resolve max %zu\n",
+        workq.stat.maxdepth, pipeline.extract.stat.maxdepth, pipeline.resolve.stat.maxdepth);
+  }
+  debug_phase("workers finished");
+
+  if (indexing) {
+    alpm_index_join(indexer);
+    indexing = 0;
+  }
+  log_flush();
 
   free(threads);
   pthread_attr_destroy(&attr);
@@ -2445,29 +9067,147 @@ int main(int argc, char *argv[]) {
    * b) update (without download) returns something
    * this is opposing behavior, so just XOR the result on a pure update */
   results = filter_results(results);
-  ret = ((results == NULL) ^ !(cfg.opmask & ~OP_UPDATE));
-  print_results(results, task.printfn);
+  ret = ((results == NULL && !found && !rawresults) ^ !(cfg.opmask & ~OP_UPDATE));
+  printstart = now_ms();
+  if (!found && !rawresults) {
+    print_results(results, task.printfn);
+  }
+  if (cfg.depsonly) {
+    print_build_order(results);
+
+    /* a closure is only worth remembering if every part of it resolved */
+    for (i = cfg.targets, n = 0; i && n < num_targets && !dlerrors; i = alpm_list_next(i), n++) {
+      const alpm_list_t *j;
+      for (j = results; j; j = alpm_list_next(j)) {
+        struct aurpkg_t *pkg = alpm_list_getdata(j);
+        if (STREQ(pkg->name, alpm_list_getdata(i))) {
+          cache_put_closure(pkg, results);
+          break;
+        }
+      }
+    }
+  }
   alpm_list_free_inner(results, aurpkg_free);
   alpm_list_free(results);
-
-  openssl_crypto_cleanup();
+  stats_add_phase(STAT_PHASE_OUTPUT, now_ms() - printstart);
+  trace_end("output", "output", NULL, printstart);
+  debug_phase("results printed");
 
 finish:
+  if (indexing) {
+    pthread_join(indexer, NULL);
+  }
+  if (targetsfp) {
+    fclose(targetsfp);
+  }
+  /* jobs are only left behind when the workers never got going, or were
+   * cut short */
+  while ((job = workq.head)) {
+    workq.head = job->next;
+    job_replay(job);
+    alpm_list_free_inner(job->results, aurpkg_free);
+    alpm_list_free(job->results);
+    free(job);
+  }
+  workq.tail = NULL;
+  log_flush();
+  if (prewarm.started) {
+    /* a connection no worker took is given up on */
+    __sync_lock_test_and_set(&prewarm.abort, 1);
+    pthread_join(prewarm.thread, NULL);
+    if (prewarm.handle) {
+      curl_easy_cleanup(prewarm.handle);
+      prewarm.handle = NULL;
+    }
+    prewarm.started = prewarm.abort = 0;
+  }
+
+  stats_print();
+  stats_free();
+  if (cfg.tracefile && trace_write() != 0) {
+    ret = 1;
+  }
+
+  if (cfg.incremental) {
+    cwr_printf(LOG_DEBUG, "%zu packages answered from their last check\n", updates.cached);
+  }
+  update_state_save();
+  if (cfg.opmask & OP_DOWNLOAD) {
+    cache_trim();
+  }
+
+  /* a request turned down before it got going has only its options to
+   * give back */
+cleanup:
+  hashtable_free(updates.entries, update_entry_free);
+  hashtable_free(updates.modified, free);
+  updates.entries = updates.modified = NULL;
+  updates.cached = updates.dirty = 0;
+
+  transport_cleanup();
+  hashtable_free(foreign_versions, free);
+  foreign_versions = NULL;
+  hashtable_free(targets_claimed, NULL);
+  targets_claimed = NULL;
+  format_free();
+  FREE(outbuf.data);
+  outbuf.size = outbuf.len = 0;
+  FREE(cfg.aurhost);
+  FREE(cfg.cachedir);
   FREE(cfg.dlpath);
   FREELIST(cfg.targets);
   FREELIST(cfg.ignore.pkgs);
   FREELIST(cfg.ignore.repos);
   FREE(colstr);
 
-  cwr_printf(LOG_DEBUG, "releasing curl\n");
-  curl_global_cleanup();
+  /* a daemon keeps all of this for the next request */
+  if (server.active) {
+    return ret;
+  }
+
+  provider_index_free(&local_index);
+  provider_index_free(&sync_index);
+
+  if (curl_ready == 1) {
+    cwr_printf(LOG_DEBUG, "releasing curl\n");
+    if (curl_share) {
+      curl_share_cleanup(curl_share);
+    }
+    openssl_crypto_cleanup();
+    curl_global_cleanup();
+  }
 
-  cwr_printf(LOG_DEBUG, "releasing alpm\n");
-  alpm_release();
+  if (alpm_ready) {
+    cwr_printf(LOG_DEBUG, "releasing alpm\n");
+    alpm_release();
+  }
 
   return ret;
 }
 
+int main(int argc, char *argv[]) {
+  int i, ret, usedaemon = 1;
+
+  setlocale(LC_ALL, "");
+  umask_read();
+
+  /* being a daemon, or using one, is settled before any options are parsed,
+   * since a daemon parses them for its clients */
+  for (i = 1; i < argc && !STREQ(argv[i], "--"); i++) {
+    if (STREQ(argv[i], "--daemon")) {
+      return daemon_main(argc, argv);
+    } else if (STREQ(argv[i], "--no-daemon")) {
+      usedaemon = 0;
+    }
+  }
+
+  if (usedaemon && (ret = daemon_client(argc, argv)) >= 0) {
+    return ret;
+  }
+
+  return cower_run(argc, argv);
+}
+
 /* vim: set et sw=2: */
 /* Local Variables: */
 /* c-basic-offset:2 */